@@ -0,0 +1,91 @@
+/* Microbenchmark of bus_handle_io: how fast an exit finds its device on a
+ * bus of 2, 32 and 256 devices, compared with a linear scan of the same
+ * devices (the lookup the bus used to do). Run with `make bench`.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bus.h"
+
+#define LOOKUPS 20000000
+/* Accesses in a row to one device in the bursty pattern. */
+#define BURST 64
+#define DEV_LEN 0x1000
+
+static void dev_io(void *owner,
+                   void *data,
+                   uint8_t is_write,
+                   uint64_t offset,
+                   uint8_t size)
+{
+    ((struct dev *) owner)->accesses++;
+}
+
+static struct dev *linear_find(struct dev *devs, int n, uint64_t addr)
+{
+    for (int i = 0; i < n; i++) {
+        if (addr - devs[i].base < devs[i].len)
+            return &devs[i];
+    }
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(int nr_devs, bool bursty)
+{
+    struct dev *devs = calloc(nr_devs, sizeof(*devs));
+    uint64_t *addrs = malloc(LOOKUPS * sizeof(*addrs));
+    struct bus bus;
+    uint32_t data = 0;
+
+    bus_init(&bus);
+    /* Registered in reverse so that the sorted insert does some work. */
+    for (int i = nr_devs - 1; i >= 0; i--) {
+        dev_init(&devs[i], 0x10000000 + (uint64_t) i * 2 * DEV_LEN, DEV_LEN,
+                 &devs[i], dev_io);
+        bus_register_dev(&bus, &devs[i]);
+    }
+    srand(1);
+    int target = 0;
+    for (int i = 0; i < LOOKUPS; i++) {
+        if (!bursty || i % BURST == 0)
+            target = rand() % nr_devs;
+        addrs[i] = devs[target].base + (rand() % (DEV_LEN / 4)) * 4;
+    }
+
+    double t = now();
+    for (int i = 0; i < LOOKUPS; i++) {
+        struct dev *dev = linear_find(devs, nr_devs, addrs[i]);
+        dev->do_io(dev->owner, &data, 0, addrs[i] - dev->base, 4);
+    }
+    double linear = LOOKUPS / (now() - t) / 1e6;
+
+    t = now();
+    for (int i = 0; i < LOOKUPS; i++)
+        bus_handle_io(&bus, &data, 0, addrs[i], 4);
+    double sorted = LOOKUPS / (now() - t) / 1e6;
+
+    printf("%3d devices, %-6s: linear %6.1f M/s, bus %6.1f M/s\n", nr_devs,
+           bursty ? "bursts" : "random", linear, sorted);
+    bus_exit(&bus);
+    free(addrs);
+    free(devs);
+}
+
+int main(void)
+{
+    static const int sizes[] = {2, 32, 256};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        run(sizes[i], false);
+        run(sizes[i], true);
+    }
+    return 0;
+}
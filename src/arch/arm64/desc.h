@@ -1,6 +1,8 @@
 #pragma once
 
 #define RAM_BASE (1UL << 31)
+/* The kernel, initrd and FDT windows take the first 258 MiB of RAM. */
+#define RAM_SIZE_MIN (512ULL << 20)
 
 /* GIC SPIs (offset by ARM_GIC_SPI_BASE inside vm_irq_line). Distinct lines per
  * device so a level-triggered ARM GIC can de-assert per source rather than
@@ -29,9 +29,14 @@
 #define ARM_GIC_DIST_BASE ARM_GIC_BASE
 #define ARM_GIC_DIST_SIZE KVM_VGIC_V3_DIST_SIZE
 
+/* GICv3 redistributors are laid out back to back, one frame of
+ * ARM_GIC_REDIST_CPUI_SIZE per vCPU. VM_MAX_VCPUS of them end well below 16M.
+ */
 #define ARM_GIC_REDIST_CPUI_BASE (ARM_GIC_DIST_BASE + ARM_GIC_DIST_SIZE)
 #define ARM_GIC_REDIST_CPUI_SIZE KVM_VGIC_V3_REDIST_SIZE
 
+#define ARM_GIC_V2_MAX_CPUS 8
+
 #define ARM_PCI_CFG_BASE 0x40000000UL
 #define ARM_PCI_CFG_SIZE (1UL << 16)
 
@@ -6,6 +6,7 @@
 #include <linux/kvm.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
 
@@ -60,6 +61,11 @@ static int create_irqchip(vm_t *v)
         priv->gic_type = IRQCHIP_TYPE_GIC_V2;
     }
 
+    if (priv->gic_type == IRQCHIP_TYPE_GIC_V2 &&
+        v->cfg.nr_vcpus > ARM_GIC_V2_MAX_CPUS)
+        return throw_err("GICv2 supports at most %d vCPUs\n",
+                         ARM_GIC_V2_MAX_CPUS);
+
     priv->gic_fd = device.fd;
 
     if (ioctl(priv->gic_fd, KVM_SET_DEVICE_ATTR, &dist_attr) < 0)
@@ -86,7 +92,7 @@ int vm_arch_init(vm_t *v)
     return 0;
 }
 
-int vm_arch_cpu_init(vm_t *v)
+int vm_arch_cpu_init(vm_t *v, vcpu_t *vcpu)
 {
     struct kvm_vcpu_init vcpu_init;
     if (ioctl(v->vm_fd, KVM_ARM_PREFERRED_TARGET, &vcpu_init) < 0)
@@ -99,7 +105,13 @@ int vm_arch_cpu_init(vm_t *v)
      */
     vcpu_init.features[0] |= 1 << KVM_ARM_VCPU_PSCI_0_2;
 
-    if (ioctl(v->vcpu_fd, KVM_ARM_VCPU_INIT, &vcpu_init))
+    /* Secondary CPUs start powered off and are released by the guest with
+     * PSCI CPU_ON, which KVM's PSCI emulation handles without an exit.
+     */
+    if (vcpu->id != 0)
+        vcpu_init.features[0] |= 1 << KVM_ARM_VCPU_POWER_OFF;
+
+    if (ioctl(vcpu->fd, KVM_ARM_VCPU_INIT, &vcpu_init))
         return throw_err("Failed to initialize vCPU\n");
 
     return 0;
@@ -178,7 +190,7 @@ typedef struct {
     uint32_t res5;        /* reserved (used for PE COFF offset) */
 } arm64_kernel_header_t;
 
-int vm_arch_load_image(vm_t *v, void *data, size_t datasz)
+int vm_arch_load_image(vm_t *v, int fd, void *data, size_t datasz)
 {
     vm_arch_priv_t *priv = (vm_arch_priv_t *) v->priv;
 
@@ -198,16 +210,18 @@ int vm_arch_load_image(vm_t *v, void *data, size_t datasz)
     }
 
     void *dest = vm_guest_to_host(v, ARM_KERNEL_BASE + offset);
-    memmove(dest, data, datasz);
+    if (vm_load_range(v, dest, fd, data, 0, datasz) < 0)
+        return -1;
     priv->entry = ARM_KERNEL_BASE + offset;
     return 0;
 }
 
-int vm_arch_load_initrd(vm_t *v, void *data, size_t datasz)
+int vm_arch_load_initrd(vm_t *v, int fd, void *data, size_t datasz)
 {
     vm_arch_priv_t *priv = (vm_arch_priv_t *) v->priv;
     void *dest = vm_guest_to_host(v, ARM_INITRD_BASE);
-    memmove(dest, data, datasz);
+    if (vm_load_range(v, dest, fd, data, 0, datasz) < 0)
+        return -1;
     priv->initrdsz = datasz;
     return 0;
 }
@@ -219,13 +233,13 @@ int vm_arch_load_initrd(vm_t *v, void *data, size_t datasz)
 #define ARM_MPIDR_BITMASK 0xFF00FFFFFFUL
 #define ARM_MPIDR_REG_ID ARM64_SYS_REG(3, 0, 0, 0, 5)
 
-static int get_mpidr(vm_t *v, uint64_t *mpidr)
+static int get_mpidr(vcpu_t *vcpu, uint64_t *mpidr)
 {
     struct kvm_one_reg reg;
     reg.addr = (uint64_t) mpidr;
     reg.id = ARM_MPIDR_REG_ID;
 
-    if (ioctl(v->vcpu_fd, KVM_GET_ONE_REG, &reg) < 0)
+    if (ioctl(vcpu->fd, KVM_GET_ONE_REG, &reg) < 0)
         return throw_err("Failed to get MPIDR register\n");
 
     *mpidr &= ARM_MPIDR_BITMASK;
@@ -301,8 +315,13 @@ static int generate_fdt(vm_t *v)
     /* Create /memory node */
     __FDT(begin_node, "memory");
     __FDT(property_string, "device_type", "memory");
-    uint64_t mem_reg[2] = {cpu_to_fdt64(RAM_BASE), cpu_to_fdt64(RAM_SIZE)};
-    __FDT(property, "reg", mem_reg, sizeof(mem_reg));
+    uint64_t mem_reg[2 * VM_MAX_MEM_REGIONS];
+    for (int i = 0; i < v->nr_mem_regions; i++) {
+        mem_reg[2 * i] = cpu_to_fdt64(v->mem_regions[i].gpa);
+        mem_reg[2 * i + 1] = cpu_to_fdt64(v->mem_regions[i].size);
+    }
+    __FDT(property, "reg", mem_reg,
+          2 * v->nr_mem_regions * sizeof(mem_reg[0]));
     __FDT(end_node); /* End of /memory node */
 
     /* Create /cpus node */
@@ -310,16 +329,21 @@ static int generate_fdt(vm_t *v)
     /* /cpus node headers */
     __FDT(property_cell, "#address-cells", 0x1);
     __FDT(property_cell, "#size-cells", 0x0);
-    /* The only one CPU */
-    __FDT(begin_node, "cpu"); /* Create /cpus/cpu subnode */
-    uint64_t mpidr;
-    if (get_mpidr(v, &mpidr) < 0)
-        return -1;
-    __FDT(property_cell, "reg", mpidr);
-    __FDT(property_string, "device_type", "cpu");
-    __FDT(property_string, "compatible", "arm,arm-v8");
-    __FDT(end_node); /* End of /cpus/cpu */
-    __FDT(end_node); /* End of /cpu */
+    /* One /cpus/cpu@N subnode per vCPU, addressed by its MPIDR */
+    for (int i = 0; i < v->cfg.nr_vcpus; i++) {
+        uint64_t mpidr;
+        char name[16];
+        if (get_mpidr(&v->vcpus[i], &mpidr) < 0)
+            return -1;
+        snprintf(name, sizeof(name), "cpu@%llx", (unsigned long long) mpidr);
+        __FDT(begin_node, name); /* Create /cpus/cpu@N subnode */
+        __FDT(property_cell, "reg", mpidr);
+        __FDT(property_string, "device_type", "cpu");
+        __FDT(property_string, "compatible", "arm,arm-v8");
+        __FDT(property_string, "enable-method", "psci");
+        __FDT(end_node); /* End of /cpus/cpu@N */
+    }
+    __FDT(end_node); /* End of /cpus */
 
     /* Create /timer node
      * Use the example from
@@ -342,7 +366,9 @@ static int generate_fdt(vm_t *v)
         cpu_to_fdt64(ARM_GIC_DIST_BASE),
         cpu_to_fdt64(ARM_GIC_DIST_SIZE),
         cpu_to_fdt64(ARM_GIC_REDIST_CPUI_BASE),
-        cpu_to_fdt64(ARM_GIC_REDIST_CPUI_SIZE),
+        cpu_to_fdt64(priv->gic_type == IRQCHIP_TYPE_GIC_V3
+                         ? v->cfg.nr_vcpus * ARM_GIC_REDIST_CPUI_SIZE
+                         : ARM_GIC_REDIST_CPUI_SIZE),
     };
     if (priv->gic_type == IRQCHIP_TYPE_GIC_V3)
         __FDT(property_string, "compatible", "arm,gic-v3");
@@ -468,6 +494,7 @@ static int generate_fdt(vm_t *v)
 static int init_reg(vm_t *v)
 {
     vm_arch_priv_t *priv = (vm_arch_priv_t *) v->priv;
+    int vcpu_fd = v->vcpus[0].fd;
     struct kvm_one_reg reg;
     uint64_t data;
 
@@ -480,20 +507,20 @@ static int init_reg(vm_t *v)
     for (int i = 0; i < 3; i++) {
         data = 0;
         reg.id = __REG(regs.regs[i]);
-        if (ioctl(v->vcpu_fd, KVM_SET_ONE_REG, &reg) < 0)
+        if (ioctl(vcpu_fd, KVM_SET_ONE_REG, &reg) < 0)
             return throw_err("Failed to set x%d\n", i);
     }
 
     /* Set x0 to the address of the device tree */
     data = ARM_FDT_BASE;
     reg.id = __REG(regs.regs[0]);
-    if (ioctl(v->vcpu_fd, KVM_SET_ONE_REG, &reg) < 0)
+    if (ioctl(vcpu_fd, KVM_SET_ONE_REG, &reg) < 0)
         return throw_err("Failed to set x0\n");
 
     /* Set program counter to the begining of kernel image */
     data = priv->entry;
     reg.id = __REG(regs.pc);
-    if (ioctl(v->vcpu_fd, KVM_SET_ONE_REG, &reg) < 0)
+    if (ioctl(vcpu_fd, KVM_SET_ONE_REG, &reg) < 0)
         return throw_err("Failed to set program counter\n");
 
 #undef _REG
@@ -528,3 +555,19 @@ int vm_irq_line(vm_t *v, int irq, int level)
 
     return 0;
 }
+
+/* Saving arm64 vCPUs needs the KVM_GET_REG_LIST walk plus the VGIC device
+ * attributes; until that is wired up, snapshots are x86-only.
+ */
+int vm_arch_save_state(vm_t *v, int fd)
+{
+    (void) v;
+    (void) fd;
+    errno = ENOTSUP;
+    return throw_err("Snapshots are not supported on arm64");
+}
+
+int vm_arch_restore_state(vm_t *v, int fd)
+{
+    return vm_arch_save_state(v, fd);
+}
@@ -1,6 +1,13 @@
 #pragma once
 
 #define RAM_BASE 0
+#define RAM_SIZE_MIN (64ULL << 20)
+
+/* 32-bit PCI MMIO window. Guest RAM beyond MMIO_HOLE_BASE is relocated above
+ * 4 GiB so the guest allocates BARs (and the IOAPIC/LAPIC pages) here.
+ */
+#define MMIO_HOLE_BASE 0xc0000000ULL
+#define MMIO_HOLE_END (1ULL << 32)
 
 /* IO-APIC GSIs. Each device gets its own line so we never share a vector
  * between virtio devices, which keeps level-triggered ISA legacy IRQs (the
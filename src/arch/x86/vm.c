@@ -7,16 +7,18 @@
 #include <linux/kvm.h>
 #include <linux/kvm_para.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 
 #include "err.h"
+#include "snapshot.h"
 #include "vm.h"
 
-static int vm_init_regs(vm_t *v)
+static int vm_init_regs(vcpu_t *vcpu)
 {
     struct kvm_sregs sregs;
-    if (ioctl(v->vcpu_fd, KVM_GET_SREGS, &sregs) < 0)
+    if (ioctl(vcpu->fd, KVM_GET_SREGS, &sregs) < 0)
         return throw_err("Failed to get registers");
 
 #define X(R) sregs.R.base = 0, sregs.R.limit = ~0, sregs.R.g = 1
@@ -27,23 +29,23 @@ static int vm_init_regs(vm_t *v)
     sregs.ss.db = 1;
     sregs.cr0 |= 1; /* enable protected mode */
 
-    if (ioctl(v->vcpu_fd, KVM_SET_SREGS, &sregs) < 0)
+    if (ioctl(vcpu->fd, KVM_SET_SREGS, &sregs) < 0)
         return throw_err("Failed to set special registers");
 
     struct kvm_regs regs;
-    if (ioctl(v->vcpu_fd, KVM_GET_REGS, &regs) < 0)
+    if (ioctl(vcpu->fd, KVM_GET_REGS, &regs) < 0)
         return throw_err("Failed to get registers");
 
     regs.rflags = 2;
     regs.rip = 0x100000, regs.rsi = 0x10000;
-    if (ioctl(v->vcpu_fd, KVM_SET_REGS, &regs) < 0)
+    if (ioctl(vcpu->fd, KVM_SET_REGS, &regs) < 0)
         return throw_err("Failed to set registers");
 
     return 0;
 }
 
 #define N_ENTRIES 100
-static void vm_init_cpu_id(vm_t *v)
+static void vm_init_cpu_id(vm_t *v, vcpu_t *vcpu)
 {
     struct {
         uint32_t nent;
@@ -60,8 +62,15 @@ static void vm_init_cpu_id(vm_t *v)
             entry->ecx = 0x564b4d56; /* VMKV */
             entry->edx = 0x4d;       /* M */
         }
+        /* KVM assigns APIC ID == vcpu id; make CPUID agree so the guest's
+         * topology enumeration matches the MP table.
+         */
+        if (entry->function == 0x1)
+            entry->ebx = (entry->ebx & 0x00ffffff) | (vcpu->id << 24);
+        if (entry->function == 0xb || entry->function == 0x1f)
+            entry->edx = vcpu->id;
     }
-    ioctl(v->vcpu_fd, KVM_SET_CPUID2, &kvm_cpuid);
+    ioctl(vcpu->fd, KVM_SET_CPUID2, &kvm_cpuid);
 }
 
 #define MSR_IA32_MISC_ENABLE 0x000001a0
@@ -74,7 +83,7 @@ static void vm_init_cpu_id(vm_t *v)
     {                                  \
         .index = _index, .data = _data \
     }
-static void vm_init_msrs(vm_t *v)
+static void vm_init_msrs(vcpu_t *vcpu)
 {
     int ndx = 0;
     struct kvm_msrs *msrs =
@@ -84,7 +93,7 @@ static void vm_init_msrs(vm_t *v)
         KVM_MSR_ENTRY(MSR_IA32_MISC_ENABLE, MSR_IA32_MISC_ENABLE_FAST_STRING);
     msrs->nmsrs = ndx;
 
-    ioctl(v->vcpu_fd, KVM_SET_MSRS, msrs);
+    ioctl(vcpu->fd, KVM_SET_MSRS, msrs);
 
     free(msrs);
 }
@@ -108,11 +117,16 @@ int vm_arch_init(vm_t *v)
     return 0;
 }
 
-int vm_arch_cpu_init(vm_t *v)
+int vm_arch_cpu_init(vm_t *v, vcpu_t *vcpu)
 {
-    vm_init_regs(v);
-    vm_init_cpu_id(v);
-    vm_init_msrs(v);
+    /* Only the boot CPU enters the kernel directly. Application processors
+     * stay in KVM's wait-for-SIPI state until the guest wakes them through
+     * the in-kernel LAPIC.
+     */
+    if (vcpu->id == 0)
+        vm_init_regs(vcpu);
+    vm_init_cpu_id(v, vcpu);
+    vm_init_msrs(vcpu);
     return 0;
 }
 
@@ -127,12 +141,12 @@ int vm_arch_init_platform_device(vm_t *v)
     return 0;
 }
 
-int vm_arch_load_image(vm_t *v, void *data, size_t datasz)
+int vm_arch_load_image(vm_t *v, int fd, void *data, size_t datasz)
 {
     struct boot_params *boot =
-        (struct boot_params *) ((uint8_t *) v->mem + 0x10000);
-    void *cmdline = ((uint8_t *) v->mem) + 0x20000;
-    void *kernel = ((uint8_t *) v->mem) + 0x100000;
+        (struct boot_params *) ((uint8_t *) v->mem.base + 0x10000);
+    void *cmdline = ((uint8_t *) v->mem.base) + 0x20000;
+    void *kernel = ((uint8_t *) v->mem.base) + 0x100000;
 
     /* According to https://www.kernel.org/doc/html/next/x86/boot.html,
      * the first step in loading a Linux kernel should be to setup the boot
@@ -154,7 +168,11 @@ int vm_arch_load_image(vm_t *v, void *data, size_t datasz)
     boot->hdr.cmd_line_ptr = 0x20000;
     memset(cmdline, 0, boot->hdr.cmdline_size);
     memcpy(cmdline, KERNEL_OPTS, sizeof(KERNEL_OPTS));
-    memmove(kernel, (char *) data + setupsz, datasz - setupsz);
+    /* The protected-mode payload is mapped rather than copied only when the
+     * setup code ends on a page boundary; it usually does not.
+     */
+    if (vm_load_range(v, kernel, fd, data, setupsz, datasz - setupsz) < 0)
+        return -1;
 
     /* setup E820 memory map to report usable address ranges for initrd */
     unsigned int idx = 0;
@@ -163,42 +181,292 @@ int vm_arch_load_image(vm_t *v, void *data, size_t datasz)
         .size = ISA_START_ADDRESS,
         .type = E820_RAM,
     };
-    boot->e820_table[idx++] = (struct boot_e820_entry) {
-        .addr = ISA_END_ADDRESS,
-        .size = RAM_SIZE - ISA_END_ADDRESS,
-        .type = E820_RAM,
-    };
+    for (int i = 0; i < v->nr_mem_regions; i++) {
+        struct vm_mem_region *r = &v->mem_regions[i];
+        /* The low region starts at 0; skip the VGA/BIOS hole in it. */
+        uint64_t start = r->gpa < ISA_END_ADDRESS ? ISA_END_ADDRESS : r->gpa;
+        boot->e820_table[idx++] = (struct boot_e820_entry) {
+            .addr = start,
+            .size = r->gpa + r->size - start,
+            .type = E820_RAM,
+        };
+    }
     boot->e820_entries = idx;
 
     return 0;
 }
 
-int vm_arch_load_initrd(vm_t *v, void *data, size_t datasz)
+int vm_arch_load_initrd(vm_t *v, int fd, void *data, size_t datasz)
 {
     struct boot_params *boot =
-        (struct boot_params *) ((uint8_t *) v->mem + 0x10000);
+        (struct boot_params *) ((uint8_t *) v->mem.base + 0x10000);
     unsigned long addr = boot->hdr.initrd_addr_max & ~0xfffff;
+    /* initrd_addr_max is below 4 GiB, so only the low region can host it. */
+    uint64_t low_end = v->mem_regions[0].gpa + v->mem_regions[0].size;
 
     for (;;) {
-        if (addr < 0x100000)
+        if (addr < 0x100000 || datasz > low_end)
             return throw_err("Not enough memory for initrd");
-        if (addr < (RAM_SIZE - datasz))
+        if (addr < (low_end - datasz))
             break;
         addr -= 0x100000;
     }
 
-    void *initrd = ((uint8_t *) v->mem) + addr;
-
-    memset(initrd, 0, datasz);
-    memmove(initrd, data, datasz);
+    void *initrd = ((uint8_t *) v->mem.base) + addr;
+    if (vm_load_range(v, initrd, fd, data, 0, datasz) < 0)
+        return -1;
 
     boot->hdr.ramdisk_image = addr;
     boot->hdr.ramdisk_size = datasz;
     return 0;
 }
 
+/* Intel MultiProcessor Specification v1.4 tables. Without ACPI in the guest
+ * configuration, this is how Linux discovers the application processors and
+ * the IOAPIC.
+ */
+#define MPTABLE_BASE 0xf0000
+#define MPTABLE_MAX_SIZE 0x10000
+#define MPC_SPEC 4
+#define MPC_LAPIC_BASE 0xfee00000
+#define MPC_IOAPIC_BASE 0xfec00000
+#define MPC_APIC_VERSION 0x14
+#define MPC_IOAPIC_VERSION 0x11
+#define MPC_IOAPIC_PINS 24
+
+enum {
+    MP_PROCESSOR = 0,
+    MP_BUS,
+    MP_IOAPIC,
+    MP_INTSRC,
+    MP_LINTSRC,
+};
+
+enum {
+    MP_INT = 0,
+    MP_NMI,
+    MP_SMI,
+    MP_EXTINT,
+};
+
+#define MPC_CPU_ENABLED 0x01
+#define MPC_CPU_BOOTPROCESSOR 0x02
+#define MPC_APIC_USABLE 0x01
+/* Polarity in bits 1:0, trigger mode in bits 3:2. */
+#define MP_IRQ_ACTIVE_HIGH 0x1
+#define MP_IRQ_EDGE 0x4
+
+#define MP_BUS_PCI 0
+#define MP_BUS_ISA 1
+
+struct mpf_intel {
+    char signature[4];
+    uint32_t physptr;
+    uint8_t length;
+    uint8_t specification;
+    uint8_t checksum;
+    uint8_t feature[5];
+} __attribute__((packed));
+
+struct mpc_table {
+    char signature[4];
+    uint16_t length;
+    uint8_t spec;
+    uint8_t checksum;
+    char oem[8];
+    char productid[12];
+    uint32_t oemptr;
+    uint16_t oemsize;
+    uint16_t oemcount;
+    uint32_t lapic;
+    uint32_t reserved;
+} __attribute__((packed));
+
+struct mpc_cpu {
+    uint8_t type;
+    uint8_t apicid;
+    uint8_t apicver;
+    uint8_t cpuflag;
+    uint32_t cpufeature;
+    uint32_t featureflag;
+    uint32_t reserved[2];
+} __attribute__((packed));
+
+struct mpc_bus {
+    uint8_t type;
+    uint8_t busid;
+    char bustype[6];
+} __attribute__((packed));
+
+struct mpc_ioapic {
+    uint8_t type;
+    uint8_t apicid;
+    uint8_t apicver;
+    uint8_t flags;
+    uint32_t apicaddr;
+} __attribute__((packed));
+
+struct mpc_intsrc {
+    uint8_t type;
+    uint8_t irqtype;
+    uint16_t irqflag;
+    uint8_t srcbus;
+    uint8_t srcbusirq;
+    uint8_t dstapic;
+    uint8_t dstirq;
+} __attribute__((packed));
+
+static uint8_t mptable_checksum(const void *buf, size_t len)
+{
+    uint8_t sum = 0;
+    for (size_t i = 0; i < len; i++)
+        sum += ((const uint8_t *) buf)[i];
+    return -sum;
+}
+
+/* Append one entry to the configuration table at *p and bump the count. */
+#define MPTABLE_ADD(p, mpc, entry)                     \
+    do {                                               \
+        __typeof__(entry) __e = (entry);               \
+        memcpy(p, &__e, sizeof(__e));                  \
+        p = (void *) ((uintptr_t) (p) + sizeof(__e)); \
+        (mpc)->oemcount++;                             \
+    } while (0)
+
+static int pci_dev_slot(struct pci_dev *dev)
+{
+    union pci_config_address addr = {.value = dev->config_dev.base};
+    return addr.dev_num;
+}
+
+static int vm_setup_mptable(vm_t *v)
+{
+    struct mpf_intel *mpf = vm_guest_to_host(v, MPTABLE_BASE);
+    struct mpc_table *mpc = (struct mpc_table *) (mpf + 1);
+    void *p = mpc + 1;
+    uint8_t ioapic_id = v->cfg.nr_vcpus;
+
+    size_t need = sizeof(*mpf) + sizeof(*mpc) +
+                  v->cfg.nr_vcpus * sizeof(struct mpc_cpu) +
+                  2 * sizeof(struct mpc_bus) + sizeof(struct mpc_ioapic) +
+                  (16 + 2 + 2) * sizeof(struct mpc_intsrc);
+    if (need > MPTABLE_MAX_SIZE)
+        return throw_err("MP table does not fit below 1 MiB");
+
+    memset(mpf, 0, need);
+    memcpy(mpc->signature, "PCMP", 4);
+    mpc->spec = MPC_SPEC;
+    memcpy(mpc->oem, "KVMHOST ", 8);
+    memcpy(mpc->productid, "kvm-host    ", 12);
+    mpc->lapic = MPC_LAPIC_BASE;
+
+    for (int i = 0; i < v->cfg.nr_vcpus; i++) {
+        MPTABLE_ADD(p, mpc,
+                    ((struct mpc_cpu) {
+                        .type = MP_PROCESSOR,
+                        .apicid = i,
+                        .apicver = MPC_APIC_VERSION,
+                        .cpuflag = MPC_CPU_ENABLED |
+                                   (i == 0 ? MPC_CPU_BOOTPROCESSOR : 0),
+                        .cpufeature = 0x600,  /* family 6 */
+                        .featureflag = 0x201, /* FPU | APIC */
+                    }));
+    }
+
+    MPTABLE_ADD(p, mpc,
+                ((struct mpc_bus) {MP_BUS, MP_BUS_PCI, "PCI   "}));
+    MPTABLE_ADD(p, mpc,
+                ((struct mpc_bus) {MP_BUS, MP_BUS_ISA, "ISA   "}));
+    MPTABLE_ADD(p, mpc,
+                ((struct mpc_ioapic) {
+                    .type = MP_IOAPIC,
+                    .apicid = ioapic_id,
+                    .apicver = MPC_IOAPIC_VERSION,
+                    .flags = MPC_APIC_USABLE,
+                    .apicaddr = MPC_IOAPIC_BASE,
+                }));
+
+    /* virtio devices raise their line through irqfd, which KVM delivers as
+     * an edge on the IOAPIC pin of the same number. Describe them as PCI
+     * INTA# sources with explicit edge/active-high flags and leave their
+     * pins out of the ISA identity map below.
+     */
+    struct pci_dev *pci_devs[] = {
+        (struct pci_dev *) &v->virtio_blk_dev,
+        (struct pci_dev *) &v->virtio_net_dev,
+    };
+    int pci_irqs[] = {v->virtio_blk_dev.irq_num, v->virtio_net_dev.irq_num};
+    uint32_t pci_pins = 0;
+    for (size_t i = 0; i < sizeof(pci_devs) / sizeof(pci_devs[0]); i++) {
+        if (pci_devs[i]->config_dev.len != PCI_CFG_SPACE_SIZE)
+            continue;
+        MPTABLE_ADD(p, mpc,
+                    ((struct mpc_intsrc) {
+                        .type = MP_INTSRC,
+                        .irqtype = MP_INT,
+                        .irqflag = MP_IRQ_EDGE | MP_IRQ_ACTIVE_HIGH,
+                        .srcbus = MP_BUS_PCI,
+                        .srcbusirq = pci_dev_slot(pci_devs[i]) << 2,
+                        .dstapic = ioapic_id,
+                        .dstirq = pci_irqs[i],
+                    }));
+        pci_pins |= 1U << pci_irqs[i];
+    }
+
+    /* KVM's default GSI routing wires ISA IRQ n to IOAPIC pin n, including
+     * the in-kernel PIT on IRQ0. IRQ2 is the 8259 cascade and has no source.
+     */
+    for (int irq = 0; irq < 16; irq++) {
+        if (irq == 2 || (pci_pins & (1U << irq)))
+            continue;
+        MPTABLE_ADD(p, mpc,
+                    ((struct mpc_intsrc) {
+                        .type = MP_INTSRC,
+                        .irqtype = MP_INT,
+                        .srcbus = MP_BUS_ISA,
+                        .srcbusirq = irq,
+                        .dstapic = ioapic_id,
+                        .dstirq = irq,
+                    }));
+    }
+
+    MPTABLE_ADD(p, mpc,
+                ((struct mpc_intsrc) {
+                    .type = MP_LINTSRC,
+                    .irqtype = MP_EXTINT,
+                    .srcbus = MP_BUS_ISA,
+                    .dstapic = 0xff,
+                    .dstirq = 0,
+                }));
+    MPTABLE_ADD(p, mpc,
+                ((struct mpc_intsrc) {
+                    .type = MP_LINTSRC,
+                    .irqtype = MP_NMI,
+                    .srcbus = MP_BUS_ISA,
+                    .dstapic = 0xff,
+                    .dstirq = 1,
+                }));
+
+    mpc->length = (uintptr_t) p - (uintptr_t) mpc;
+    mpc->checksum = mptable_checksum(mpc, mpc->length);
+
+    memcpy(mpf->signature, "_MP_", 4);
+    mpf->physptr = MPTABLE_BASE + sizeof(*mpf);
+    mpf->length = 1; /* in 16-byte paragraphs */
+    mpf->specification = MPC_SPEC;
+    mpf->checksum = mptable_checksum(mpf, sizeof(*mpf));
+    return 0;
+}
+#undef MPTABLE_ADD
+
 int vm_late_init(vm_t *v)
 {
+    /* A uniprocessor guest keeps the legacy 8259 boot path it has always
+     * used; the MP table, and with it the IOAPIC, is only published when
+     * there are application processors to describe.
+     */
+    if (v->cfg.nr_vcpus > 1 && vm_setup_mptable(v) < 0)
+        return -1;
     return 0;
 }
 
@@ -214,3 +482,216 @@ int vm_irq_line(vm_t *v, int irq, int level)
 
     return 0;
 }
+
+/* Per-vCPU state that has a plain KVM_GET_x/KVM_SET_x pair, listed in the
+ * order it has to be set back: sregs before the LAPIC (APIC base) and
+ * mp_state/events last, after everything they depend on.
+ */
+struct vcpu_state {
+    struct kvm_sregs sregs;
+    struct kvm_regs regs;
+    struct kvm_xsave xsave;
+    struct kvm_xcrs xcrs;
+    struct kvm_debugregs debugregs;
+    struct kvm_lapic_state lapic;
+    struct kvm_mp_state mp_state;
+    struct kvm_vcpu_events events;
+};
+
+#define VCPU_STATE(get, set, field)                          \
+    {                                                        \
+        get, set, offsetof(struct vcpu_state, field), #field \
+    }
+static const struct {
+    unsigned long get, set;
+    size_t offset;
+    const char *name;
+} vcpu_state_ops[] = {
+    VCPU_STATE(KVM_GET_SREGS, KVM_SET_SREGS, sregs),
+    VCPU_STATE(KVM_GET_REGS, KVM_SET_REGS, regs),
+    VCPU_STATE(KVM_GET_XSAVE, KVM_SET_XSAVE, xsave),
+    VCPU_STATE(KVM_GET_XCRS, KVM_SET_XCRS, xcrs),
+    VCPU_STATE(KVM_GET_DEBUGREGS, KVM_SET_DEBUGREGS, debugregs),
+    VCPU_STATE(KVM_GET_LAPIC, KVM_SET_LAPIC, lapic),
+    VCPU_STATE(KVM_GET_MP_STATE, KVM_SET_MP_STATE, mp_state),
+    VCPU_STATE(KVM_GET_VCPU_EVENTS, KVM_SET_VCPU_EVENTS, events),
+};
+#undef VCPU_STATE
+
+#define VCPU_STATE_NR (sizeof(vcpu_state_ops) / sizeof(vcpu_state_ops[0]))
+
+/* Every MSR KVM knows how to save. Some in the list are not readable for a
+ * given CPU model, so they are probed one at a time and only the readable
+ * ones end up in the snapshot.
+ */
+static struct kvm_msr_list *vm_get_msr_list(vm_t *v)
+{
+    struct kvm_msr_list probe = {.nmsrs = 0};
+    if (ioctl(v->kvm_fd, KVM_GET_MSR_INDEX_LIST, &probe) < 0 && errno != E2BIG)
+        return NULL;
+
+    struct kvm_msr_list *list =
+        calloc(1, sizeof(*list) + probe.nmsrs * sizeof(list->indices[0]));
+    if (!list)
+        return NULL;
+    list->nmsrs = probe.nmsrs;
+    if (ioctl(v->kvm_fd, KVM_GET_MSR_INDEX_LIST, list) < 0) {
+        free(list);
+        return NULL;
+    }
+    return list;
+}
+
+static int vm_save_msrs(vcpu_t *vcpu, struct kvm_msr_list *list, int fd)
+{
+    struct kvm_msrs *msrs =
+        calloc(1, sizeof(*msrs) + list->nmsrs * sizeof(msrs->entries[0]));
+    if (!msrs)
+        return -1;
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < list->nmsrs; i++) {
+        struct {
+            struct kvm_msrs hdr;
+            struct kvm_msr_entry entry;
+        } one = {.hdr.nmsrs = 1, .entry.index = list->indices[i]};
+        if (ioctl(vcpu->fd, KVM_GET_MSRS, &one) == 1)
+            msrs->entries[n++] = one.entry;
+    }
+
+    int ret = snapshot_write(fd, &n, sizeof(n));
+    if (!ret)
+        ret = snapshot_write(fd, msrs->entries, n * sizeof(msrs->entries[0]));
+    free(msrs);
+    return ret;
+}
+
+static int vm_restore_msrs(vcpu_t *vcpu, int fd)
+{
+    uint32_t n;
+    if (snapshot_read(fd, &n, sizeof(n)) < 0)
+        return -1;
+    if (n > 4096) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct kvm_msrs *msrs =
+        calloc(1, sizeof(*msrs) + n * sizeof(msrs->entries[0]));
+    if (!msrs)
+        return -1;
+    if (snapshot_read(fd, msrs->entries, n * sizeof(msrs->entries[0])) < 0) {
+        free(msrs);
+        return -1;
+    }
+
+    /* KVM_SET_MSRS stops at the first MSR it refuses (read-only ones such
+     * as the microcode revision); skip that entry and carry on.
+     */
+    while (n) {
+        msrs->nmsrs = n;
+        int ret = ioctl(vcpu->fd, KVM_SET_MSRS, msrs);
+        if (ret < 0) {
+            free(msrs);
+            return -1;
+        }
+        if ((uint32_t) ret >= n)
+            break;
+        n -= ret + 1;
+        memmove(msrs->entries, msrs->entries + ret + 1,
+                n * sizeof(msrs->entries[0]));
+    }
+    free(msrs);
+    return 0;
+}
+
+int vm_arch_save_state(vm_t *v, int fd)
+{
+    struct kvm_clock_data clock = {0};
+    if (ioctl(v->vm_fd, KVM_GET_CLOCK, &clock) < 0)
+        return throw_err("Failed to get kvmclock");
+    if (snapshot_write(fd, &clock, sizeof(clock)) < 0)
+        return -1;
+
+    for (int i = 0; i < 3; i++) {
+        /* KVM_IRQCHIP_PIC_MASTER, KVM_IRQCHIP_PIC_SLAVE, KVM_IRQCHIP_IOAPIC */
+        struct kvm_irqchip chip = {.chip_id = i};
+        if (ioctl(v->vm_fd, KVM_GET_IRQCHIP, &chip) < 0)
+            return throw_err("Failed to get irqchip %d", i);
+        if (snapshot_write(fd, &chip, sizeof(chip)) < 0)
+            return -1;
+    }
+
+    struct kvm_pit_state2 pit;
+    if (ioctl(v->vm_fd, KVM_GET_PIT2, &pit) < 0)
+        return throw_err("Failed to get PIT state");
+    if (snapshot_write(fd, &pit, sizeof(pit)) < 0)
+        return -1;
+
+    struct kvm_msr_list *msr_list = vm_get_msr_list(v);
+    if (!msr_list)
+        return throw_err("Failed to get the MSR index list");
+
+    int ret = 0;
+    struct vcpu_state state;
+    for (int i = 0; i < v->cfg.nr_vcpus && !ret; i++) {
+        vcpu_t *vcpu = &v->vcpus[i];
+        for (size_t j = 0; j < VCPU_STATE_NR; j++) {
+            void *p = (uint8_t *) &state + vcpu_state_ops[j].offset;
+            if (ioctl(vcpu->fd, vcpu_state_ops[j].get, p) < 0) {
+                ret = throw_err("Failed to get %s of vcpu %d",
+                                vcpu_state_ops[j].name, vcpu->id);
+                break;
+            }
+        }
+        if (!ret && (snapshot_write(fd, &state, sizeof(state)) < 0 ||
+                     vm_save_msrs(vcpu, msr_list, fd) < 0))
+            ret = -1;
+    }
+    free(msr_list);
+    return ret;
+}
+
+int vm_arch_restore_state(vm_t *v, int fd)
+{
+    struct kvm_clock_data clock;
+    if (snapshot_read(fd, &clock, sizeof(clock)) < 0)
+        return -1;
+
+    for (int i = 0; i < 3; i++) {
+        struct kvm_irqchip chip;
+        if (snapshot_read(fd, &chip, sizeof(chip)) < 0)
+            return -1;
+        if (ioctl(v->vm_fd, KVM_SET_IRQCHIP, &chip) < 0)
+            return throw_err("Failed to set irqchip %d", i);
+    }
+
+    struct kvm_pit_state2 pit;
+    if (snapshot_read(fd, &pit, sizeof(pit)) < 0)
+        return -1;
+    if (ioctl(v->vm_fd, KVM_SET_PIT2, &pit) < 0)
+        return throw_err("Failed to set PIT state");
+
+    struct vcpu_state state;
+    for (int i = 0; i < v->cfg.nr_vcpus; i++) {
+        vcpu_t *vcpu = &v->vcpus[i];
+        if (snapshot_read(fd, &state, sizeof(state)) < 0)
+            return -1;
+        for (size_t j = 0; j < VCPU_STATE_NR; j++) {
+            void *p = (uint8_t *) &state + vcpu_state_ops[j].offset;
+            if (ioctl(vcpu->fd, vcpu_state_ops[j].set, p) < 0)
+                return throw_err("Failed to set %s of vcpu %d",
+                                 vcpu_state_ops[j].name, vcpu->id);
+        }
+        if (vm_restore_msrs(vcpu, fd) < 0)
+            return throw_err("Failed to set MSRs of vcpu %d", vcpu->id);
+    }
+
+    /* kvmclock goes last: the guest clock resumes where it was paused
+     * rather than jumping by the time the snapshot sat on disk.
+     */
+    clock.flags = 0;
+    if (ioctl(v->vm_fd, KVM_SET_CLOCK, &clock) < 0)
+        return throw_err("Failed to set kvmclock");
+    return 0;
+}
@@ -1,55 +1,132 @@
 #include "bus.h"
-#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "err.h"
+
+/* Buses with no more devices than this are searched without the hint. */
+#define BUS_HINT_MIN 8
+
+static inline bool entry_contains(const struct bus_entry *e, uint64_t addr)
+{
+    return addr - e->base < e->len;
+}
 
 static inline struct dev *bus_find_dev(struct bus *bus, uint64_t addr)
 {
-    struct dev **p = &bus->head;
+    const struct bus_entry *e = bus->entries;
+    size_t n = bus->nr_devs;
+
+    /* Exits come in bursts to the same device (a virtqueue kick, a string of
+     * serial writes), so try the last hit before searching. On a bus of a
+     * few devices the search is shorter than a mispredicted guess.
+     */
+    if (n > BUS_HINT_MIN && entry_contains(&e[bus->hint], addr))
+        return e[bus->hint].dev;
+    if (!n)
+        return NULL;
 
-    for (; *p; p = &(*p)->next) {
-        uint64_t start = (*p)->base;
-        uint64_t end = start + (*p)->len - 1;
-        if (addr >= start && addr <= end)
-            return *p;
+    /* Narrow down to the last entry whose base is <= addr, the only
+     * candidate. The step is a conditional move rather than a branch, as
+     * random addresses would mispredict it half the time.
+     */
+    while (n > 1) {
+        size_t half = n / 2;
+        e = e[half].base <= addr ? e + half : e;
+        n -= half;
     }
-    return NULL;
+    if (!entry_contains(e, addr))
+        return NULL;
+    bus->hint = e - bus->entries;
+    return e->dev;
 }
 
-void bus_handle_io(struct bus *bus,
-                   void *data,
-                   uint8_t is_write,
-                   uint64_t addr,
-                   uint8_t size)
+/* Returns the device that handled the access, or NULL if none did. */
+struct dev *bus_handle_io(struct bus *bus,
+                          void *data,
+                          uint8_t is_write,
+                          uint64_t addr,
+                          uint8_t size)
 {
     struct dev *dev = bus_find_dev(bus, addr);
 
     if (dev && addr + size - 1 <= dev->base + dev->len - 1) {
         dev->do_io(dev->owner, data, is_write, addr - dev->base, size);
+        return dev;
     }
+    return NULL;
 }
 
 void bus_register_dev(struct bus *bus, struct dev *dev)
 {
-    dev->next = bus->head;
-    bus->head = dev;
+    size_t n = bus->nr_devs;
+
+    struct bus_entry *e = bus->entries;
+    size_t pos = 0;
+    while (pos < n && e[pos].base < dev->base)
+        pos++;
+    /* Overlapping ranges would make the lookup ambiguous; the guest can get
+     * here by programming two BARs over each other.
+     */
+    if ((pos > 0 && entry_contains(&e[pos - 1], dev->base)) ||
+        (pos < n && e[pos].base - dev->base < dev->len)) {
+        errno = EBUSY;
+        throw_err("Device range 0x%llx+0x%llx overlaps another one",
+                  (unsigned long long) dev->base,
+                  (unsigned long long) dev->len);
+        return;
+    }
+
+    /* The array only grows, so BARs moved or toggled by the guest reuse
+     * the slots they left.
+     */
+    if (n == bus->cap) {
+        size_t cap = bus->cap ? bus->cap * 2 : 8;
+        e = realloc(bus->entries, cap * sizeof(*e));
+        if (!e) {
+            throw_err("Failed to grow the bus index");
+            return;
+        }
+        bus->entries = e;
+        bus->cap = cap;
+    }
+    memmove(e + pos + 1, e + pos, (n - pos) * sizeof(*e));
+    e[pos] = (struct bus_entry) {
+        .base = dev->base,
+        .len = dev->len,
+        .dev = dev,
+    };
+    bus->nr_devs++;
+    bus->hint = pos;
     bus->dev_num++;
 }
 
 void bus_deregister_dev(struct bus *bus, struct dev *dev)
 {
-    struct dev **p = &bus->head;
+    size_t n = bus->nr_devs;
 
-    while (*p != dev && *p) {
-        p = &(*p)->next;
-    }
+    size_t pos = 0;
+    while (pos < n && bus->entries[pos].dev != dev)
+        pos++;
+    if (pos == n)
+        return;
 
-    if (*p)
-        *p = (*p)->next;
+    memmove(bus->entries + pos, bus->entries + pos + 1,
+            (n - pos - 1) * sizeof(bus->entries[0]));
+    bus->nr_devs--;
+    bus->hint = 0;
 }
 
 void bus_init(struct bus *bus)
 {
-    bus->dev_num = 0;
-    bus->head = NULL;
+    *bus = (struct bus) {0};
+}
+
+void bus_exit(struct bus *bus)
+{
+    free(bus->entries);
+    *bus = (struct bus) {0};
 }
 
 void dev_init(struct dev *dev,
@@ -62,5 +139,5 @@ void dev_init(struct dev *dev,
     dev->len = len;
     dev->owner = owner;
     dev->do_io = do_io;
-    dev->next = NULL;
+    dev->accesses = 0;
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 struct dev;
@@ -15,22 +16,39 @@ struct dev {
     uint64_t len;
     void *owner;
     dev_io_fn do_io;
-    struct dev *next;
+    uint64_t accesses; /* counted with --stats */
 };
 
+/* A registered device's range, copied next to it so that a lookup searches
+ * one contiguous array without loading the devices themselves.
+ */
+struct bus_entry {
+    uint64_t base;
+    uint64_t len;
+    struct dev *dev;
+};
+
+/* Devices are kept sorted by base address, with no two ranges overlapping.
+ * Lookups, register and deregister must all be serialized by the caller
+ * (vm_t.io_lock, or single-threaded setup).
+ */
 struct bus {
     uint64_t dev_num;
-    struct dev *head;
+    struct bus_entry *entries;
+    size_t nr_devs;
+    size_t cap;  /* slots allocated in entries */
+    size_t hint; /* slot of the last device found */
 };
 
 void bus_register_dev(struct bus *bus, struct dev *dev);
 void bus_deregister_dev(struct bus *bus, struct dev *dev);
-void bus_handle_io(struct bus *bus,
-                   void *data,
-                   uint8_t is_write,
-                   uint64_t addr,
-                   uint8_t size);
+struct dev *bus_handle_io(struct bus *bus,
+                          void *data,
+                          uint8_t is_write,
+                          uint64_t addr,
+                          uint8_t size);
 void bus_init(struct bus *bus);
+void bus_exit(struct bus *bus);
 void dev_init(struct dev *dev,
               uint64_t base,
               uint64_t len,
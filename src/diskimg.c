@@ -1,18 +1,257 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include "diskimg.h"
+#include "overlay.h"
+#include "qcow2.h"
 
+bool diskimg_aligned(const struct diskimg *diskimg,
+                     const struct iovec *iov,
+                     int iovcnt,
+                     off_t offset)
+{
+    if (!diskimg->direct)
+        return true;
+    if (offset & (diskimg->align - 1))
+        return false;
+    for (int i = 0; i < iovcnt; i++) {
+        if (((uintptr_t) iov[i].iov_base & (diskimg->mem_align - 1)) ||
+            (iov[i].iov_len & (diskimg->align - 1)))
+            return false;
+    }
+    return true;
+}
+
+static uint8_t *diskimg_get_bounce(struct diskimg *diskimg)
+{
+    pthread_mutex_lock(&diskimg->bounce_lock);
+    while (!diskimg->bounce_free)
+        pthread_cond_wait(&diskimg->bounce_cond, &diskimg->bounce_lock);
+    int i = __builtin_ctz(diskimg->bounce_free);
+    diskimg->bounce_free &= ~(1U << i);
+    pthread_mutex_unlock(&diskimg->bounce_lock);
+    return diskimg->bounce[i];
+}
+
+static void diskimg_put_bounce(struct diskimg *diskimg, uint8_t *buf)
+{
+    pthread_mutex_lock(&diskimg->bounce_lock);
+    for (int i = 0; i < DISKIMG_BOUNCE_BUFS; i++) {
+        if (diskimg->bounce[i] == buf)
+            diskimg->bounce_free |= 1U << i;
+    }
+    pthread_cond_signal(&diskimg->bounce_cond);
+    pthread_mutex_unlock(&diskimg->bounce_lock);
+}
+
+/* Unaligned O_DIRECT I/O, staged through a bounce buffer one aligned span at
+ * a time. A write that covers a block only in part reads it in first.
+ */
+static ssize_t diskimg_bounce_rw(struct diskimg *diskimg,
+                                 uint8_t *data,
+                                 off_t offset,
+                                 size_t size,
+                                 bool write)
+{
+    uint8_t *buf = diskimg_get_bounce(diskimg);
+    size_t align = diskimg->align;
+    size_t done = 0;
+    ssize_t ret = 0;
+
+    while (done < size) {
+        off_t pos = offset + done;
+        off_t start = pos & ~(off_t) (align - 1);
+        size_t head = pos - start;
+        size_t len = size - done;
+        if (len > DISKIMG_BOUNCE_SIZE - head)
+            len = DISKIMG_BOUNCE_SIZE - head;
+        size_t span = (head + len + align - 1) & ~(align - 1);
+
+        if (!write || head || len != span) {
+            ret = pread(diskimg->fd, buf, span, start);
+            if (ret < 0)
+                break;
+            if ((size_t) ret < head + len) {
+                errno = EIO;
+                ret = -1;
+                break;
+            }
+        }
+        if (write) {
+            memcpy(buf + head, data + done, len);
+            ret = pwrite(diskimg->fd, buf, span, start);
+            if (ret >= 0 && (size_t) ret != span) {
+                errno = EIO;
+                ret = -1;
+            }
+            if (ret < 0)
+                break;
+        } else {
+            memcpy(data + done, buf + head, len);
+        }
+        done += len;
+    }
+
+    diskimg_put_bounce(diskimg, buf);
+    return ret < 0 ? ret : (ssize_t) done;
+}
+
+ssize_t diskimg_file_rw_vec(struct diskimg *diskimg,
+                            bool write,
+                            const struct iovec *iov,
+                            int iovcnt,
+                            off_t offset)
+{
+    size_t done = 0;
+
+    /* Unaligned segments are bounced one by one. */
+    if (!diskimg_aligned(diskimg, iov, iovcnt, offset)) {
+        for (int i = 0; i < iovcnt; i++) {
+            ssize_t ret =
+                diskimg_bounce_rw(diskimg, iov[i].iov_base, offset + done,
+                                  iov[i].iov_len, write);
+            if (ret < 0)
+                return done ? (ssize_t) done : -1;
+            done += ret;
+        }
+        return done;
+    }
+
+    while (iovcnt) {
+        int cnt = iovcnt < DISKIMG_IOV_MAX ? iovcnt : DISKIMG_IOV_MAX;
+        size_t want = 0;
+        for (int i = 0; i < cnt; i++)
+            want += iov[i].iov_len;
+        ssize_t ret;
+        if (write)
+            ret = pwritev2(diskimg->fd, iov, cnt, offset + done, 0);
+        else
+            ret = preadv2(diskimg->fd, iov, cnt, offset + done, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return done ? (ssize_t) done : -1;
+        done += ret;
+        if ((size_t) ret != want)
+            break;
+        iov += cnt;
+        iovcnt -= cnt;
+    }
+    return done;
+}
+
+static int diskimg_file_write_zeroes(struct diskimg *diskimg,
+                                     off_t offset,
+                                     size_t len)
+{
+    static uint8_t zeros[64 << 10] __attribute__((aligned(4096)));
+    struct iovec iov[16];
+
+    while (len) {
+        size_t n = 0;
+        int cnt = 0;
+        while (cnt < 16 && n < len) {
+            size_t seg = len - n < sizeof(zeros) ? len - n : sizeof(zeros);
+            iov[cnt++] = (struct iovec) {.iov_base = zeros, .iov_len = seg};
+            n += seg;
+        }
+        ssize_t ret = diskimg_file_rw_vec(diskimg, true, iov, cnt, offset);
+        if (ret < 0)
+            return -1;
+        if ((size_t) ret != n) {
+            errno = EIO;
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* BLKDISCARD takes whole logical sectors only; a partial one at either end
+ * is left as it is, which a discard allows.
+ */
+static int diskimg_blockdev_discard(struct diskimg *diskimg,
+                                    off_t offset,
+                                    size_t len)
+{
+    uint64_t mask = diskimg->align - 1;
+    uint64_t start = (offset + mask) & ~mask;
+    uint64_t end = (offset + len) & ~mask;
+    uint64_t range[2] = {start, end - start};
+
+    if (end <= start || ioctl(diskimg->fd, BLKDISCARD, range) == 0)
+        return 0;
+    return errno == EOPNOTSUPP ? 0 : -1;
+}
+
+int diskimg_file_discard(struct diskimg *diskimg,
+                         enum diskimg_discard mode,
+                         off_t offset,
+                         size_t len)
+{
+    int flags = mode == DISKIMG_ZERO ? FALLOC_FL_ZERO_RANGE
+                                     : FALLOC_FL_PUNCH_HOLE;
+
+    /* On a block device, punching a hole writes zeros. */
+    if (diskimg->blockdev && mode == DISKIMG_DISCARD)
+        return len ? diskimg_blockdev_discard(diskimg, offset, len) : 0;
+    if (!len ||
+        fallocate(diskimg->fd, flags | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+        return 0;
+    if (errno != EOPNOTSUPP)
+        return -1;
+    /* Discarding is only advice. Some file systems (tmpfs) punch holes but
+     * cannot zero a range; a hole reads as zeros just the same. Block
+     * devices without an unmapping write-zeroes command are the other way
+     * round, and zero the range in the kernel.
+     */
+    if (mode == DISKIMG_DISCARD)
+        return 0;
+    flags = mode == DISKIMG_ZERO ? FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE;
+    if (fallocate(diskimg->fd, flags | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+        return 0;
+    if (errno != EOPNOTSUPP)
+        return -1;
+    return diskimg_file_write_zeroes(diskimg, offset, len);
+}
+
+static const struct diskimg_ops diskimg_raw_ops = {
+    .name = "raw",
+    .rw_vec = diskimg_file_rw_vec,
+};
+
+ssize_t diskimg_rw_vec(struct diskimg *diskimg,
+                       bool write,
+                       const struct iovec *iov,
+                       int iovcnt,
+                       off_t offset)
+{
+    return diskimg->ops->rw_vec(diskimg, write, iov, iovcnt, offset);
+}
+
+/* pread/pwrite (or their vectored forms) carry the offset in the syscall,
+ * so concurrent virtq workers cannot race on a shared file pointer the way
+ * lseek+read does.
+ */
 ssize_t diskimg_read(struct diskimg *diskimg,
                      void *data,
                      off_t offset,
                      size_t size)
 {
-    /* pread/pwrite carry the offset in the syscall, so concurrent virtq
-     * workers cannot race on a shared file pointer the way lseek+read does.
-     */
-    return pread(diskimg->fd, data, size, offset);
+    struct iovec iov = {.iov_base = data, .iov_len = size};
+    return diskimg_rw_vec(diskimg, false, &iov, 1, offset);
 }
 
 ssize_t diskimg_write(struct diskimg *diskimg,
@@ -20,30 +259,450 @@ ssize_t diskimg_write(struct diskimg *diskimg,
                       off_t offset,
                       size_t size)
 {
-    return pwrite(diskimg->fd, data, size, offset);
+    struct iovec iov = {.iov_base = data, .iov_len = size};
+    return diskimg_rw_vec(diskimg, true, &iov, 1, offset);
+}
+
+int diskimg_discard(struct diskimg *diskimg,
+                    enum diskimg_discard mode,
+                    off_t offset,
+                    size_t len)
+{
+    if (diskimg->ops->discard)
+        return diskimg->ops->discard(diskimg, mode, offset, len);
+    return diskimg_file_discard(diskimg, mode, offset, len);
+}
+
+size_t diskimg_map(struct diskimg *diskimg,
+                   bool write,
+                   off_t offset,
+                   size_t len,
+                   off_t *host,
+                   enum diskimg_file *file)
+{
+    if (!diskimg->ops->map) {
+        *host = offset;
+        *file = DISKIMG_FILE_IMAGE;
+        return len;
+    }
+    return diskimg->ops->map(diskimg, write, offset, len, host, file);
+}
+
+int diskimg_iov_slice(const struct iovec *iov,
+                      int iovcnt,
+                      size_t skip,
+                      size_t *len,
+                      struct iovec *out,
+                      int max)
+{
+    size_t want = *len;
+    int cnt = 0;
+
+    *len = 0;
+    for (int i = 0; i < iovcnt && *len < want && cnt < max; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        size_t n = iov[i].iov_len - skip;
+        if (n > want - *len)
+            n = want - *len;
+        out[cnt++] = (struct iovec) {
+            .iov_base = (uint8_t *) iov[i].iov_base + skip,
+            .iov_len = n,
+        };
+        *len += n;
+        skip = 0;
+    }
+    return cnt;
+}
+
+static bool diskimg_is_zero_tail(const uint8_t *p, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (p[i])
+            return false;
+    }
+    return true;
+}
+
+/* Four vectors are ORed together before each test, so that a block of
+ * zeros costs one branch per 64 or 128 bytes; data usually fails the first
+ * test.
+ */
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static bool diskimg_is_zero_avx2(
+    const uint8_t *p,
+    size_t len)
+{
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        const __m256i *v = (const __m256i *) (p + i);
+        __m256i x = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256(v), _mm256_loadu_si256(v + 1)),
+            _mm256_or_si256(_mm256_loadu_si256(v + 2),
+                            _mm256_loadu_si256(v + 3)));
+        if (!_mm256_testz_si256(x, x))
+            return false;
+    }
+    return diskimg_is_zero_tail(p + i, len - i);
+}
+
+static bool diskimg_is_zero_sse2(const uint8_t *p, size_t len)
+{
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        const __m128i *v = (const __m128i *) (p + i);
+        __m128i x = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128(v), _mm_loadu_si128(v + 1)),
+            _mm_or_si128(_mm_loadu_si128(v + 2), _mm_loadu_si128(v + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) !=
+            0xffff)
+            return false;
+    }
+    return diskimg_is_zero_tail(p + i, len - i);
+}
+#elif defined(__aarch64__)
+static bool diskimg_is_zero_neon(const uint8_t *p, size_t len)
+{
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint8x16_t x = vorrq_u8(vorrq_u8(vld1q_u8(p + i), vld1q_u8(p + i + 16)),
+                                vorrq_u8(vld1q_u8(p + i + 32),
+                                         vld1q_u8(p + i + 48)));
+        if (vmaxvq_u8(x))
+            return false;
+    }
+    return diskimg_is_zero_tail(p + i, len - i);
+}
+#endif
+
+bool diskimg_is_zero(const void *buf, size_t len)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        return diskimg_is_zero_avx2(buf, len);
+    return diskimg_is_zero_sse2(buf, len);
+#elif defined(__aarch64__)
+    return diskimg_is_zero_neon(buf, len);
+#else
+    return diskimg_is_zero_tail(buf, len);
+#endif
+}
+
+void diskimg_iov_zero(const struct iovec *iov, int iovcnt, size_t skip)
+{
+    for (int i = 0; i < iovcnt; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        memset((uint8_t *) iov[i].iov_base + skip, 0, iov[i].iov_len - skip);
+        skip = 0;
+    }
 }
 
 int diskimg_flush(struct diskimg *diskimg)
 {
+    if (diskimg->ops->flush)
+        return diskimg->ops->flush(diskimg);
     return fdatasync(diskimg->fd);
 }
 
-int diskimg_init(struct diskimg *diskimg, const char *file_path)
+/* Direct I/O alignment as the kernel reports it (Linux 6.1+), else the
+ * file system block size, or a block device's logical sector size, which
+ * is always sufficient.
+ */
+static int diskimg_probe_align(struct diskimg *diskimg,
+                               const struct stat *st)
+{
+    diskimg->align = st->st_blksize;
+    diskimg->mem_align = st->st_blksize;
+    diskimg->physical_block = st->st_blksize;
+    if (diskimg->blockdev) {
+        int logical;
+        unsigned int physical;
+        if (ioctl(diskimg->fd, BLKSSZGET, &logical) < 0 ||
+            ioctl(diskimg->fd, BLKPBSZGET, &physical) < 0)
+            return -1;
+        diskimg->align = logical;
+        diskimg->mem_align = logical;
+        diskimg->physical_block = physical;
+    }
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    if (statx(diskimg->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+        (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align) {
+        diskimg->align = stx.stx_dio_offset_align;
+        diskimg->mem_align = stx.stx_dio_mem_align;
+    }
+#endif
+    if (diskimg->physical_block < diskimg->align)
+        diskimg->physical_block = diskimg->align;
+    return 0;
+}
+
+static int diskimg_init_bounce(struct diskimg *diskimg)
+{
+    size_t align = diskimg->mem_align > 4096 ? diskimg->mem_align : 4096;
+    for (int i = 0; i < DISKIMG_BOUNCE_BUFS; i++) {
+        void *p;
+        if (posix_memalign(&p, align, DISKIMG_BOUNCE_SIZE))
+            return -1;
+        diskimg->bounce[i] = p;
+    }
+    diskimg->bounce_free = (1U << DISKIMG_BOUNCE_BUFS) - 1;
+    pthread_mutex_init(&diskimg->bounce_lock, NULL);
+    pthread_cond_init(&diskimg->bounce_cond, NULL);
+    return 0;
+}
+
+int diskimg_init(struct diskimg *diskimg,
+                 const char *file_path,
+                 const char *base_path,
+                 enum diskimg_cache cache)
 {
-    diskimg->fd = open(file_path, O_RDWR);
+    *diskimg = (struct diskimg) {
+        .fd = -1,
+        .backing_fd = -1,
+        .ops = &diskimg_raw_ops,
+        .direct = cache == DISKIMG_CACHE_NONE,
+    };
+    diskimg->fd = open(file_path,
+                       O_RDWR | (diskimg->direct ? O_DIRECT : 0) |
+                           (base_path ? O_CREAT : 0),
+                       0644);
     if (diskimg->fd < 0)
         return -1;
     struct stat st;
-    if (fstat(diskimg->fd, &st) < 0) {
+    if (fstat(diskimg->fd, &st) < 0)
+        goto err;
+    diskimg->size = st.st_size;
+    diskimg->blockdev = S_ISBLK(st.st_mode);
+    if (diskimg->blockdev) {
+        uint64_t size;
+        if (ioctl(diskimg->fd, BLKGETSIZE64, &size) < 0)
+            goto err;
+        diskimg->size = size;
+        /* The guest has the device to itself; the host page cache would
+         * only hold a second copy of what the guest caches.
+         */
+        if (cache == DISKIMG_CACHE_DEFAULT &&
+            fcntl(diskimg->fd, F_SETFL,
+                  fcntl(diskimg->fd, F_GETFL) | O_DIRECT) == 0)
+            diskimg->direct = true;
+    }
+    if ((diskimg->direct || diskimg->blockdev) &&
+        diskimg_probe_align(diskimg, &st) < 0)
+        goto err;
+    if (diskimg->direct) {
+        /* A partial block at the end could only be written by extending
+         * the file, so it is left out of the disk.
+         */
+        diskimg->size &= ~(diskimg->align - 1);
+        if (diskimg->align > DISKIMG_BOUNCE_SIZE / 2 ||
+            diskimg_init_bounce(diskimg) < 0) {
+            errno = EINVAL;
+            goto err;
+        }
+    }
+    /* Image formats grow their file, which a block device cannot do: one
+     * is always raw, and never an overlay.
+     */
+    if (diskimg->blockdev && base_path) {
+        errno = EEXIST;
+        goto err;
+    }
+    if (diskimg->blockdev)
+        return 0;
+    if (base_path && !st.st_size &&
+        overlay_create(diskimg, base_path) < 0)
+        goto err;
+
+    if (overlay_probe(diskimg)) {
+        if (overlay_open(diskimg, base_path) < 0)
+            goto err;
+    } else if (base_path) {
+        /* Refuse to treat some other image as an overlay. */
+        errno = EEXIST;
+        goto err;
+    } else if (qcow2_probe(diskimg) && qcow2_open(diskimg) < 0) {
+        goto err;
+    }
+    return 0;
+
+err:;
+    int err = errno;
+    diskimg_exit(diskimg);
+    errno = err;
+    return -1;
+}
+
+void diskimg_exit(struct diskimg *diskimg)
+{
+    if (diskimg->ops && diskimg->ops->exit)
+        diskimg->ops->exit(diskimg);
+    diskimg->ops = &diskimg_raw_ops;
+    for (int i = 0; i < DISKIMG_BOUNCE_BUFS; i++) {
+        free(diskimg->bounce[i]);
+        diskimg->bounce[i] = NULL;
+    }
+    if (diskimg->fd >= 0)
         close(diskimg->fd);
-        diskimg->fd = -1;
+    if (diskimg->backing_fd >= 0)
+        close(diskimg->backing_fd);
+    diskimg->fd = -1;
+    diskimg->backing_fd = -1;
+}
+
+/* Only reads and writes of the registered files may go through the ring
+ * once it is enabled, and no further registration: io_uring operations do
+ * not pass through the --seccomp filter.
+ */
+static int diskimg_aio_restrict(struct diskimg_aio *aio)
+{
+    static const uint8_t ops[] = {
+        IORING_OP_READV,       IORING_OP_WRITEV, IORING_OP_READ_FIXED,
+        IORING_OP_WRITE_FIXED,
+    };
+    struct io_uring_restriction res[sizeof(ops) + 1];
+
+    memset(res, 0, sizeof(res));
+    for (size_t i = 0; i < sizeof(ops); i++) {
+        res[i].opcode = IORING_RESTRICTION_SQE_OP;
+        res[i].sqe_op = ops[i];
+    }
+    res[sizeof(ops)].opcode = IORING_RESTRICTION_SQE_FLAGS_REQUIRED;
+    res[sizeof(ops)].sqe_flags = IOSQE_FIXED_FILE;
+    if (uring_register(&aio->ring, IORING_REGISTER_RESTRICTIONS, res,
+                       sizeof(res) / sizeof(res[0])) < 0)
         return -1;
+    return uring_register(&aio->ring, IORING_REGISTER_ENABLE_RINGS, NULL, 0);
+}
+
+int diskimg_aio_init(struct diskimg *diskimg,
+                     struct diskimg_aio *aio,
+                     unsigned depth,
+                     int eventfd,
+                     const struct iovec *bufs,
+                     unsigned nr_bufs)
+{
+    *aio = (struct diskimg_aio) {.eventfd = eventfd};
+    if (uring_init(&aio->ring, depth, IORING_SETUP_R_DISABLED) < 0)
+        return -1;
+    int files[] = {
+        [DISKIMG_FILE_IMAGE] = diskimg->fd,
+        [DISKIMG_FILE_BACKING] = diskimg->backing_fd,
+    };
+    if (uring_register(&aio->ring, IORING_REGISTER_FILES, files,
+                       diskimg->backing_fd >= 0 ? 2 : 1) < 0 ||
+        uring_register(&aio->ring, IORING_REGISTER_EVENTFD, &aio->eventfd,
+                       1) < 0)
+        goto err;
+    /* Fixed buffers save the per-request page pinning, but registering
+     * them pins all of @bufs up front; go on without them if that is not
+     * allowed (RLIMIT_MEMLOCK, or a mapping io_uring cannot pin).
+     */
+    if (bufs && uring_register(&aio->ring, IORING_REGISTER_BUFFERS,
+                               (void *) bufs, nr_bufs) == 0) {
+        aio->bufs = bufs;
+        aio->nr_bufs = nr_bufs;
     }
-    diskimg->size = st.st_size;
+    if (diskimg_aio_restrict(aio) < 0)
+        goto err;
     return 0;
+
+err:;
+    int err = errno;
+    uring_exit(&aio->ring);
+    errno = err;
+    return -1;
 }
 
-void diskimg_exit(struct diskimg *diskimg)
+static int diskimg_aio_buf_index(struct diskimg_aio *aio,
+                                 const struct iovec *iov)
+{
+    uintptr_t start = (uintptr_t) iov->iov_base;
+    for (unsigned i = 0; i < aio->nr_bufs; i++) {
+        uintptr_t base = (uintptr_t) aio->bufs[i].iov_base;
+        if (start >= base &&
+            start + iov->iov_len <= base + aio->bufs[i].iov_len)
+            return i;
+    }
+    return -1;
+}
+
+/* @iov is read when the request is issued, which may be after
+ * diskimg_aio_submit returns: keep it in place until the completion.
+ */
+int diskimg_aio_rw(struct diskimg_aio *aio,
+                   bool write,
+                   const struct iovec *iov,
+                   int iovcnt,
+                   enum diskimg_file file,
+                   off_t offset,
+                   uint64_t tag)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&aio->ring);
+    if (!sqe) {
+        errno = EBUSY;
+        return -1;
+    }
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = file;
+    sqe->off = offset;
+    sqe->user_data = tag;
+
+    int index = iovcnt == 1 ? diskimg_aio_buf_index(aio, iov) : -1;
+    if (index >= 0) {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->addr = (uintptr_t) iov->iov_base;
+        sqe->len = iov->iov_len;
+        sqe->buf_index = index;
+    } else {
+        sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (uintptr_t) iov;
+        sqe->len = iovcnt;
+    }
+    aio->inflight++;
+    return 0;
+}
+
+int diskimg_aio_submit(struct diskimg_aio *aio, unsigned wait_nr)
+{
+    return uring_submit(&aio->ring, wait_nr);
+}
+
+unsigned diskimg_aio_reap(struct diskimg_aio *aio,
+                          void (*done)(void *opaque, uint64_t tag, int res),
+                          void *opaque)
+{
+    uint64_t n;
+    unsigned count = 0;
+    struct io_uring_cqe *cqe;
+
+    /* Clear the eventfd first: a completion posted while draining leaves it
+     * readable again rather than being missed.
+     */
+    if (read(aio->eventfd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        return 0;
+    while ((cqe = uring_peek_cqe(&aio->ring))) {
+        uint64_t tag = cqe->user_data;
+        int res = cqe->res;
+        uring_cqe_seen(&aio->ring);
+        aio->inflight--;
+        count++;
+        done(opaque, tag, res);
+    }
+    return count;
+}
+
+bool diskimg_aio_ready(struct diskimg_aio *aio)
+{
+    return uring_peek_cqe(&aio->ring) != NULL;
+}
+
+void diskimg_aio_exit(struct diskimg_aio *aio)
 {
-    close(diskimg->fd);
+    uring_exit(&aio->ring);
 }
@@ -1,12 +1,100 @@
 #pragma once
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
-/* simple backed by disk image file */
+#include "uring.h"
+
+/* Disk image file, raw or in an image format (see struct diskimg_ops). */
+
+/* Aligned buffers for O_DIRECT requests whose guest buffer, offset or
+ * length does not meet the alignment the file needs.
+ */
+#define DISKIMG_BOUNCE_BUFS 16
+/* Segments one vectored call takes (UIO_MAXIOV). */
+#define DISKIMG_IOV_MAX 1024
+#define DISKIMG_BOUNCE_SIZE (256 << 10)
+
+struct diskimg;
+
+/* Files an image is made of, as indexes into the ones registered with each
+ * diskimg_aio context.
+ */
+enum diskimg_file {
+    DISKIMG_FILE_IMAGE,
+    DISKIMG_FILE_BACKING, /* read-only base of an overlay */
+};
+
+/* Whether the image bypasses the host page cache (--disk-cache). */
+enum diskimg_cache {
+    DISKIMG_CACHE_DEFAULT, /* none for block devices, writeback for files */
+    DISKIMG_CACHE_WRITEBACK,
+    DISKIMG_CACHE_NONE, /* O_DIRECT */
+};
+
+/* What diskimg_discard leaves behind in a range. */
+enum diskimg_discard {
+    DISKIMG_DISCARD,    /* anything; the space may be given back */
+    DISKIMG_ZERO,       /* zeros, and the space stays allocated */
+    DISKIMG_ZERO_UNMAP, /* zeros; the space may be given back */
+};
+
+/* An image format: how the guest's disk offsets map onto the file. Raw
+ * images leave the optional hooks NULL.
+ */
+struct diskimg_ops {
+    const char *name;
+    ssize_t (*rw_vec)(struct diskimg *diskimg,
+                      bool write,
+                      const struct iovec *iov,
+                      int iovcnt,
+                      off_t offset);
+    /* Bytes from @offset on, up to @len, that lie contiguously in one file
+     * from *host on and may be accessed there directly; 0 if none. NULL
+     * maps everything to itself in the image file.
+     */
+    size_t (*map)(struct diskimg *diskimg,
+                  bool write,
+                  off_t offset,
+                  size_t len,
+                  off_t *host,
+                  enum diskimg_file *file);
+    /* Drop or zero guest bytes [offset, offset + len); NULL does that to
+     * the same bytes of the image file.
+     */
+    int (*discard)(struct diskimg *diskimg,
+                   enum diskimg_discard mode,
+                   off_t offset,
+                   size_t len);
+    /* Write out cached metadata and sync; NULL for a plain fdatasync. */
+    int (*flush)(struct diskimg *diskimg);
+    void (*exit)(struct diskimg *diskimg);
+};
 
 struct diskimg {
     int fd;
-    size_t size;
+    int backing_fd; /* or -1 */
+    size_t size; /* of the disk the guest sees */
+    /* A host block device: always raw, sized, and discarded with ioctls. */
+    bool blockdev;
+    const struct diskimg_ops *ops;
+    void *priv; /* format state */
+    /* Opened with O_DIRECT: I/O bypasses the host page cache, and file
+     * offsets and lengths must be multiples of align, memory addresses of
+     * mem_align. A block device has align set to its logical sector size
+     * either way.
+     */
+    bool direct;
+    size_t align;
+    size_t mem_align;
+    size_t physical_block; /* preferred I/O granularity of the backing */
+    uint8_t *bounce[DISKIMG_BOUNCE_BUFS];
+    unsigned bounce_free; /* bitmap of the free bounce buffers */
+    pthread_mutex_t bounce_lock;
+    pthread_cond_t bounce_cond;
 };
 
 ssize_t diskimg_read(struct diskimg *diskimg,
@@ -17,6 +105,106 @@ ssize_t diskimg_write(struct diskimg *diskimg,
                       void *data,
                       off_t offset,
                       size_t size);
+/* Returns the bytes moved, which is short only at an error or the end of
+ * the file.
+ */
+ssize_t diskimg_rw_vec(struct diskimg *diskimg,
+                       bool write,
+                       const struct iovec *iov,
+                       int iovcnt,
+                       off_t offset);
+/* I/O at file offsets, for formats: one preadv2/pwritev2 per
+ * DISKIMG_IOV_MAX segments, bounced if O_DIRECT needs it.
+ */
+ssize_t diskimg_file_rw_vec(struct diskimg *diskimg,
+                            bool write,
+                            const struct iovec *iov,
+                            int iovcnt,
+                            off_t offset);
+int diskimg_discard(struct diskimg *diskimg,
+                    enum diskimg_discard mode,
+                    off_t offset,
+                    size_t len);
+/* diskimg_discard at file offsets, for formats: one fallocate, or writes
+ * of zeros where the file system cannot do that.
+ */
+int diskimg_file_discard(struct diskimg *diskimg,
+                         enum diskimg_discard mode,
+                         off_t offset,
+                         size_t len);
+/* See diskimg_ops.map; only ranges it covers may go through diskimg_aio. */
+size_t diskimg_map(struct diskimg *diskimg,
+                   bool write,
+                   off_t offset,
+                   size_t len,
+                   off_t *host,
+                   enum diskimg_file *file);
+/* Point @out at bytes [skip, skip + *len) of @iov, in at most @max
+ * segments; *len is cut short if they do not reach that far.
+ */
+int diskimg_iov_slice(const struct iovec *iov,
+                      int iovcnt,
+                      size_t skip,
+                      size_t *len,
+                      struct iovec *out,
+                      int max);
+/* Whether the @len bytes at @buf are all zeros, compared a vector
+ * register at a time.
+ */
+bool diskimg_is_zero(const void *buf, size_t len);
+/* Zero @iov from byte @skip on. */
+void diskimg_iov_zero(const struct iovec *iov, int iovcnt, size_t skip);
 int diskimg_flush(struct diskimg *diskimg);
-int diskimg_init(struct diskimg *diskimg, const char *file_path);
+/* With @base_path, @file_path is a copy-on-write overlay of that image; it
+ * is created if it does not exist yet or is empty.
+ */
+int diskimg_init(struct diskimg *diskimg,
+                 const char *file_path,
+                 const char *base_path,
+                 enum diskimg_cache cache);
+/* Whether a request can go to the file as is, with no bounce buffer. */
+bool diskimg_aligned(const struct diskimg *diskimg,
+                     const struct iovec *iov,
+                     int iovcnt,
+                     off_t offset);
 void diskimg_exit(struct diskimg *diskimg);
+
+/* Asynchronous I/O on the image file through io_uring, one context per
+ * submitting thread; offsets are file offsets, see diskimg_map. Each request
+ * carries a caller tag that comes back with its result (bytes transferred or
+ * -errno); requests may complete in any order.
+ */
+struct diskimg_aio {
+    struct uring ring;
+    int eventfd; /* readable when completions are waiting */
+    const struct iovec *bufs; /* registered fixed buffers, or NULL */
+    unsigned nr_bufs;
+    unsigned inflight;
+};
+
+/* @bufs, if not NULL, is host memory (guest RAM) to register as fixed
+ * buffers; it must stay mapped at the same pages while the context lives.
+ * @eventfd is owned by the caller.
+ */
+int diskimg_aio_init(struct diskimg *diskimg,
+                     struct diskimg_aio *aio,
+                     unsigned depth,
+                     int eventfd,
+                     const struct iovec *bufs,
+                     unsigned nr_bufs);
+int diskimg_aio_rw(struct diskimg_aio *aio,
+                   bool write,
+                   const struct iovec *iov,
+                   int iovcnt,
+                   enum diskimg_file file,
+                   off_t offset,
+                   uint64_t tag);
+/* Submit what was queued, waiting for at least @wait_nr completions. */
+int diskimg_aio_submit(struct diskimg_aio *aio, unsigned wait_nr);
+/* Hand every available completion to @done; returns how many there were. */
+unsigned diskimg_aio_reap(struct diskimg_aio *aio,
+                          void (*done)(void *opaque, uint64_t tag, int res),
+                          void *opaque);
+/* Whether completions are waiting, without a system call. */
+bool diskimg_aio_ready(struct diskimg_aio *aio);
+void diskimg_aio_exit(struct diskimg_aio *aio);
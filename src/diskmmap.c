@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "diskmmap.h"
+
+/* Writes are tracked for msync in chunks of this size. */
+#define DISKMMAP_CHUNK (2ULL << 20)
+/* A sequential stream has this much past its end prefetched each time it
+ * crosses into another stretch of this size.
+ */
+#define DISKMMAP_READAHEAD (2ULL << 20)
+/* Sequential streams followed at once, e.g. one per guest queue. */
+#define DISKMMAP_STREAMS 8
+/* Requests over which the pattern is judged before the advice for the
+ * whole mapping is revised.
+ */
+#define DISKMMAP_WINDOW 256
+
+struct diskmmap {
+    uint8_t *base;
+    size_t len;
+    uint64_t *dirty; /* bit per chunk written since the last flush */
+    size_t dirty_words;
+    bool discarded; /* the file changed other than through the mapping */
+    /* Access pattern, updated by every worker without a lock: it only
+     * steers advice, so a lost update does no harm.
+     */
+    uint64_t stream_end[DISKMMAP_STREAMS];
+    unsigned next_stream;
+    unsigned window;
+    unsigned window_seq; /* requests in the window that continued a stream */
+    int advice;
+};
+
+/* Prefetch ahead of streams, and tell the kernel whether faults should read
+ * around (MADV_SEQUENTIAL) or just the page (MADV_RANDOM), from what most of
+ * the last DISKMMAP_WINDOW requests looked like.
+ */
+static void diskmmap_observe(struct diskmmap *m, uint64_t offset, size_t len)
+{
+    uint64_t end = offset + len;
+    bool seq = false;
+
+    for (int i = 0; i < DISKMMAP_STREAMS && !seq; i++) {
+        if (__atomic_load_n(&m->stream_end[i], __ATOMIC_RELAXED) == offset) {
+            __atomic_store_n(&m->stream_end[i], end, __ATOMIC_RELAXED);
+            seq = true;
+        }
+    }
+    if (!seq) {
+        unsigned i = __atomic_fetch_add(&m->next_stream, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&m->stream_end[i % DISKMMAP_STREAMS], end,
+                         __ATOMIC_RELAXED);
+    } else if (offset / DISKMMAP_READAHEAD != end / DISKMMAP_READAHEAD &&
+               end < m->len) {
+        uint64_t start = end & ~(uint64_t) (getpagesize() - 1);
+        size_t n = m->len - start < DISKMMAP_READAHEAD ? m->len - start
+                                                       : DISKMMAP_READAHEAD;
+        madvise(m->base + start, n, MADV_WILLNEED);
+    }
+
+    if (seq)
+        __atomic_fetch_add(&m->window_seq, 1, __ATOMIC_RELAXED);
+    if (__atomic_add_fetch(&m->window, 1, __ATOMIC_RELAXED) < DISKMMAP_WINDOW)
+        return;
+    __atomic_store_n(&m->window, 0, __ATOMIC_RELAXED);
+    unsigned nr_seq = __atomic_exchange_n(&m->window_seq, 0, __ATOMIC_RELAXED);
+    int advice = nr_seq >= DISKMMAP_WINDOW * 3 / 4 ? MADV_SEQUENTIAL
+                 : nr_seq <= DISKMMAP_WINDOW / 4   ? MADV_RANDOM
+                                                   : MADV_NORMAL;
+    if (__atomic_exchange_n(&m->advice, advice, __ATOMIC_RELAXED) != advice)
+        madvise(m->base, m->len, advice);
+}
+
+/* The copy a thread is in the middle of. A fault the file cannot back
+ * (ENOSPC in a hole, a media error, the file truncated behind us) raises
+ * SIGBUS, which jumps back and fails just that request.
+ */
+struct diskmmap_copy {
+    const struct diskmmap *m;
+    sigjmp_buf jmp;
+};
+static __thread struct diskmmap_copy *diskmmap_copy;
+static struct sigaction diskmmap_old_sigbus;
+
+static void diskmmap_sigbus(int sig, siginfo_t *info, void *ucontext)
+{
+    struct diskmmap_copy *c = diskmmap_copy;
+
+    if (c && (uint8_t *) info->si_addr - c->m->base < c->m->len)
+        siglongjmp(c->jmp, 1);
+    /* Not ours: the faulting access runs again, under the old handler. */
+    sigaction(SIGBUS, &diskmmap_old_sigbus, NULL);
+}
+
+static int diskmmap_catch_sigbus(void)
+{
+    static bool installed;
+    /* SA_NODEFER leaves SIGBUS unblocked after the jump, so sigsetjmp need
+     * not save the signal mask, which would cost a system call per request.
+     */
+    struct sigaction sa = {
+        .sa_sigaction = diskmmap_sigbus,
+        .sa_flags = SA_SIGINFO | SA_NODEFER,
+    };
+
+    if (installed)
+        return 0;
+    if (sigaction(SIGBUS, &sa, &diskmmap_old_sigbus) < 0)
+        return -1;
+    installed = true;
+    return 0;
+}
+
+static void diskmmap_mark(struct diskmmap *m, uint64_t offset, size_t len)
+{
+    uint64_t last = (offset + len - 1) / DISKMMAP_CHUNK;
+    for (uint64_t c = offset / DISKMMAP_CHUNK; c <= last; c++) {
+        uint64_t bit = 1ULL << (c % 64);
+        /* Read first: rewriting a marked chunk should not bounce the line
+         * between workers.
+         */
+        if (!(__atomic_load_n(&m->dirty[c / 64], __ATOMIC_RELAXED) & bit))
+            __atomic_fetch_or(&m->dirty[c / 64], bit, __ATOMIC_RELEASE);
+    }
+}
+
+static ssize_t diskmmap_rw_vec(struct diskimg *diskimg,
+                               bool write,
+                               const struct iovec *iov,
+                               int iovcnt,
+                               off_t offset)
+{
+    struct diskmmap *m = diskimg->priv;
+    struct diskmmap_copy copy = {.m = m};
+    size_t done = 0;
+    volatile size_t reached = 0; /* bytes the copy may have touched */
+
+    if ((uint64_t) offset >= m->len)
+        return 0;
+    if (sigsetjmp(copy.jmp, 0)) {
+        diskmmap_copy = NULL;
+        /* Whatever part of the request made it into the mapping is synced
+         * by the next flush.
+         */
+        if (write && reached)
+            diskmmap_mark(m, offset, reached);
+        errno = EIO;
+        return -1;
+    }
+    diskmmap_copy = &copy;
+    for (int i = 0; i < iovcnt && offset + done < m->len; i++) {
+        uint8_t *p = m->base + offset + done;
+        size_t n = iov[i].iov_len;
+        if (n > m->len - offset - done)
+            n = m->len - offset - done;
+        reached = done + n;
+        if (write)
+            memcpy(p, iov[i].iov_base, n);
+        else
+            memcpy(iov[i].iov_base, p, n);
+        done += n;
+    }
+    diskmmap_copy = NULL;
+    if (write && done)
+        diskmmap_mark(m, offset, done);
+    diskmmap_observe(m, offset, done);
+    return done;
+}
+
+/* Requests are served by copying, never by the io_uring. */
+static size_t diskmmap_map(struct diskimg *diskimg,
+                           bool write,
+                           off_t offset,
+                           size_t len,
+                           off_t *host,
+                           enum diskimg_file *file)
+{
+    return 0;
+}
+
+static int diskmmap_discard(struct diskimg *diskimg,
+                            enum diskimg_discard mode,
+                            off_t offset,
+                            size_t len)
+{
+    struct diskmmap *m = diskimg->priv;
+
+    /* fallocate, or zeros written with pwrite, are not in the dirty map. */
+    __atomic_store_n(&m->discarded, true, __ATOMIC_RELEASE);
+    return diskimg_file_discard(diskimg, mode, offset, len);
+}
+
+static int diskmmap_sync(struct diskmmap *m, uint64_t chunk, uint64_t nr)
+{
+    uint64_t off = chunk * DISKMMAP_CHUNK;
+    size_t len = nr * DISKMMAP_CHUNK;
+    if (len > m->len - off)
+        len = m->len - off;
+    if (msync(m->base + off, len, MS_SYNC) == 0)
+        return 0;
+    /* Left for the next flush to try again. */
+    diskmmap_mark(m, off, len);
+    return -1;
+}
+
+/* msync each run of chunks written since the last flush; a chunk written
+ * while this runs is either synced now or marked for the next one.
+ */
+static int diskmmap_flush(struct diskimg *diskimg)
+{
+    struct diskmmap *m = diskimg->priv;
+    uint64_t run = 0, nr = 0;
+    int ret = 0;
+
+    for (size_t w = 0; w < m->dirty_words; w++) {
+        uint64_t bits = 0;
+        if (__atomic_load_n(&m->dirty[w], __ATOMIC_RELAXED))
+            bits = __atomic_exchange_n(&m->dirty[w], 0, __ATOMIC_ACQUIRE);
+        while (bits) {
+            uint64_t c = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if (nr && c == run + nr) {
+                nr++;
+                continue;
+            }
+            if (nr && diskmmap_sync(m, run, nr) < 0)
+                ret = -1;
+            run = c;
+            nr = 1;
+        }
+    }
+    if (nr && diskmmap_sync(m, run, nr) < 0)
+        ret = -1;
+    if (__atomic_exchange_n(&m->discarded, false, __ATOMIC_ACQUIRE) &&
+        fdatasync(diskimg->fd) < 0)
+        ret = -1;
+    return ret;
+}
+
+static void diskmmap_exit(struct diskimg *diskimg)
+{
+    struct diskmmap *m = diskimg->priv;
+    if (!m)
+        return;
+    /* Dirty pages stay in the page cache and are written back as usual. */
+    munmap(m->base, m->len);
+    free(m->dirty);
+    free(m);
+    diskimg->priv = NULL;
+}
+
+static const struct diskimg_ops diskmmap_ops = {
+    .name = "mmap",
+    .rw_vec = diskmmap_rw_vec,
+    .map = diskmmap_map,
+    .discard = diskmmap_discard,
+    .flush = diskmmap_flush,
+    .exit = diskmmap_exit,
+};
+
+int diskmmap_open(struct diskimg *diskimg)
+{
+    if (diskimg->direct || strcmp(diskimg->ops->name, "raw") ||
+        !diskimg->size) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (diskmmap_catch_sigbus() < 0)
+        return -1;
+
+    struct diskmmap *m = calloc(1, sizeof(*m));
+    if (!m)
+        return -1;
+    m->len = diskimg->size;
+    m->dirty_words = (m->len + 64 * DISKMMAP_CHUNK - 1) / (64 * DISKMMAP_CHUNK);
+    m->dirty = calloc(m->dirty_words, sizeof(*m->dirty));
+    m->base = mmap(NULL, m->len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   diskimg->fd, 0);
+    if (!m->dirty || m->base == MAP_FAILED) {
+        int err = errno;
+        if (m->base != MAP_FAILED)
+            munmap(m->base, m->len);
+        free(m->dirty);
+        free(m);
+        errno = err;
+        return -1;
+    }
+    /* A --template clone gets a disk of its own, not this mapping. */
+    madvise(m->base, m->len, MADV_DONTFORK);
+    m->advice = MADV_NORMAL;
+    diskimg->ops = &diskmmap_ops;
+    diskimg->priv = m;
+    return 0;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "diskimg.h"
+
+/* Raw images served from a shared mapping of the whole file (--disk-io
+ * mmap): reads and writes are copies between guest RAM and the page cache,
+ * with no system call once the pages are resident. Readahead advice follows
+ * the access pattern, and a flush msyncs only what was written since the
+ * last one. A copy the file cannot back (no space for a hole, a media error,
+ * a truncated file) is caught as SIGBUS and fails its request with EIO.
+ */
+
+/* Take over @diskimg, which must be a raw image opened without O_DIRECT. */
+int diskmmap_open(struct diskimg *diskimg);
@@ -1,22 +1,130 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "err.h"
 #include "seccomp.h"
+#include "snapshot.h"
+#include "template.h"
 #include "vm.h"
 
 static char *kernel_file = NULL, *initrd_file = NULL, *diskimg_file = NULL;
+static char *snapshot_out = NULL, *template_socket = NULL;
 static int enable_seccomp = 0;
+static vm_config_t vm_config = {
+    .nr_vcpus = 1,
+    .ram_size = RAM_SIZE_DEFAULT,
+};
 
 /* Long-only option ids start above the ASCII range so they can never collide
  * with a short-option char in the getopt_long return.
  */
 enum {
     OPT_SECCOMP = 256,
+    OPT_MEM_BACKEND,
+    OPT_HUGEPAGE_SIZE,
+    OPT_MEM_PATH,
+    OPT_PREFAULT,
+    OPT_MAP_IMAGES,
+    OPT_MEM_NODES,
+    OPT_MEM_POLICY,
+    OPT_VCPU_CPUS,
+    OPT_IO_CPUS,
+    OPT_SNAPSHOT_OUT,
+    OPT_SNAPSHOT_IN,
+    OPT_SNAPSHOT_UFFD,
+    OPT_SNAPSHOT_TRACE,
+    OPT_TEMPLATE,
+    OPT_STATS,
+    OPT_BLK_QUEUES,
+    OPT_BLK_QUEUE_SIZE,
+    OPT_NET_QUEUE_SIZE,
+    OPT_DISK_IO,
+    OPT_DISK_CACHE,
+    OPT_DISK_BASE,
+    OPT_DISK_ZEROES,
+    OPT_IO_POLL,
 };
 
+/* Parse "<n>[K|M|G|T]" into bytes. A bare number is taken in units of
+ * default_unit. Returns 0 on success, -1 on a malformed or overflowing value.
+ */
+static int parse_size(const char *str, uint64_t default_unit, uint64_t *out)
+{
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(str, &end, 0);
+    if (errno || end == str)
+        return -1;
+
+    uint64_t unit = default_unit;
+    switch (*end) {
+    case '\0':
+        break;
+    case 'k':
+    case 'K':
+        unit = 1ULL << 10;
+        break;
+    case 'm':
+    case 'M':
+        unit = 1ULL << 20;
+        break;
+    case 'g':
+    case 'G':
+        unit = 1ULL << 30;
+        break;
+    case 't':
+    case 'T':
+        unit = 1ULL << 40;
+        break;
+    default:
+        return -1;
+    }
+    if (*end && end[1] != '\0')
+        return -1;
+    if (__builtin_mul_overflow((uint64_t) n, unit, out))
+        return -1;
+    return 0;
+}
+
+/* Parse a virtqueue size: a power of two the Linux driver accepts, with
+ * room for a request header, data and status. Returns 0 on success.
+ */
+static int parse_queue_size(const char *str, uint16_t *out)
+{
+    char *end;
+    errno = 0;
+    unsigned long n = strtoul(str, &end, 0);
+    if (errno || end == str || *end || n < 4 || n > VIRTQ_MAX_SIZE ||
+        (n & (n - 1)))
+        return -1;
+    *out = n;
+    return 0;
+}
+
+/* Parse the --io-poll spin limit in microseconds, 32 if omitted, into
+ * nanoseconds. Returns 0 on success.
+ */
+static int parse_poll_time(const char *str, uint32_t *out_ns)
+{
+    char *end;
+    unsigned long us = 32;
+    if (str) {
+        errno = 0;
+        us = strtoul(str, &end, 0);
+        if (errno || end == str || *end || us < 1 || us > 1000000)
+            return -1;
+    }
+    *out_ns = us * 1000;
+    return 0;
+}
+
 #define print_option(args, help_msg) printf("  %-30s%s", args, help_msg)
 
 static void usage(const char *execpath)
@@ -28,6 +136,56 @@ static void usage(const char *execpath)
     print_option("-i, --initrd initrd", "Initial RAM disk image\n");
     print_option("-d, --disk disk-image",
                  "Disk image for virtio-blk devices\n");
+    print_option("-c, --cpus N", "Number of vCPUs (default: 1)\n");
+    print_option("--blk-queues N",
+                 "virtio-blk queues, up to 16 (default: one per vCPU)\n");
+    print_option("--blk-queue-size N",
+                 "Descriptors per virtio-blk queue, up to 32768 (128)\n");
+    print_option("--net-queue-size N",
+                 "Descriptors per virtio-net queue, up to 32768 (128)\n");
+    print_option("--disk-io io_uring|sync|mmap",
+                 "How the disk image is accessed (default: io_uring)\n");
+    print_option("--disk-cache writeback|none",
+                 "none opens the disk with O_DIRECT, the default for "
+                 "block devices\n");
+    print_option("--disk-zeroes write|unmap",
+                 "unmap punches zeros out of the disk (default: write)\n");
+    print_option("--disk-base base-image",
+                 "-d is a copy-on-write overlay of base-image\n");
+    print_option("--io-poll[=usec]",
+                 "Busy-poll virtqueues up to usec before sleeping (32)\n");
+    print_option("-m, --memory size[K|M|G|T]",
+                 "Guest RAM size, in MiB without a suffix (default: 1G)\n");
+    print_option("--mem-backend anon|thp|hugetlb|file",
+                 "Host backing for guest RAM (default: anon)\n");
+    print_option("--hugepage-size size",
+                 "Huge page size for the hugetlb backend (2M, 1G)\n");
+    print_option("--mem-path path",
+                 "hugetlbfs directory or file for the file backend\n");
+    print_option("--prefault[=threads]",
+                 "Fault in all guest RAM at startup (default: 1 thread)\n");
+    print_option("--map-images",
+                 "Map the kernel and initrd into guest RAM, not copy them\n");
+    print_option("--mem-nodes list",
+                 "Host NUMA nodes for guest RAM, e.g. 0 or 0-1\n");
+    print_option("--mem-policy bind|interleave|preferred",
+                 "How guest RAM uses --mem-nodes (default: bind)\n");
+    print_option("--vcpu-cpus list",
+                 "Host CPUs for vCPU threads, one per vCPU if enough\n");
+    print_option("--io-cpus list",
+                 "Host CPUs for serial and virtio worker threads\n");
+    print_option("--snapshot-out file",
+                 "Save the VM when the guest writes the pause port\n");
+    print_option("--snapshot-in file",
+                 "Resume a saved VM instead of booting -k/-i\n");
+    print_option("--snapshot-uffd",
+                 "Restore RAM on demand through userfaultfd\n");
+    print_option("--snapshot-trace file",
+                 "Page order to prefetch; recorded if it does not exist\n");
+    print_option("--template socket",
+                 "At the pause port, serve fork()ed clones on socket\n");
+    print_option("--stats[=file]",
+                 "Count exits; JSON on SIGUSR2 and at exit (stderr)\n");
     print_option("--seccomp",
                  "Install a seccomp BPF allowlist before vm_run.\n");
 }
@@ -57,17 +215,127 @@ static void set_input_mode(void)
     tcsetattr(STDIN_FILENO, TCSANOW, &tattr);
 }
 
+static double ms_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 +
+           (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Create the VM and its devices, then either boot it from -k/-i or resume
+ * it from cfg->snapshot_in.
+ */
+static int vm_setup(vm_t *vm,
+                    const vm_config_t *cfg,
+                    const char *disk,
+                    const struct timespec *start)
+{
+    if (vm_init(vm, cfg) < 0)
+        return throw_err("Failed to initialize guest vm");
+
+    if (!cfg->snapshot_in) {
+        if (!kernel_file)
+            return throw_err(
+                "The kernel image must be used as the input of kvm-host!");
+        if (vm_load_image(vm, kernel_file) < 0)
+            return throw_err("Failed to load guest image");
+        if (initrd_file && vm_load_initrd(vm, initrd_file) < 0)
+            return throw_err("Failed to load initrd");
+    }
+    if (disk && vm_load_diskimg(vm, disk) < 0)
+        return throw_err("Failed to load disk image");
+    if (vm_enable_net(vm) < 0)
+        fprintf(stderr, "Failed to enable virtio-net device\n");
+
+    if (!cfg->snapshot_in)
+        return vm_late_init(vm);
+    if (vm_snapshot_restore(vm) < 0)
+        return -1;
+    if (!cfg->template_mem)
+        fprintf(stderr, "restored %s in %.1f ms\n", cfg->snapshot_in,
+                ms_since(start));
+    return 0;
+}
+
+/* Runs in a process fork()ed from the template: build a fresh KVM VM on the
+ * inherited RAM, load the template's state into it and run it with the
+ * client connection as its console.
+ */
+static int vm_run_clone(vm_t *template, const struct vm_clone *clone)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char state_path[32], disk_path[32];
+    snprintf(state_path, sizeof(state_path), "/proc/self/fd/%d",
+             clone->state_fd);
+    snprintf(disk_path, sizeof(disk_path), "/proc/self/fd/%d", clone->disk_fd);
+
+    vm_config_t cfg = template->cfg;
+    cfg.template_mem = &template->mem;
+    cfg.snapshot_in = state_path;
+    cfg.snapshot_uffd = false;
+    cfg.guest_pause = false;
+
+    if (dup2(clone->conn, STDIN_FILENO) < 0 ||
+        dup2(clone->conn, STDOUT_FILENO) < 0)
+        return throw_err("Failed to attach the clone console");
+    close(clone->conn);
+
+    static vm_t vm;
+    if (vm_setup(&vm, &cfg, clone->disk_fd >= 0 ? disk_path : NULL, &start) <
+        0)
+        return -1;
+    if (clone->disk_fd >= 0)
+        close(clone->disk_fd);
+    close(clone->state_fd);
+    fprintf(stderr, "clone %d ready in %.1f ms\n", (int) getpid(),
+            ms_since(&start));
+
+    if (enable_seccomp && seccomp_apply() < 0)
+        return -1;
+    vm_run(&vm);
+    vm_exit(&vm);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int option_index = 0;
     struct option opts[] = {
         {"kernel", 1, NULL, 'k'}, {"initrd", 1, NULL, 'i'},
-        {"disk", 1, NULL, 'd'},   {"seccomp", 0, NULL, OPT_SECCOMP},
-        {"help", 0, NULL, 'h'},
+        {"disk", 1, NULL, 'd'},   {"cpus", 1, NULL, 'c'},
+        {"blk-queues", 1, NULL, OPT_BLK_QUEUES},
+        {"blk-queue-size", 1, NULL, OPT_BLK_QUEUE_SIZE},
+        {"net-queue-size", 1, NULL, OPT_NET_QUEUE_SIZE},
+        {"disk-io", 1, NULL, OPT_DISK_IO},
+        {"disk-cache", 1, NULL, OPT_DISK_CACHE},
+        {"disk-base", 1, NULL, OPT_DISK_BASE},
+        {"disk-zeroes", 1, NULL, OPT_DISK_ZEROES},
+        {"io-poll", 2, NULL, OPT_IO_POLL},
+        {"memory", 1, NULL, 'm'},
+        {"mem-backend", 1, NULL, OPT_MEM_BACKEND},
+        {"hugepage-size", 1, NULL, OPT_HUGEPAGE_SIZE},
+        {"mem-path", 1, NULL, OPT_MEM_PATH},
+        {"prefault", 2, NULL, OPT_PREFAULT},
+        {"map-images", 0, NULL, OPT_MAP_IMAGES},
+        {"mem-nodes", 1, NULL, OPT_MEM_NODES},
+        {"mem-policy", 1, NULL, OPT_MEM_POLICY},
+        {"vcpu-cpus", 1, NULL, OPT_VCPU_CPUS},
+        {"io-cpus", 1, NULL, OPT_IO_CPUS},
+        {"snapshot-out", 1, NULL, OPT_SNAPSHOT_OUT},
+        {"snapshot-in", 1, NULL, OPT_SNAPSHOT_IN},
+        {"snapshot-uffd", 0, NULL, OPT_SNAPSHOT_UFFD},
+        {"snapshot-trace", 1, NULL, OPT_SNAPSHOT_TRACE},
+        {"template", 1, NULL, OPT_TEMPLATE},
+        {"stats", 2, NULL, OPT_STATS},
+        {"seccomp", 0, NULL, OPT_SECCOMP},
+        {"help", 0, NULL, 'h'},       {0, 0, 0, 0},
     };
 
     int c;
-    while ((c = getopt_long(argc, argv, "k:i:d:h", opts, &option_index)) !=
+    while ((c = getopt_long(argc, argv, "k:i:d:c:m:h", opts, &option_index)) !=
            -1) {
         switch (c) {
         case 'i':
@@ -79,6 +347,137 @@ int main(int argc, char *argv[])
         case 'd':
             diskimg_file = optarg;
             break;
+        case 'c':
+            vm_config.nr_vcpus = atoi(optarg);
+            break;
+        case OPT_BLK_QUEUES:
+            vm_config.blk_queues = atoi(optarg);
+            if (vm_config.blk_queues < 1 ||
+                vm_config.blk_queues > VIRTIO_BLK_MAX_QUEUES) {
+                fprintf(stderr, "Invalid virtio-blk queue count: %s\n",
+                        optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_BLK_QUEUE_SIZE:
+        case OPT_NET_QUEUE_SIZE:
+            if (parse_queue_size(optarg, c == OPT_BLK_QUEUE_SIZE
+                                             ? &vm_config.blk_queue_size
+                                             : &vm_config.net_queue_size) < 0) {
+                fprintf(stderr, "Invalid virtqueue size: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_DISK_IO:
+            if (strcmp(optarg, "io_uring") && strcmp(optarg, "sync") &&
+                strcmp(optarg, "mmap")) {
+                fprintf(stderr, "Unknown disk I/O mode: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            vm_config.disk_sync_io = strcmp(optarg, "io_uring") != 0;
+            vm_config.disk_mmap = !strcmp(optarg, "mmap");
+            break;
+        case OPT_DISK_CACHE:
+            if (strcmp(optarg, "writeback") && strcmp(optarg, "none")) {
+                fprintf(stderr, "Unknown disk cache mode: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            vm_config.disk_cache = !strcmp(optarg, "none")
+                                       ? DISKIMG_CACHE_NONE
+                                       : DISKIMG_CACHE_WRITEBACK;
+            break;
+        case OPT_DISK_ZEROES:
+            if (strcmp(optarg, "write") && strcmp(optarg, "unmap")) {
+                fprintf(stderr, "Unknown disk zeroes mode: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            vm_config.disk_unmap_zeroes = !strcmp(optarg, "unmap");
+            break;
+        case OPT_DISK_BASE:
+            vm_config.disk_base = optarg;
+            break;
+        case OPT_IO_POLL:
+            if (parse_poll_time(optarg, &vm_config.io_poll_ns) < 0) {
+                fprintf(stderr, "Invalid I/O poll time: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            if (parse_size(optarg, 1ULL << 20, &vm_config.ram_size) < 0) {
+                fprintf(stderr, "Invalid memory size: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_MEM_BACKEND:
+            if (guest_mem_parse_backend(optarg, &vm_config.mem_backend) < 0) {
+                fprintf(stderr, "Unknown memory backend: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_HUGEPAGE_SIZE:
+            if (parse_size(optarg, 1ULL << 20, &vm_config.hugepage_size) < 0) {
+                fprintf(stderr, "Invalid huge page size: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_MEM_PATH:
+            vm_config.mem_path = optarg;
+            vm_config.mem_backend = MEM_BACKEND_FILE;
+            break;
+        case OPT_PREFAULT:
+            vm_config.prefault_threads = optarg ? atoi(optarg) : 1;
+            if (vm_config.prefault_threads < 1) {
+                fprintf(stderr, "Invalid prefault thread count: %s\n",
+                        optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_MAP_IMAGES:
+            vm_config.map_images = true;
+            break;
+        case OPT_MEM_NODES:
+            if (numa_parse_list(optarg, &vm_config.mem_nodes) < 0) {
+                fprintf(stderr, "Invalid node list: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_MEM_POLICY:
+            if (numa_parse_policy(optarg, &vm_config.mem_policy) < 0) {
+                fprintf(stderr, "Unknown memory policy: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_VCPU_CPUS:
+        case OPT_IO_CPUS:
+            if (numa_parse_list(optarg, c == OPT_VCPU_CPUS
+                                            ? &vm_config.vcpu_cpus
+                                            : &vm_config.io_cpus) < 0) {
+                fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_SNAPSHOT_OUT:
+            snapshot_out = optarg;
+            vm_config.guest_pause = true;
+            break;
+        case OPT_SNAPSHOT_IN:
+            vm_config.snapshot_in = optarg;
+            break;
+        case OPT_SNAPSHOT_UFFD:
+            vm_config.snapshot_uffd = true;
+            break;
+        case OPT_SNAPSHOT_TRACE:
+            vm_config.snapshot_trace = optarg;
+            vm_config.snapshot_uffd = true;
+            break;
+        case OPT_TEMPLATE:
+            template_socket = optarg;
+            vm_config.guest_pause = true;
+            break;
+        case OPT_STATS:
+            vm_config.stats = true;
+            vm_config.stats_file = optarg;
+            break;
         case OPT_SECCOMP:
             enable_seccomp = 1;
             break;
@@ -90,31 +489,42 @@ int main(int argc, char *argv[])
         }
     }
 
-    vm_t vm;
-    if (vm_init(&vm) < 0)
-        return throw_err("Failed to initialize guest vm");
-
-    if (!kernel_file)
-        return throw_err(
-            "The kernel image must be used as the input of kvm-host!");
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    if (vm_load_image(&vm, kernel_file) < 0)
-        return throw_err("Failed to load guest image");
-    if (initrd_file && vm_load_initrd(&vm, initrd_file) < 0)
-        return throw_err("Failed to load initrd");
-    if (diskimg_file && vm_load_diskimg(&vm, diskimg_file) < 0)
-        return throw_err("Failed to load disk image");
-    if (vm_enable_net(&vm) < 0)
-        fprintf(stderr, "Failed to enable virtio-net device\n");
+    /* A restored VM takes its shape from the snapshot, not the command line;
+     * only the devices (-d, the TAP) have to be supplied again.
+     */
+    if (vm_config.snapshot_in) {
+        struct snapshot_header hdr;
+        if (snapshot_read_header(vm_config.snapshot_in, &hdr) < 0)
+            return -1;
+        vm_config.nr_vcpus = hdr.nr_vcpus;
+        vm_config.ram_size = hdr.ram_size;
+    }
 
-    if (vm_late_init(&vm) < 0)
+    vm_t vm;
+    if (vm_setup(&vm, &vm_config, diskimg_file, &start) < 0)
         return -1;
 
+    /* Opened now rather than at the pause so that it is not blocked by
+     * --seccomp.
+     */
+    int snapshot_fd = -1;
+    if (snapshot_out) {
+        snapshot_fd =
+            open(snapshot_out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (snapshot_fd < 0)
+            return throw_err("Failed to create snapshot %s", snapshot_out);
+    }
+
     /* Lock down the syscall surface before raw-mode and vm_run, so a
      * memory-corruption RCE in device emulation cannot escape to arbitrary host
-     * syscalls. Off by default — opt in via --seccomp.
+     * syscalls. Off by default — opt in via --seccomp. A template forks clones
+     * that need KVM_CREATE_VM, a disk and a TAP of their own, so there only
+     * the clones are locked down.
      */
-    if (enable_seccomp && seccomp_apply() < 0)
+    if (enable_seccomp && !template_socket && seccomp_apply() < 0)
         return -1;
 
     /* Switch the terminal to raw mode only once setup has succeeded so that any
@@ -123,6 +533,18 @@ int main(int argc, char *argv[])
     set_input_mode();
 
     vm_run(&vm);
+    if (vm.paused && snapshot_fd >= 0) {
+        if (vm_snapshot_save(&vm, snapshot_fd) == 0)
+            fprintf(stderr, "\nsnapshot saved to %s\n", snapshot_out);
+        close(snapshot_fd);
+    }
+    if (vm.paused && template_socket) {
+        reset_input_mode();
+        struct vm_clone clone;
+        if (vm_template_serve(&vm, template_socket, diskimg_file, &clone) < 0)
+            return -1;
+        return vm_run_clone(&vm, &clone);
+    }
     vm_exit(&vm);
 
     return 0;
@@ -0,0 +1,318 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/memfd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "mem.h"
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+
+#define THP_DEFAULT_SIZE (2UL << 20)
+
+static const char *backend_names[] = {
+    [MEM_BACKEND_ANON] = "anon",
+    [MEM_BACKEND_THP] = "thp",
+    [MEM_BACKEND_HUGETLB] = "hugetlb",
+    [MEM_BACKEND_FILE] = "file",
+};
+
+const char *guest_mem_backend_name(enum mem_backend backend)
+{
+    return backend_names[backend];
+}
+
+int guest_mem_parse_backend(const char *name, enum mem_backend *backend)
+{
+    for (size_t i = 0; i < sizeof(backend_names) / sizeof(backend_names[0]);
+         i++) {
+        if (!strcmp(name, backend_names[i])) {
+            *backend = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static size_t thp_pmd_size(void)
+{
+    size_t size = THP_DEFAULT_SIZE;
+    FILE *f =
+        fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+    if (f) {
+        unsigned long val;
+        if (fscanf(f, "%lu", &val) == 1 && val)
+            size = val;
+        fclose(f);
+    }
+    return size;
+}
+
+/* Anonymous mapping whose start is aligned to @align, so that the kernel can
+ * back it with PMD-sized pages from the first byte.
+ */
+static void *mmap_aligned_anon(size_t size, size_t align)
+{
+    size_t len = size + align;
+    uint8_t *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return MAP_FAILED;
+
+    uint8_t *start = (uint8_t *) (((uintptr_t) p + align - 1) & ~(align - 1));
+    if (start > p)
+        munmap(p, start - p);
+    if (start + size < p + len)
+        munmap(start + size, p + len - (start + size));
+    return start;
+}
+
+static int memfd_hugetlb_flags(size_t hugepage_size, unsigned int *flags)
+{
+    *flags = MFD_CLOEXEC | MFD_HUGETLB;
+    if (!hugepage_size)
+        return 0;
+    if (hugepage_size & (hugepage_size - 1))
+        return -1;
+    /* The page size is encoded as log2 in the MFD_HUGE_SHIFT field. */
+    *flags |= (unsigned int) __builtin_ctzll(hugepage_size) << MFD_HUGE_SHIFT;
+    return 0;
+}
+
+static int open_backing_file(const char *path, size_t *page_size)
+{
+    struct stat st;
+    int fd;
+
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        /* A directory (typically a hugetlbfs mount): create a file and
+         * unlink it right away so nothing is left behind when kvm-host exits.
+         */
+        char tmpl[4096];
+        snprintf(tmpl, sizeof(tmpl), "%s/kvm-host.XXXXXX", path);
+        fd = mkstemp(tmpl);
+        if (fd >= 0)
+            unlink(tmpl);
+    } else {
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    }
+    if (fd < 0)
+        return -1;
+
+    struct statfs sfs;
+    if (fstatfs(fd, &sfs) == 0 && sfs.f_type == HUGETLBFS_MAGIC)
+        *page_size = sfs.f_bsize;
+    else
+        *page_size = getpagesize();
+    return fd;
+}
+
+int guest_mem_alloc(struct guest_mem *m,
+                    size_t size,
+                    enum mem_backend backend,
+                    size_t hugepage_size,
+                    const char *path)
+{
+    *m = (struct guest_mem) {
+        .size = size,
+        .fd = -1,
+        .backend = backend,
+        .page_size = getpagesize(),
+    };
+
+    switch (backend) {
+    case MEM_BACKEND_ANON:
+        m->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (m->base == MAP_FAILED)
+            return throw_err("Failed to mmap vm memory");
+        break;
+    case MEM_BACKEND_THP:
+        m->page_size = thp_pmd_size();
+        m->base = mmap_aligned_anon(size, m->page_size);
+        if (m->base == MAP_FAILED)
+            return throw_err("Failed to mmap vm memory");
+        if (madvise(m->base, size, MADV_HUGEPAGE) < 0)
+            return throw_err("Failed to enable transparent huge pages");
+        break;
+    case MEM_BACKEND_HUGETLB: {
+        unsigned int flags;
+        if (memfd_hugetlb_flags(hugepage_size, &flags) < 0) {
+            errno = EINVAL;
+            return throw_err("Invalid huge page size %zu", hugepage_size);
+        }
+        m->fd = syscall(SYS_memfd_create, "kvm-host-ram", flags);
+        if (m->fd < 0)
+            return throw_err("Failed to create hugetlb memfd");
+        struct stat st;
+        if (fstat(m->fd, &st) < 0)
+            return throw_err("Failed to stat hugetlb memfd");
+        m->page_size = st.st_blksize;
+        break;
+    }
+    case MEM_BACKEND_FILE:
+        if (!path) {
+            errno = EINVAL;
+            return throw_err("The file memory backend needs --mem-path");
+        }
+        m->fd = open_backing_file(path, &m->page_size);
+        if (m->fd < 0)
+            return throw_err("Failed to open %s", path);
+        break;
+    }
+
+    if (m->fd >= 0) {
+        if (size % m->page_size) {
+            errno = EINVAL;
+            return throw_err("Memory size must be a multiple of %zu KiB",
+                             m->page_size >> 10);
+        }
+        if (ftruncate(m->fd, size) < 0)
+            return throw_err("Failed to size guest memory file");
+        /* hugetlb reserves the whole range here, so a host without enough
+         * free huge pages fails now rather than with SIGBUS at runtime.
+         */
+        m->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd,
+                       0);
+        if (m->base == MAP_FAILED)
+            return throw_err("Failed to mmap guest memory file");
+    }
+    return 0;
+}
+
+struct prefault_job {
+    uint8_t *start;
+    size_t len;
+    size_t page_size;
+    pthread_t tid;
+    bool threaded;
+    int ret;
+};
+
+static void *prefault_worker(void *arg)
+{
+    struct prefault_job *job = (struct prefault_job *) arg;
+
+    if (madvise(job->start, job->len, MADV_POPULATE_WRITE) == 0)
+        return NULL;
+    if (errno != EINVAL) {
+        job->ret = -1;
+        return NULL;
+    }
+    /* Pre-5.14 kernels: touch one byte per page. A volatile read-modify-write
+     * forces a write fault without changing the contents.
+     */
+    for (size_t off = 0; off < job->len; off += job->page_size) {
+        volatile uint8_t *p = job->start + off;
+        *p = *p;
+    }
+    return NULL;
+}
+
+int guest_mem_prefault(struct guest_mem *m, int nr_threads)
+{
+    if (nr_threads < 1)
+        nr_threads = 1;
+
+    size_t pages = m->size / m->page_size;
+    if (!pages)
+        pages = 1;
+    if ((size_t) nr_threads > pages)
+        nr_threads = pages;
+
+    struct prefault_job *jobs = calloc(nr_threads, sizeof(*jobs));
+    if (!jobs)
+        return throw_err("Failed to allocate prefault workers");
+
+    /* Split on backing-page boundaries so no huge page is shared between two
+     * workers.
+     */
+    size_t per_job = pages / nr_threads;
+    size_t extra = pages % nr_threads;
+    uint8_t *p = m->base;
+    int ret = 0;
+    for (int i = 0; i < nr_threads; i++) {
+        size_t n = per_job + ((size_t) i < extra);
+        jobs[i] = (struct prefault_job) {
+            .start = p,
+            .len = n * m->page_size,
+            .page_size = m->page_size,
+        };
+        /* The last slice also takes a THP range's sub-PMD tail. */
+        if (i == nr_threads - 1)
+            jobs[i].len = (uint8_t *) m->base + m->size - jobs[i].start;
+        p += jobs[i].len;
+        jobs[i].threaded = pthread_create(&jobs[i].tid, NULL, prefault_worker,
+                                          &jobs[i]) == 0;
+        /* Fall back to doing this slice on the calling thread. */
+        if (!jobs[i].threaded)
+            prefault_worker(&jobs[i]);
+    }
+    for (int i = 0; i < nr_threads; i++) {
+        if (jobs[i].threaded)
+            pthread_join(jobs[i].tid, NULL);
+        if (jobs[i].ret < 0)
+            ret = -1;
+    }
+
+    free(jobs);
+    if (ret < 0)
+        return throw_err("Failed to prefault guest memory");
+    return 0;
+}
+
+/* Sum the AnonHugePages of the VMAs covering the guest mapping. */
+static size_t thp_backed_bytes(const struct guest_mem *m)
+{
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (!f)
+        return 0;
+
+    uintptr_t lo = (uintptr_t) m->base, hi = lo + m->size;
+    bool inside = false;
+    size_t total = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long start, end, kb;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+            inside = start >= lo && end <= hi;
+        else if (inside && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+            total += (size_t) kb << 10;
+    }
+    fclose(f);
+    return total;
+}
+
+void guest_mem_report(const struct guest_mem *m)
+{
+    fprintf(stderr, "guest memory: %zu MiB, backend %s, page size %zu KiB",
+            m->size >> 20, guest_mem_backend_name(m->backend),
+            m->page_size >> 10);
+    if (m->backend == MEM_BACKEND_THP)
+        fprintf(stderr, ", %zu MiB in huge pages", thp_backed_bytes(m) >> 20);
+    fprintf(stderr, "\n");
+}
+
+void guest_mem_free(struct guest_mem *m)
+{
+    if (m->base && m->base != MAP_FAILED)
+        munmap(m->base, m->size);
+    if (m->fd >= 0)
+        close(m->fd);
+    m->base = NULL;
+    m->fd = -1;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* How guest RAM is backed on the host. */
+enum mem_backend {
+    MEM_BACKEND_ANON = 0, /* private anonymous 4K pages */
+    MEM_BACKEND_THP,      /* private anonymous, MADV_HUGEPAGE */
+    MEM_BACKEND_HUGETLB,  /* memfd_create(MFD_HUGETLB), shared */
+    MEM_BACKEND_FILE,     /* file on a hugetlbfs (or tmpfs) mount, shared */
+};
+
+struct guest_mem {
+    void *base;
+    size_t size;
+    int fd; /* -1 for the anonymous backends */
+    enum mem_backend backend;
+    /* Host page size backing the mapping: the hugetlb page size for the
+     * hugetlb/file backends, the PMD size for THP and the base page size
+     * otherwise. THP is best effort; guest_mem_report tells how much of the
+     * range actually got huge pages.
+     */
+    size_t page_size;
+};
+
+/* Map @size bytes of guest RAM. @hugepage_size selects the hugetlb page size
+ * for MEM_BACKEND_HUGETLB (0 = system default); @path is the directory or
+ * file for MEM_BACKEND_FILE.
+ */
+int guest_mem_alloc(struct guest_mem *m,
+                    size_t size,
+                    enum mem_backend backend,
+                    size_t hugepage_size,
+                    const char *path);
+/* Fault in every page of the mapping using @nr_threads workers. */
+int guest_mem_prefault(struct guest_mem *m, int nr_threads);
+void guest_mem_report(const struct guest_mem *m);
+void guest_mem_free(struct guest_mem *m);
+const char *guest_mem_backend_name(enum mem_backend backend);
+int guest_mem_parse_backend(const char *name, enum mem_backend *backend);
@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "numa.h"
+
+void numa_mask_set(numa_mask_t *mask, int bit)
+{
+    mask->bits[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static bool numa_mask_test(const numa_mask_t *mask, int bit)
+{
+    return mask->bits[bit / 64] & (1ULL << (bit % 64));
+}
+
+bool numa_mask_empty(const numa_mask_t *mask)
+{
+    return numa_mask_weight(mask) == 0;
+}
+
+int numa_mask_weight(const numa_mask_t *mask)
+{
+    int n = 0;
+    for (size_t i = 0; i < NUMA_MASK_BITS / 64; i++)
+        n += __builtin_popcountll(mask->bits[i]);
+    return n;
+}
+
+int numa_mask_nth(const numa_mask_t *mask, int n)
+{
+    for (int bit = 0; bit < NUMA_MASK_BITS; bit++) {
+        if (numa_mask_test(mask, bit) && n-- == 0)
+            return bit;
+    }
+    return -1;
+}
+
+int numa_parse_list(const char *str, numa_mask_t *mask)
+{
+    memset(mask, 0, sizeof(*mask));
+    const char *p = str;
+    while (*p) {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p || lo < 0)
+            return -1;
+        p = end;
+        if (*p == '-') {
+            hi = strtol(p + 1, &end, 10);
+            if (end == p + 1 || hi < lo)
+                return -1;
+            p = end;
+        }
+        if (hi >= NUMA_MASK_BITS)
+            return -1;
+        for (long i = lo; i <= hi; i++)
+            numa_mask_set(mask, i);
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return -1;
+    }
+    return numa_mask_empty(mask) ? -1 : 0;
+}
+
+int numa_parse_policy(const char *str, enum numa_policy *policy)
+{
+    static const char *names[] = {
+        [NUMA_POLICY_BIND] = "bind",
+        [NUMA_POLICY_INTERLEAVE] = "interleave",
+        [NUMA_POLICY_PREFERRED] = "preferred",
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (!strcmp(str, names[i])) {
+            *policy = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int numa_bind_memory(void *addr,
+                     size_t len,
+                     const numa_mask_t *nodes,
+                     enum numa_policy policy)
+{
+    static const int modes[] = {
+        [NUMA_POLICY_BIND] = MPOL_BIND,
+        [NUMA_POLICY_INTERLEAVE] = MPOL_INTERLEAVE,
+        [NUMA_POLICY_PREFERRED] = MPOL_PREFERRED,
+    };
+    /* MPOL_PREFERRED takes a single node: the first one in the list. */
+    numa_mask_t mask = *nodes;
+    if (policy == NUMA_POLICY_PREFERRED) {
+        memset(&mask, 0, sizeof(mask));
+        numa_mask_set(&mask, numa_mask_nth(nodes, 0));
+    }
+    /* The kernel reads maxnode - 1 bits. */
+    return syscall(SYS_mbind, addr, len, modes[policy], mask.bits,
+                   NUMA_MASK_BITS + 1, MPOL_MF_MOVE);
+}
+
+int numa_get_thread_cpus(numa_mask_t *cpus)
+{
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) < 0)
+        return -1;
+    memset(cpus, 0, sizeof(*cpus));
+    for (int i = 0; i < CPU_SETSIZE && i < NUMA_MASK_BITS; i++) {
+        if (CPU_ISSET(i, &set))
+            numa_mask_set(cpus, i);
+    }
+    return 0;
+}
+
+int numa_pin_thread(pthread_t tid, const numa_mask_t *cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < CPU_SETSIZE && i < NUMA_MASK_BITS; i++) {
+        if (numa_mask_test(cpus, i))
+            CPU_SET(i, &set);
+    }
+    errno = pthread_setaffinity_np(tid, sizeof(set), &set);
+    return errno ? -1 : 0;
+}
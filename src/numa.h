@@ -0,0 +1,42 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Fixed-size CPU/node bitmap. Kept independent of cpu_set_t so that headers
+ * including this one do not need _GNU_SOURCE.
+ */
+#define NUMA_MASK_BITS 1024
+
+typedef struct {
+    uint64_t bits[NUMA_MASK_BITS / 64];
+} numa_mask_t;
+
+enum numa_policy {
+    NUMA_POLICY_BIND = 0,
+    NUMA_POLICY_INTERLEAVE,
+    NUMA_POLICY_PREFERRED,
+};
+
+/* Parse a list such as "0-3,8,10-11". Returns 0 on success, -1 on a
+ * malformed list or an entry beyond NUMA_MASK_BITS.
+ */
+int numa_parse_list(const char *str, numa_mask_t *mask);
+int numa_parse_policy(const char *str, enum numa_policy *policy);
+bool numa_mask_empty(const numa_mask_t *mask);
+int numa_mask_weight(const numa_mask_t *mask);
+/* Index of the n-th (0-based) set bit, or -1 if fewer bits are set. */
+int numa_mask_nth(const numa_mask_t *mask, int n);
+void numa_mask_set(numa_mask_t *mask, int bit);
+
+/* Apply a memory policy over [addr, addr + len) and migrate any pages that
+ * are already populated.
+ */
+int numa_bind_memory(void *addr,
+                     size_t len,
+                     const numa_mask_t *nodes,
+                     enum numa_policy policy);
+int numa_get_thread_cpus(numa_mask_t *cpus);
+int numa_pin_thread(pthread_t tid, const numa_mask_t *cpus);
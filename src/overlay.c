@@ -0,0 +1,519 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "overlay.h"
+
+#define OVERLAY_MAGIC "KVMHCOW1"
+#define OVERLAY_VERSION 1
+#define OVERLAY_HEADER_SIZE 4096
+/* Data starts on a boundary that any O_DIRECT alignment or reflink block
+ * size divides.
+ */
+#define OVERLAY_DATA_ALIGN (1 << 20)
+/* The bitmap is written back in pages of this size. */
+#define OVERLAY_BITMAP_PAGE 4096
+
+struct overlay_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t size; /* of the disk */
+    uint64_t bitmap_offset;
+    uint64_t data_offset; /* where the data of disk offset 0 would be */
+    char base[OVERLAY_HEADER_SIZE - 40]; /* absolute path, NUL-terminated */
+};
+
+struct overlay {
+    /* Serializes copy-ups and bitmap write-back. Writes to blocks that are
+     * in the overlay already and all reads go without it.
+     */
+    pthread_mutex_t lock;
+    unsigned block_bits;
+    uint64_t *bitmap; /* bit set: the block's data is in the overlay */
+    size_t bitmap_len;
+    uint64_t bitmap_offset;
+    uint64_t data_offset;
+    uint8_t *dirty; /* per bitmap page */
+    bool any_dirty;
+    uint8_t *fill; /* two blocks of base data around a copy-up */
+    uint8_t *zeros; /* a block of them */
+    struct iovec iov[DISKIMG_IOV_MAX + 2];
+};
+
+static int overlay_file_rw(struct diskimg *diskimg,
+                           bool write,
+                           void *buf,
+                           size_t len,
+                           uint64_t offset)
+{
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    ssize_t ret = diskimg_file_rw_vec(diskimg, write, &iov, 1, offset);
+    if (ret >= 0 && (size_t) ret != len)
+        errno = EIO;
+    return ret >= 0 && (size_t) ret == len ? 0 : -1;
+}
+
+static bool overlay_has(const struct overlay *o, uint64_t block)
+{
+    return __atomic_load_n(&o->bitmap[block / 64], __ATOMIC_ACQUIRE) >>
+               (block % 64) &
+           1;
+}
+
+/* Length of the part of [offset, offset + len) whose blocks are all in the
+ * overlay, or all not, as *in_overlay says.
+ */
+static size_t overlay_run(const struct overlay *o,
+                          uint64_t offset,
+                          size_t len,
+                          bool *in_overlay)
+{
+    uint64_t end = offset + len;
+    uint64_t block = offset >> o->block_bits;
+
+    *in_overlay = overlay_has(o, block);
+    uint64_t pos = (block + 1) << o->block_bits;
+    while (pos < end && overlay_has(o, pos >> o->block_bits) == *in_overlay)
+        pos += 1ULL << o->block_bits;
+    return (pos < end ? pos : end) - offset;
+}
+
+/* Read from the base. Past its end, which only a partial last block can
+ * reach, reads as zeros.
+ */
+static ssize_t overlay_base_read(struct diskimg *diskimg,
+                                 const struct iovec *iov,
+                                 int iovcnt,
+                                 uint64_t offset)
+{
+    ssize_t ret;
+    do {
+        ret = preadv2(diskimg->backing_fd, iov, iovcnt, offset, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret >= 0)
+        diskimg_iov_zero(iov, iovcnt, ret);
+    return ret;
+}
+
+static void overlay_mark(struct overlay *o, uint64_t block)
+{
+    __atomic_fetch_or(&o->bitmap[block / 64], 1ULL << (block % 64),
+                      __ATOMIC_RELEASE);
+    o->dirty[block / 8 / OVERLAY_BITMAP_PAGE] = 1;
+    o->any_dirty = true;
+}
+
+/* First write to blocks that are still the base's: write the whole blocks
+ * to the overlay, the parts the request does not cover taken from the
+ * base, and only then send reads to them. Returns the bytes written, 0 if
+ * another thread got to the first block meanwhile.
+ */
+static ssize_t overlay_copy_up(struct diskimg *diskimg,
+                               const struct iovec *iov,
+                               int iovcnt,
+                               uint64_t offset,
+                               size_t len)
+{
+    struct overlay *o = diskimg->priv;
+    uint64_t bs = 1ULL << o->block_bits;
+    bool in_overlay;
+    ssize_t ret = 0;
+
+    pthread_mutex_lock(&o->lock);
+    len = overlay_run(o, offset, len, &in_overlay);
+    if (in_overlay)
+        goto out;
+
+    uint64_t start = offset & ~(bs - 1);
+    uint8_t *head = o->fill, *tail = o->fill + bs;
+    struct iovec fill = {.iov_base = head, .iov_len = bs};
+    int cnt = 0;
+
+    if (start < offset) {
+        if (overlay_base_read(diskimg, &fill, 1, start) < 0)
+            goto err;
+        o->iov[cnt++] = (struct iovec) {
+            .iov_base = head,
+            .iov_len = offset - start,
+        };
+    }
+    cnt += diskimg_iov_slice(iov, iovcnt, 0, &len, &o->iov[cnt],
+                             DISKIMG_IOV_MAX);
+    uint64_t end = offset + len;
+    uint64_t stop = (end + bs - 1) & ~(bs - 1);
+    if (end < stop) {
+        uint64_t block = end & ~(bs - 1);
+        /* Head and tail may be the same block, read in already. */
+        if (block != start || start == offset) {
+            fill.iov_base = tail;
+            if (overlay_base_read(diskimg, &fill, 1, block) < 0)
+                goto err;
+        }
+        o->iov[cnt++] = (struct iovec) {
+            .iov_base = (uint8_t *) fill.iov_base + (end - block),
+            .iov_len = stop - end,
+        };
+    }
+
+    size_t want = stop - start;
+    ret = diskimg_file_rw_vec(diskimg, true, o->iov, cnt,
+                              o->data_offset + start);
+    if (ret < 0)
+        goto err;
+    if ((size_t) ret != want) {
+        errno = EIO;
+        goto err;
+    }
+    for (uint64_t pos = start; pos < stop; pos += bs)
+        overlay_mark(o, pos >> o->block_bits);
+    ret = len;
+    goto out;
+
+err:
+    ret = -1;
+out:
+    pthread_mutex_unlock(&o->lock);
+    return ret;
+}
+
+static ssize_t overlay_rw_vec(struct diskimg *diskimg,
+                              bool write,
+                              const struct iovec *iov,
+                              int iovcnt,
+                              off_t offset)
+{
+    struct overlay *o = diskimg->priv;
+    struct iovec sub[DISKIMG_IOV_MAX];
+    size_t total = 0, done = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    if ((uint64_t) offset >= diskimg->size)
+        return 0;
+    if (total > diskimg->size - offset)
+        total = diskimg->size - offset;
+
+    while (done < total) {
+        uint64_t pos = offset + done;
+        bool in_overlay;
+        size_t len = overlay_run(o, pos, total - done, &in_overlay);
+        int cnt = diskimg_iov_slice(iov, iovcnt, done, &len, sub,
+                                    DISKIMG_IOV_MAX);
+        ssize_t ret;
+
+        if (in_overlay)
+            ret = diskimg_file_rw_vec(diskimg, write, sub, cnt,
+                                      o->data_offset + pos);
+        else if (write)
+            ret = overlay_copy_up(diskimg, sub, cnt, pos, len);
+        else
+            ret = overlay_base_read(diskimg, sub, cnt, pos);
+        if (ret < 0)
+            return done ? (ssize_t) done : -1;
+        if (in_overlay && (size_t) ret != len)
+            return done + ret;
+        /* A copy-up may stop short where another thread allocated. */
+        done += write && !in_overlay ? (size_t) ret : len;
+    }
+    return done;
+}
+
+/* Zero blocks that are still the base's by taking them into the overlay:
+ * whole blocks as they are in the overlay file, zeroed there, and part of
+ * one by a copy-up of zeros. Returns the bytes done, 0 if another thread
+ * took in the first block meanwhile.
+ */
+static ssize_t overlay_zero_up(struct diskimg *diskimg,
+                               enum diskimg_discard mode,
+                               uint64_t offset,
+                               size_t len)
+{
+    struct overlay *o = diskimg->priv;
+    uint64_t bs = 1ULL << o->block_bits;
+    size_t head = bs - (offset & (bs - 1));
+    bool in_overlay;
+
+    if (head != bs || len < bs) {
+        struct iovec iov = {
+            .iov_base = o->zeros,
+            .iov_len = len < head ? len : head,
+        };
+        return overlay_copy_up(diskimg, &iov, 1, offset, iov.iov_len);
+    }
+
+    ssize_t ret = 0;
+    pthread_mutex_lock(&o->lock);
+    len = overlay_run(o, offset, len & ~(bs - 1), &in_overlay);
+    if (!in_overlay) {
+        ret = diskimg_file_discard(diskimg, mode, o->data_offset + offset,
+                                   len);
+        for (uint64_t pos = offset; !ret && pos < offset + len; pos += bs)
+            overlay_mark(o, pos >> o->block_bits);
+        if (!ret)
+            ret = len;
+    }
+    pthread_mutex_unlock(&o->lock);
+    return ret;
+}
+
+/* A discard leaves blocks that are still the base's as they are. */
+static int overlay_discard(struct diskimg *diskimg,
+                           enum diskimg_discard mode,
+                           off_t offset,
+                           size_t len)
+{
+    struct overlay *o = diskimg->priv;
+    size_t done = 0;
+
+    while (done < len) {
+        uint64_t pos = offset + done;
+        bool in_overlay;
+        size_t n = overlay_run(o, pos, len - done, &in_overlay);
+        if (in_overlay) {
+            if (diskimg_file_discard(diskimg, mode, o->data_offset + pos,
+                                     n) < 0)
+                return -1;
+        } else if (mode != DISKIMG_DISCARD) {
+            ssize_t ret = overlay_zero_up(diskimg, mode, pos, n);
+            if (ret < 0)
+                return -1;
+            n = ret;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/* Reads go wherever the blocks are; writes only to blocks in the overlay,
+ * the others need a copy-up first.
+ */
+static size_t overlay_map(struct diskimg *diskimg,
+                          bool write,
+                          off_t offset,
+                          size_t len,
+                          off_t *host,
+                          enum diskimg_file *file)
+{
+    struct overlay *o = diskimg->priv;
+    bool in_overlay;
+
+    if ((uint64_t) offset >= diskimg->size)
+        return 0;
+    if (len > diskimg->size - offset)
+        len = diskimg->size - offset;
+    len = overlay_run(o, offset, len, &in_overlay);
+    if (in_overlay) {
+        *host = o->data_offset + offset;
+        *file = DISKIMG_FILE_IMAGE;
+    } else if (!write) {
+        *host = offset;
+        *file = DISKIMG_FILE_BACKING;
+    } else {
+        return 0;
+    }
+    return len;
+}
+
+static int overlay_flush(struct diskimg *diskimg)
+{
+    struct overlay *o = diskimg->priv;
+    int ret = 0;
+
+    pthread_mutex_lock(&o->lock);
+    if (o->any_dirty) {
+        /* Copied-up blocks reach the disk before the bits that send reads
+         * to them.
+         */
+        ret = fdatasync(diskimg->fd);
+        for (size_t p = 0; !ret && p < o->bitmap_len / OVERLAY_BITMAP_PAGE;
+             p++) {
+            if (!o->dirty[p])
+                continue;
+            ret = overlay_file_rw(diskimg, true,
+                                  (uint8_t *) o->bitmap +
+                                      p * OVERLAY_BITMAP_PAGE,
+                                  OVERLAY_BITMAP_PAGE,
+                                  o->bitmap_offset + p * OVERLAY_BITMAP_PAGE);
+            if (!ret)
+                o->dirty[p] = 0;
+        }
+        if (!ret)
+            o->any_dirty = false;
+    }
+    pthread_mutex_unlock(&o->lock);
+    return ret < 0 ? ret : fdatasync(diskimg->fd);
+}
+
+static void overlay_exit(struct diskimg *diskimg)
+{
+    struct overlay *o = diskimg->priv;
+    if (!o)
+        return;
+    free(o->bitmap);
+    free(o->dirty);
+    free(o->fill);
+    free(o->zeros);
+    pthread_mutex_destroy(&o->lock);
+    free(o);
+    diskimg->priv = NULL;
+}
+
+static const struct diskimg_ops overlay_ops = {
+    .name = "overlay",
+    .rw_vec = overlay_rw_vec,
+    .map = overlay_map,
+    .discard = overlay_discard,
+    .flush = overlay_flush,
+    .exit = overlay_exit,
+};
+
+bool overlay_probe(struct diskimg *diskimg)
+{
+    char magic[8];
+    return overlay_file_rw(diskimg, false, magic, sizeof(magic), 0) == 0 &&
+           !memcmp(magic, OVERLAY_MAGIC, sizeof(magic));
+}
+
+static size_t overlay_bitmap_len(uint64_t size, uint32_t block_size)
+{
+    uint64_t blocks = (size + block_size - 1) / block_size;
+    uint64_t bytes = (blocks + 63) / 64 * 8;
+    return (bytes + OVERLAY_BITMAP_PAGE - 1) & ~(OVERLAY_BITMAP_PAGE - 1ULL);
+}
+
+/* lseek rather than st_size, which is 0 for a block device. */
+static off_t overlay_fd_size(int fd)
+{
+    return lseek(fd, 0, SEEK_END);
+}
+
+static off_t overlay_base_size(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    off_t size = overlay_fd_size(fd);
+    close(fd);
+    return size;
+}
+
+int overlay_create(struct diskimg *diskimg, const char *base_path)
+{
+    struct overlay_header *h;
+    char path[PATH_MAX];
+
+    if (!realpath(base_path, path))
+        return throw_err("Failed to find base image %s", base_path);
+    off_t size = overlay_base_size(path);
+    if (size < 0)
+        return throw_err("Failed to open base image %s", path);
+    if (strlen(path) >= sizeof(h->base)) {
+        errno = ENAMETOOLONG;
+        return throw_err("Base image path %s is too long", path);
+    }
+    if (posix_memalign((void **) &h, 4096, sizeof(*h)))
+        return -1;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, OVERLAY_MAGIC, sizeof(h->magic));
+    h->version = OVERLAY_VERSION;
+    h->block_size = OVERLAY_BLOCK_SIZE;
+    h->size = size & ~511ULL;
+    h->bitmap_offset = OVERLAY_HEADER_SIZE;
+    h->data_offset = (h->bitmap_offset +
+                      overlay_bitmap_len(h->size, h->block_size) +
+                      OVERLAY_DATA_ALIGN - 1) &
+                     ~(OVERLAY_DATA_ALIGN - 1ULL);
+    strcpy(h->base, path);
+
+    uint64_t end = h->data_offset + ((h->size + h->block_size - 1) &
+                                     ~(h->block_size - 1ULL));
+    int ret = 0;
+    if (ftruncate(diskimg->fd, end) < 0 ||
+        overlay_file_rw(diskimg, true, h, sizeof(*h), 0) < 0)
+        ret = throw_err("Failed to create the overlay");
+    free(h);
+    return ret;
+}
+
+static int overlay_check_header(const struct overlay_header *h)
+{
+    uint32_t bs = h->block_size;
+    if (h->version != OVERLAY_VERSION)
+        return throw_err("Overlay version %u is not supported", h->version);
+    if (bs < 512 || bs > OVERLAY_DATA_ALIGN || (bs & (bs - 1)) ||
+        h->bitmap_offset < OVERLAY_HEADER_SIZE ||
+        h->bitmap_offset % OVERLAY_BITMAP_PAGE ||
+        h->data_offset < h->bitmap_offset + overlay_bitmap_len(h->size, bs) ||
+        h->data_offset % bs || !memchr(h->base, 0, sizeof(h->base)))
+        return throw_err("Corrupt overlay header");
+    return 0;
+}
+
+int overlay_open(struct diskimg *diskimg, const char *base_path)
+{
+    struct overlay_header *h;
+    int ret = -1;
+
+    if (posix_memalign((void **) &h, 4096, sizeof(*h)))
+        return -1;
+    if (overlay_file_rw(diskimg, false, h, sizeof(*h), 0) < 0) {
+        throw_err("Failed to read the overlay header");
+        goto out;
+    }
+    errno = ENOTSUP;
+    if (overlay_check_header(h) < 0)
+        goto out;
+
+    if (!base_path)
+        base_path = h->base;
+    diskimg->backing_fd = open(base_path, O_RDONLY);
+    off_t size = diskimg->backing_fd < 0
+                     ? -1
+                     : overlay_fd_size(diskimg->backing_fd);
+    if (size < 0) {
+        throw_err("Failed to open base image %s", base_path);
+        goto out;
+    }
+    if ((uint64_t) size < h->size) {
+        errno = ENOTSUP;
+        throw_err("Base image %s is smaller than the overlay", base_path);
+        goto out;
+    }
+
+    struct overlay *o = calloc(1, sizeof(*o));
+    if (!o)
+        goto out;
+    diskimg->ops = &overlay_ops;
+    diskimg->priv = o;
+    diskimg->size = h->size;
+    pthread_mutex_init(&o->lock, NULL);
+    o->block_bits = __builtin_ctz(h->block_size);
+    o->bitmap_offset = h->bitmap_offset;
+    o->data_offset = h->data_offset;
+    o->bitmap_len = overlay_bitmap_len(h->size, h->block_size);
+    o->dirty = calloc(o->bitmap_len / OVERLAY_BITMAP_PAGE, 1);
+    o->zeros = calloc(1, h->block_size);
+    if (!o->dirty || !o->zeros ||
+        posix_memalign((void **) &o->bitmap, 4096, o->bitmap_len) ||
+        posix_memalign((void **) &o->fill, 4096, 2 * h->block_size)) {
+        throw_err("Failed to allocate the overlay bitmap");
+        goto out;
+    }
+    if (overlay_file_rw(diskimg, false, o->bitmap, o->bitmap_len,
+                        o->bitmap_offset) < 0) {
+        throw_err("Failed to read the overlay bitmap");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    free(h);
+    return ret;
+}
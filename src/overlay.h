@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "diskimg.h"
+
+/* Copy-on-write overlay of a raw base image that is only ever read, so any
+ * number of VMs can share it and its page cache. The overlay file holds a
+ * header, a bitmap of the blocks written so far, and the data of those
+ * blocks, sparse, at the offset they have on the disk. Reads of blocks not
+ * in the bitmap go to the base; the first write to one copies the rest of
+ * it up.
+ */
+#define OVERLAY_BLOCK_SIZE 4096
+
+/* Whether the opened file starts with the overlay magic. */
+bool overlay_probe(struct diskimg *diskimg);
+/* Turn the empty file open in @diskimg into an overlay of @base_path. Only
+ * the header is written: the bitmap and data are holes.
+ */
+int overlay_create(struct diskimg *diskimg, const char *base_path);
+/* Take over @diskimg; @base_path, if not NULL, stands in for the base
+ * recorded in the overlay.
+ */
+int overlay_open(struct diskimg *diskimg, const char *base_path);
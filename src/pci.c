@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "pci.h"
+#include "snapshot.h"
 #include "utils.h"
 
 static void pci_address_io(void *owner,
@@ -74,7 +75,20 @@ static void pci_config_bar(struct pci_dev *dev, uint8_t bar)
     uint32_t old_bar = PCI_HDR_READ(dev->hdr, PCI_BAR_OFFSET(bar), 32);
     uint32_t new_bar = (old_bar & mask) | (dev->bar_layout[bar] & ~mask);
     PCI_HDR_WRITE(dev->hdr, PCI_BAR_OFFSET(bar), new_bar, 32);
+
+    /* The bus keeps its devices sorted by base, so a BAR that moves while
+     * decoding is enabled is taken off the bus and put back at its new
+     * address.
+     */
+    bool active = dev->bar_active[bar];
+    struct bus *bus = dev->bar_layout[bar] & PCI_BASE_ADDRESS_SPACE_IO
+                          ? dev->io_bus
+                          : dev->mmio_bus;
+    if (active)
+        pci_deactivate_bar(dev, bar, bus);
     dev->space_dev[bar].base = new_bar & mask;
+    if (active)
+        pci_activate_bar(dev, bar, bus);
 }
 
 static void pci_config_write(struct pci_dev *dev,
@@ -177,6 +191,26 @@ void pci_dev_init(struct pci_dev *dev,
     dev->mmio_bus = mmio_bus;
 }
 
+int pci_dev_save(struct pci_dev *dev, int fd)
+{
+    return snapshot_write(fd, dev->cfg_space, sizeof(dev->cfg_space));
+}
+
+int pci_dev_restore(struct pci_dev *dev, int fd)
+{
+    if (snapshot_read(fd, dev->cfg_space, sizeof(dev->cfg_space)) < 0)
+        return -1;
+    /* Replay the BAR and command writes so the BARs are decoded on the I/O
+     * and MMIO buses where the guest left them.
+     */
+    for (int i = 0; i < PCI_STD_NUM_BARS; i++) {
+        if (dev->bar_size[i])
+            pci_config_bar(dev, i);
+    }
+    pci_config_command(dev);
+    return 0;
+}
+
 void pci_dev_register(struct pci_dev *dev)
 {
     /* FIXEME: It just simplifies the registration on pci bus 0 */
@@ -187,6 +221,16 @@ void pci_dev_register(struct pci_dev *dev)
     bus_register_dev(dev->pci_bus, &dev->config_dev);
 }
 
+int pci_save(struct pci *pci, int fd)
+{
+    return snapshot_write(fd, &pci->pci_addr, sizeof(pci->pci_addr));
+}
+
+int pci_restore(struct pci *pci, int fd)
+{
+    return snapshot_read(fd, &pci->pci_addr, sizeof(pci->pci_addr));
+}
+
 #define PCI_CONFIG_ADDR 0xCF8
 #define PCI_CONFIG_DATA 0xCFC
 #define PCI_MMIO_SIZE (1UL << 16)
@@ -58,8 +58,13 @@ void pci_set_bar(struct pci_dev *dev,
                  dev_io_fn do_io);
 void pci_set_status(struct pci_dev *dev, uint16_t status);
 void pci_dev_register(struct pci_dev *dev);
+/* Config space only; the BAR layout is fixed by the device model. */
+int pci_dev_save(struct pci_dev *dev, int fd);
+int pci_dev_restore(struct pci_dev *dev, int fd);
 void pci_dev_init(struct pci_dev *dev,
                   struct pci *pci,
                   struct bus *io_bus,
                   struct bus *mmio_bus);
 void pci_init(struct pci *pci);
+int pci_save(struct pci *pci, int fd);
+int pci_restore(struct pci *pci, int fd);
@@ -0,0 +1,807 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "qcow2.h"
+
+#define QCOW2_MAGIC 0x514649fb /* "QFI\xfb" */
+
+#define QCOW2_OFLAG_COPIED (1ULL << 63)
+#define QCOW2_OFLAG_COMPRESSED (1ULL << 62)
+#define QCOW2_OFLAG_ZERO 1ULL
+#define QCOW2_OFFSET_MASK 0x00fffffffffffe00ULL
+#define QCOW2_RT_OFFSET_MASK (~0x1ffULL)
+
+/* Tables kept in memory. 64 L2 tables of 64 KiB clusters map 32 GiB. */
+#define QCOW2_L2_CACHE_SIZE 64
+#define QCOW2_RB_CACHE_SIZE 16
+/* The file is grown this much at a time, so that clusters allocated one
+ * after the other also lie one after the other on the host.
+ */
+#define QCOW2_PREALLOC (4 << 20)
+
+struct qcow2_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t backing_file_offset;
+    uint32_t backing_file_size;
+    uint32_t cluster_bits;
+    uint64_t size;
+    uint32_t crypt_method;
+    uint32_t l1_size;
+    uint64_t l1_table_offset;
+    uint64_t refcount_table_offset;
+    uint32_t refcount_table_clusters;
+    uint32_t nb_snapshots;
+    uint64_t snapshots_offset;
+    /* version 3 */
+    uint64_t incompatible_features;
+    uint64_t compatible_features;
+    uint64_t autoclear_features;
+    uint32_t refcount_order;
+    uint32_t header_length;
+} __attribute__((packed));
+
+#define QCOW2_V2_HEADER_SIZE \
+    offsetof(struct qcow2_header, incompatible_features)
+
+/* A cached L2 table or refcount block, one cluster in size. */
+struct qcow2_table {
+    uint64_t offset; /* in the file; 0 for an unused slot */
+    uint64_t last_use;
+    bool dirty;
+    void *data;
+};
+
+struct qcow2_cache {
+    struct qcow2_table *tables;
+    unsigned nr;
+};
+
+enum qcow2_extent {
+    QCOW2_DATA,
+    QCOW2_ZERO, /* unallocated, or allocated with the zero flag */
+    QCOW2_COMPRESSED,
+};
+
+struct qcow2 {
+    /* Held over metadata lookups and updates, not over guest data I/O. */
+    pthread_mutex_t lock;
+    unsigned cluster_bits;
+    uint64_t cluster_size;
+    unsigned l2_bits; /* log2 of the entries in an L2 table */
+    unsigned rb_bits; /* log2 of the 16-bit refcounts in a block */
+    bool has_zero_flag;
+
+    uint64_t *l1; /* big-endian, as on disk */
+    uint32_t l1_size;
+    uint64_t l1_offset;
+    bool l1_dirty;
+    uint64_t *rt; /* refcount table, big-endian */
+    uint64_t rt_size;
+    uint64_t rt_offset;
+    bool rt_dirty;
+
+    uint64_t next_free; /* where the search for free clusters starts */
+    uint64_t file_end;  /* the file is at least this long */
+    uint64_t clock;
+    struct qcow2_cache l2_cache;
+    struct qcow2_cache rb_cache;
+};
+
+static int qcow2_file_rw(struct diskimg *diskimg,
+                         bool write,
+                         void *buf,
+                         size_t len,
+                         uint64_t offset)
+{
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    ssize_t ret = diskimg_file_rw_vec(diskimg, write, &iov, 1, offset);
+    if (ret >= 0 && (size_t) ret != len)
+        errno = EIO;
+    return ret >= 0 && (size_t) ret == len ? 0 : -1;
+}
+
+static int qcow2_table_write(struct diskimg *diskimg, struct qcow2_table *t)
+{
+    struct qcow2 *q = diskimg->priv;
+    if (qcow2_file_rw(diskimg, true, t->data, q->cluster_size, t->offset) < 0)
+        return -1;
+    t->dirty = false;
+    return 0;
+}
+
+static bool qcow2_cache_dirty(const struct qcow2_cache *c)
+{
+    for (unsigned i = 0; i < c->nr; i++) {
+        if (c->tables[i].dirty)
+            return true;
+    }
+    return false;
+}
+
+static int qcow2_cache_write(struct diskimg *diskimg, struct qcow2_cache *c)
+{
+    for (unsigned i = 0; i < c->nr; i++) {
+        if (c->tables[i].dirty && qcow2_table_write(diskimg, &c->tables[i]) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static bool qcow2_refcounts_dirty(const struct qcow2 *q)
+{
+    return q->rt_dirty || qcow2_cache_dirty(&q->rb_cache);
+}
+
+static int qcow2_refcounts_write(struct diskimg *diskimg)
+{
+    struct qcow2 *q = diskimg->priv;
+    if (qcow2_cache_write(diskimg, &q->rb_cache) < 0)
+        return -1;
+    if (q->rt_dirty) {
+        if (qcow2_file_rw(diskimg, true, q->rt, q->rt_size * sizeof(*q->rt),
+                          q->rt_offset) < 0)
+            return -1;
+        q->rt_dirty = false;
+    }
+    return 0;
+}
+
+/* Refcounts reach the disk before any L2 entry that uses the clusters they
+ * count: a crash in between leaks clusters but never hands one out twice.
+ */
+static int qcow2_evict(struct diskimg *diskimg,
+                       struct qcow2_cache *c,
+                       struct qcow2_table *t)
+{
+    struct qcow2 *q = diskimg->priv;
+    if (c == &q->l2_cache && qcow2_refcounts_dirty(q) &&
+        (qcow2_refcounts_write(diskimg) < 0 || fdatasync(diskimg->fd) < 0))
+        return -1;
+    return qcow2_table_write(diskimg, t);
+}
+
+/* The table at @offset in the file, read in unless it is cached. @fresh
+ * starts it out zeroed instead, for a newly allocated one.
+ */
+static struct qcow2_table *qcow2_cache_get(struct diskimg *diskimg,
+                                           struct qcow2_cache *c,
+                                           uint64_t offset,
+                                           bool fresh)
+{
+    struct qcow2 *q = diskimg->priv;
+    struct qcow2_table *t = NULL;
+
+    for (unsigned i = 0; i < c->nr; i++) {
+        if (c->tables[i].offset == offset) {
+            t = &c->tables[i];
+            goto found;
+        }
+        if (!t || c->tables[i].last_use < t->last_use)
+            t = &c->tables[i];
+    }
+    if (t->dirty && qcow2_evict(diskimg, c, t) < 0)
+        return NULL;
+    t->offset = 0;
+    if (!fresh &&
+        qcow2_file_rw(diskimg, false, t->data, q->cluster_size, offset) < 0)
+        return NULL;
+    t->offset = offset;
+
+found:
+    if (fresh) {
+        memset(t->data, 0, q->cluster_size);
+        t->dirty = true;
+    }
+    t->last_use = ++q->clock;
+    return t;
+}
+
+/* Refcount block counting the cluster at @offset, or NULL with errno 0 if
+ * there is none yet.
+ */
+static struct qcow2_table *qcow2_rb_get(struct diskimg *diskimg,
+                                        uint64_t offset,
+                                        unsigned *index)
+{
+    struct qcow2 *q = diskimg->priv;
+    uint64_t cluster = offset >> q->cluster_bits;
+    uint64_t rt_index = cluster >> q->rb_bits;
+
+    *index = cluster & ((1ULL << q->rb_bits) - 1);
+    errno = 0;
+    if (rt_index >= q->rt_size)
+        return NULL;
+    uint64_t rb = be64toh(q->rt[rt_index]) & QCOW2_RT_OFFSET_MASK;
+    if (!rb)
+        return NULL;
+    return qcow2_cache_get(diskimg, &q->rb_cache, rb, false);
+}
+
+static int qcow2_refcount_get(struct diskimg *diskimg, uint64_t offset)
+{
+    unsigned i;
+    struct qcow2_table *t = qcow2_rb_get(diskimg, offset, &i);
+    if (!t)
+        return errno ? -1 : 0;
+    return be16toh(((uint16_t *) t->data)[i]);
+}
+
+/* Find @n free clusters in a row and take them. They read as zeros: the
+ * file only ever grows past them.
+ */
+static int64_t qcow2_reserve(struct diskimg *diskimg, unsigned n)
+{
+    struct qcow2 *q = diskimg->priv;
+    uint64_t start = q->next_free;
+
+    for (unsigned got = 0; got < n;) {
+        uint64_t off = start + ((uint64_t) got << q->cluster_bits);
+        int ref = qcow2_refcount_get(diskimg, off);
+        if (ref < 0)
+            return -1;
+        if (ref) {
+            start += (uint64_t) (got + 1) << q->cluster_bits;
+            got = 0;
+        } else {
+            got++;
+        }
+    }
+    q->next_free = start + ((uint64_t) n << q->cluster_bits);
+
+    if (q->next_free > q->file_end) {
+        uint64_t end = q->next_free + QCOW2_PREALLOC;
+        if (fallocate(diskimg->fd, 0, q->file_end, end - q->file_end) < 0 &&
+            (errno != EOPNOTSUPP || ftruncate(diskimg->fd, end) < 0))
+            return -1;
+        q->file_end = end;
+    }
+    return start;
+}
+
+static int qcow2_refcount_set(struct diskimg *diskimg,
+                              uint64_t offset,
+                              uint16_t ref);
+
+/* Move the refcount table to a place at the end of the file with room for
+ * entry @rt_index. The header is switched over once the new table is on
+ * disk.
+ */
+static int qcow2_grow_rt(struct diskimg *diskimg, uint64_t rt_index)
+{
+    struct qcow2 *q = diskimg->priv;
+    uint64_t per_cluster = q->cluster_size / sizeof(*q->rt);
+    uint64_t old_offset = q->rt_offset;
+    uint64_t old_clusters = q->rt_size / per_cluster;
+    uint64_t clusters = old_clusters * 2;
+
+    while (clusters * per_cluster <= rt_index)
+        clusters *= 2;
+    if (clusters > UINT32_MAX) {
+        errno = ENOSPC;
+        return -1;
+    }
+    int64_t offset = qcow2_reserve(diskimg, clusters);
+    if (offset < 0)
+        return -1;
+    void *rt;
+    if (posix_memalign(&rt, 4096, clusters << q->cluster_bits))
+        return -1;
+    memset(rt, 0, clusters << q->cluster_bits);
+    memcpy(rt, q->rt, q->rt_size * sizeof(*q->rt));
+    free(q->rt);
+    q->rt = rt;
+    q->rt_size = clusters * per_cluster;
+    q->rt_offset = offset;
+    q->rt_dirty = true;
+    for (uint64_t c = 0; c < clusters; c++) {
+        if (qcow2_refcount_set(diskimg, offset + (c << q->cluster_bits), 1) <
+            0)
+            return -1;
+    }
+
+    struct {
+        uint64_t offset;
+        uint32_t clusters;
+    } __attribute__((packed)) loc = {htobe64(offset), htobe32(clusters)};
+    if (qcow2_refcounts_write(diskimg) < 0 || fdatasync(diskimg->fd) < 0 ||
+        qcow2_file_rw(diskimg, true, &loc, sizeof(loc),
+                      offsetof(struct qcow2_header, refcount_table_offset)) <
+            0 ||
+        fdatasync(diskimg->fd) < 0)
+        return -1;
+    for (uint64_t c = 0; c < old_clusters; c++) {
+        if (qcow2_refcount_set(diskimg, old_offset + (c << q->cluster_bits),
+                               0) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int qcow2_refcount_set(struct diskimg *diskimg,
+                              uint64_t offset,
+                              uint16_t ref)
+{
+    struct qcow2 *q = diskimg->priv;
+    unsigned i;
+    struct qcow2_table *t = qcow2_rb_get(diskimg, offset, &i);
+
+    uint64_t rt_index = (offset >> q->cluster_bits) >> q->rb_bits;
+    if (!t && !errno && rt_index >= q->rt_size) {
+        if (qcow2_grow_rt(diskimg, rt_index) < 0)
+            return -1;
+        t = qcow2_rb_get(diskimg, offset, &i);
+    }
+    if (!t) {
+        if (errno)
+            return -1;
+        int64_t rb = qcow2_reserve(diskimg, 1);
+        if (rb < 0 || !qcow2_cache_get(diskimg, &q->rb_cache, rb, true))
+            return -1;
+        q->rt[rt_index] = htobe64(rb);
+        q->rt_dirty = true;
+        /* The new block often counts itself, so it is in place first. */
+        if (qcow2_refcount_set(diskimg, rb, 1) < 0)
+            return -1;
+        t = qcow2_rb_get(diskimg, offset, &i);
+        if (!t)
+            return -1;
+    }
+    ((uint16_t *) t->data)[i] = htobe16(ref);
+    t->dirty = true;
+    return 0;
+}
+
+static int64_t qcow2_alloc_clusters(struct diskimg *diskimg, unsigned n)
+{
+    struct qcow2 *q = diskimg->priv;
+    int64_t start = qcow2_reserve(diskimg, n);
+    if (start < 0)
+        return -1;
+    for (unsigned i = 0; i < n; i++) {
+        uint64_t off = start + ((uint64_t) i << q->cluster_bits);
+        if (qcow2_refcount_set(diskimg, off, 1) < 0)
+            return -1;
+    }
+    return start;
+}
+
+/* L2 table mapping guest @offset, allocated if missing and @alloc is set;
+ * otherwise NULL with errno 0 if there is none.
+ */
+static struct qcow2_table *qcow2_l2_get(struct diskimg *diskimg,
+                                        uint64_t offset,
+                                        bool alloc,
+                                        unsigned *index)
+{
+    struct qcow2 *q = diskimg->priv;
+    uint64_t l1_index = offset >> (q->cluster_bits + q->l2_bits);
+
+    *index = (offset >> q->cluster_bits) & ((1ULL << q->l2_bits) - 1);
+    uint64_t l2 = be64toh(q->l1[l1_index]) & QCOW2_OFFSET_MASK;
+    if (l2)
+        return qcow2_cache_get(diskimg, &q->l2_cache, l2, false);
+    errno = 0;
+    if (!alloc)
+        return NULL;
+
+    int64_t off = qcow2_alloc_clusters(diskimg, 1);
+    if (off < 0)
+        return NULL;
+    struct qcow2_table *t = qcow2_cache_get(diskimg, &q->l2_cache, off, true);
+    if (!t)
+        return NULL;
+    q->l1[l1_index] = htobe64(off | QCOW2_OFLAG_COPIED);
+    q->l1_dirty = true;
+    return t;
+}
+
+/* How the guest range at @offset is stored: returns the length (at most
+ * @len) of the part that is all of one kind and, for data, contiguous in
+ * the file from *host on.
+ */
+static ssize_t qcow2_extent(struct diskimg *diskimg,
+                            uint64_t offset,
+                            size_t len,
+                            enum qcow2_extent *kind,
+                            uint64_t *host)
+{
+    struct qcow2 *q = diskimg->priv;
+    size_t done = 0;
+
+    if (offset >= diskimg->size)
+        return 0;
+    if (len > diskimg->size - offset)
+        len = diskimg->size - offset;
+
+    while (done < len) {
+        uint64_t pos = offset + done;
+        unsigned i;
+        struct qcow2_table *t = qcow2_l2_get(diskimg, pos, false, &i);
+        if (!t && errno)
+            return done ? (ssize_t) done : -1;
+        uint64_t entry = t ? be64toh(((uint64_t *) t->data)[i]) : 0;
+
+        enum qcow2_extent k = QCOW2_DATA;
+        uint64_t h = 0;
+        if (entry & QCOW2_OFLAG_COMPRESSED)
+            k = QCOW2_COMPRESSED;
+        else if (((entry & QCOW2_OFLAG_ZERO) && q->has_zero_flag) ||
+                 !(entry & QCOW2_OFFSET_MASK))
+            k = QCOW2_ZERO;
+        else
+            h = (entry & QCOW2_OFFSET_MASK) + (pos & (q->cluster_size - 1));
+
+        if (!done) {
+            *kind = k;
+            *host = h;
+        } else if (k != *kind || (k == QCOW2_DATA && h != *host + done)) {
+            break;
+        }
+        size_t n = q->cluster_size - (pos & (q->cluster_size - 1));
+        done += n < len - done ? n : len - done;
+    }
+    return done;
+}
+
+/* Back the unallocated or zero clusters under [offset, offset + len) with
+ * new ones, all in one run of the file.
+ */
+static int qcow2_alloc_extent(struct diskimg *diskimg,
+                              uint64_t offset,
+                              size_t len,
+                              uint64_t *host)
+{
+    struct qcow2 *q = diskimg->priv;
+    uint64_t start = offset & ~(q->cluster_size - 1);
+    unsigned n =
+        (offset + len - start + q->cluster_size - 1) >> q->cluster_bits;
+
+    int64_t base = qcow2_alloc_clusters(diskimg, n);
+    if (base < 0)
+        return -1;
+    for (unsigned c = 0; c < n; c++) {
+        uint64_t off = (uint64_t) c << q->cluster_bits;
+        unsigned i;
+        struct qcow2_table *t = qcow2_l2_get(diskimg, start + off, true, &i);
+        if (!t)
+            return -1;
+        uint64_t *entry = &((uint64_t *) t->data)[i];
+        uint64_t old = be64toh(*entry) & QCOW2_OFFSET_MASK;
+        *entry = htobe64((base + off) | QCOW2_OFLAG_COPIED);
+        t->dirty = true;
+        /* A zero cluster's old space is dropped rather than zeroed. */
+        if (old && qcow2_refcount_set(diskimg, old, 0) < 0)
+            return -1;
+    }
+    *host = base + (offset - start);
+    return 0;
+}
+
+/* Locate (allocating, for writes) the next run of the range to access. */
+static ssize_t qcow2_lookup(struct diskimg *diskimg,
+                            bool write,
+                            uint64_t offset,
+                            size_t len,
+                            enum qcow2_extent *kind,
+                            uint64_t *host)
+{
+    struct qcow2 *q = diskimg->priv;
+
+    pthread_mutex_lock(&q->lock);
+    ssize_t n = qcow2_extent(diskimg, offset, len, kind, host);
+    if (n > 0 && write && *kind == QCOW2_ZERO) {
+        if (qcow2_alloc_extent(diskimg, offset, n, host) < 0)
+            n = -1;
+        *kind = QCOW2_DATA;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    if (n > 0 && *kind == QCOW2_COMPRESSED) {
+        errno = ENOTSUP;
+        n = -1;
+    }
+    return n;
+}
+
+static ssize_t qcow2_rw_vec(struct diskimg *diskimg,
+                            bool write,
+                            const struct iovec *iov,
+                            int iovcnt,
+                            off_t offset)
+{
+    struct iovec sub[DISKIMG_IOV_MAX];
+    size_t total = 0, done = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    while (done < total) {
+        enum qcow2_extent kind;
+        uint64_t host;
+        ssize_t n =
+            qcow2_lookup(diskimg, write, offset + done, total - done, &kind,
+                         &host);
+        if (n < 0)
+            return done ? (ssize_t) done : -1;
+        if (n == 0)
+            break;
+
+        size_t len = n;
+        int cnt =
+            diskimg_iov_slice(iov, iovcnt, done, &len, sub, DISKIMG_IOV_MAX);
+        if (kind == QCOW2_ZERO) {
+            diskimg_iov_zero(sub, cnt, 0);
+        } else {
+            ssize_t ret = diskimg_file_rw_vec(diskimg, write, sub, cnt, host);
+            if (ret < 0)
+                return done ? (ssize_t) done : -1;
+            /* Clusters at the very end of a file may be cut short. */
+            if (!write)
+                diskimg_iov_zero(sub, cnt, ret);
+            else if ((size_t) ret != len)
+                return done + ret;
+        }
+        done += len;
+    }
+    return done;
+}
+
+static size_t qcow2_map(struct diskimg *diskimg,
+                        bool write,
+                        off_t offset,
+                        size_t len,
+                        off_t *host,
+                        enum diskimg_file *file)
+{
+    enum qcow2_extent kind;
+    uint64_t h;
+    ssize_t n = qcow2_lookup(diskimg, write, offset, len, &kind, &h);
+    if (n <= 0 || kind != QCOW2_DATA)
+        return 0;
+    *host = h;
+    *file = DISKIMG_FILE_IMAGE;
+    return n;
+}
+
+/* Clusters keep their place in the file and in the tables: only their data
+ * is dropped or zeroed, where it lies. Unallocated and zero clusters read
+ * as zeros already.
+ */
+static int qcow2_discard(struct diskimg *diskimg,
+                         enum diskimg_discard mode,
+                         off_t offset,
+                         size_t len)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        enum qcow2_extent kind;
+        uint64_t host;
+        ssize_t n = qcow2_lookup(diskimg, false, offset + done, len - done,
+                                 &kind, &host);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        if (kind == QCOW2_DATA &&
+            diskimg_file_discard(diskimg, mode, host, n) < 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static int qcow2_flush(struct diskimg *diskimg)
+{
+    struct qcow2 *q = diskimg->priv;
+    int ret = 0;
+
+    pthread_mutex_lock(&q->lock);
+    bool mapping = q->l1_dirty || qcow2_cache_dirty(&q->l2_cache);
+    if (qcow2_refcounts_dirty(q)) {
+        ret = qcow2_refcounts_write(diskimg);
+        if (!ret && mapping)
+            ret = fdatasync(diskimg->fd);
+    }
+    /* New L2 tables are in clusters that read as zeros until written, so
+     * the L1 entries may go out with them.
+     */
+    if (!ret)
+        ret = qcow2_cache_write(diskimg, &q->l2_cache);
+    if (!ret && q->l1_dirty) {
+        ret = qcow2_file_rw(diskimg, true, q->l1, q->l1_size * sizeof(*q->l1),
+                            q->l1_offset);
+        if (!ret)
+            q->l1_dirty = false;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret < 0 ? ret : fdatasync(diskimg->fd);
+}
+
+static void qcow2_cache_free(struct qcow2_cache *c)
+{
+    for (unsigned i = 0; c->tables && i < c->nr; i++)
+        free(c->tables[i].data);
+    free(c->tables);
+}
+
+static void qcow2_exit(struct diskimg *diskimg)
+{
+    struct qcow2 *q = diskimg->priv;
+    if (!q)
+        return;
+    /* Hand back what was preallocated but not used. */
+    if (q->file_end > q->next_free && diskimg->fd >= 0 &&
+        ftruncate(diskimg->fd, q->next_free) < 0)
+        throw_err("Failed to trim the qcow2 image");
+    qcow2_cache_free(&q->l2_cache);
+    qcow2_cache_free(&q->rb_cache);
+    free(q->l1);
+    free(q->rt);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+    diskimg->priv = NULL;
+}
+
+static const struct diskimg_ops qcow2_ops = {
+    .name = "qcow2",
+    .rw_vec = qcow2_rw_vec,
+    .map = qcow2_map,
+    .discard = qcow2_discard,
+    .flush = qcow2_flush,
+    .exit = qcow2_exit,
+};
+
+bool qcow2_probe(struct diskimg *diskimg)
+{
+    uint32_t magic;
+    return qcow2_file_rw(diskimg, false, &magic, sizeof(magic), 0) == 0 &&
+           be32toh(magic) == QCOW2_MAGIC;
+}
+
+static int qcow2_cache_init(struct qcow2_cache *c, unsigned nr, size_t size)
+{
+    c->tables = calloc(nr, sizeof(*c->tables));
+    if (!c->tables)
+        return -1;
+    c->nr = nr;
+    for (unsigned i = 0; i < nr; i++) {
+        if (posix_memalign(&c->tables[i].data, 4096, size))
+            return -1;
+    }
+    return 0;
+}
+
+/* Zeroed, page-aligned buffer for @len bytes of a table read from @offset. */
+static void *qcow2_load(struct diskimg *diskimg, uint64_t offset, size_t len)
+{
+    void *p;
+    size_t size = (len + 4095) & ~4095UL;
+    if (posix_memalign(&p, 4096, size))
+        return NULL;
+    memset(p, 0, size);
+    if (qcow2_file_rw(diskimg, false, p, len, offset) < 0) {
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+static int qcow2_check_header(const struct diskimg *diskimg,
+                              const struct qcow2_header *h)
+{
+    if (h->version != 2 && h->version != 3)
+        return throw_err("qcow2 version %u is not supported", h->version);
+    if (h->cluster_bits < 9 || h->cluster_bits > 21)
+        return throw_err("qcow2 cluster size 2^%u is not supported",
+                         h->cluster_bits);
+    /* Clusters smaller than a direct I/O block would share blocks, whose
+     * bounced read-modify-write by one worker could undo another's write
+     * to a neighbouring cluster or table.
+     */
+    if (diskimg->direct && (1ULL << h->cluster_bits) < diskimg->align)
+        return throw_err("qcow2 cluster size %llu is below the %zu byte "
+                         "block --disk-cache none needs",
+                         1ULL << h->cluster_bits, diskimg->align);
+    if (h->backing_file_offset)
+        return throw_err("qcow2 backing files are not supported");
+    if (h->crypt_method)
+        return throw_err("Encrypted qcow2 images are not supported");
+    if (h->nb_snapshots)
+        return throw_err("qcow2 images with snapshots are not supported");
+    if (h->version == 3) {
+        if (h->incompatible_features)
+            return throw_err("qcow2 incompatible features 0x%llx are not "
+                             "supported (dirty or corrupt image?)",
+                             (unsigned long long) h->incompatible_features);
+        if (h->refcount_order != 4)
+            return throw_err("qcow2 refcount width %u is not supported",
+                             1U << h->refcount_order);
+    }
+    uint64_t cluster = 1ULL << h->cluster_bits;
+    uint64_t l2_span = cluster / sizeof(uint64_t) * cluster;
+    if ((h->l1_table_offset | h->refcount_table_offset) & (cluster - 1) ||
+        (uint64_t) h->l1_size < (h->size + l2_span - 1) / l2_span ||
+        !h->refcount_table_clusters)
+        return throw_err("Corrupt qcow2 header");
+    return 0;
+}
+
+int qcow2_open(struct diskimg *diskimg)
+{
+    struct qcow2_header h = {0};
+    struct stat st;
+
+    if (qcow2_file_rw(diskimg, false, &h, QCOW2_V2_HEADER_SIZE, 0) < 0 ||
+        fstat(diskimg->fd, &st) < 0)
+        return -1;
+    h.version = be32toh(h.version);
+    if (h.version >= 3 &&
+        qcow2_file_rw(diskimg, false, &h.incompatible_features,
+                      sizeof(h) - QCOW2_V2_HEADER_SIZE,
+                      QCOW2_V2_HEADER_SIZE) < 0)
+        return -1;
+    h.backing_file_offset = be64toh(h.backing_file_offset);
+    h.cluster_bits = be32toh(h.cluster_bits);
+    h.size = be64toh(h.size);
+    h.crypt_method = be32toh(h.crypt_method);
+    h.l1_size = be32toh(h.l1_size);
+    h.l1_table_offset = be64toh(h.l1_table_offset);
+    h.refcount_table_offset = be64toh(h.refcount_table_offset);
+    h.refcount_table_clusters = be32toh(h.refcount_table_clusters);
+    h.nb_snapshots = be32toh(h.nb_snapshots);
+    h.incompatible_features = be64toh(h.incompatible_features);
+    h.autoclear_features = be64toh(h.autoclear_features);
+    h.refcount_order = be32toh(h.refcount_order);
+    errno = ENOTSUP;
+    if (qcow2_check_header(diskimg, &h) < 0)
+        return -1;
+
+    struct qcow2 *q = calloc(1, sizeof(*q));
+    if (!q)
+        return -1;
+    diskimg->ops = &qcow2_ops;
+    diskimg->priv = q;
+    diskimg->size = h.size;
+    pthread_mutex_init(&q->lock, NULL);
+    q->cluster_bits = h.cluster_bits;
+    q->cluster_size = 1ULL << h.cluster_bits;
+    q->l2_bits = h.cluster_bits - 3;
+    q->rb_bits = h.cluster_bits - 1;
+    q->has_zero_flag = h.version >= 3;
+    q->l1_size = h.l1_size;
+    q->l1_offset = h.l1_table_offset;
+    q->rt_size = (uint64_t) h.refcount_table_clusters << (h.cluster_bits - 3);
+    q->rt_offset = h.refcount_table_offset;
+    q->file_end = st.st_size;
+    q->next_free = (st.st_size + q->cluster_size - 1) & ~(q->cluster_size - 1);
+
+    q->l1 = qcow2_load(diskimg, q->l1_offset, q->l1_size * sizeof(*q->l1));
+    q->rt = qcow2_load(diskimg, q->rt_offset, q->rt_size * sizeof(*q->rt));
+    if (!q->l1 || !q->rt)
+        return throw_err("Failed to read qcow2 tables");
+    if (qcow2_cache_init(&q->l2_cache, QCOW2_L2_CACHE_SIZE, q->cluster_size) <
+            0 ||
+        qcow2_cache_init(&q->rb_cache, QCOW2_RB_CACHE_SIZE, q->cluster_size) <
+            0)
+        return throw_err("Failed to allocate the qcow2 table cache");
+
+    /* Autoclear features describe extensions this code does not keep up
+     * to date, so the first writer drops them.
+     */
+    if (h.autoclear_features) {
+        uint64_t none = 0;
+        if (qcow2_file_rw(diskimg, true, &none, sizeof(none),
+                          offsetof(struct qcow2_header, autoclear_features)) <
+            0)
+            return throw_err("Failed to update the qcow2 header");
+    }
+    return 0;
+}
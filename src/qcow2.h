@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "diskimg.h"
+
+/* qcow2 (version 2 and 3) images without backing files, encryption,
+ * compression or internal snapshots. L2 tables and refcount blocks are
+ * cached and written back on diskimg_flush; new clusters are appended to
+ * the file, runs of them contiguously.
+ */
+
+/* Whether the opened file starts with the qcow2 magic. */
+bool qcow2_probe(struct diskimg *diskimg);
+/* Take over @diskimg, whose fd is open on a qcow2 file. */
+int qcow2_open(struct diskimg *diskimg);
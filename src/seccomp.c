@@ -45,7 +45,7 @@
  * device worker, not a graceful failure.
  */
 static const long allowed_syscalls[] = {
-    /* KVM ioctls (KVM_RUN, KVM_IRQ_LINE) and TUN/TTY ioctls. */
+    /* KVM ioctls (KVM_RUN, KVM_IRQ_LINE), TUN/TTY ioctls and BLKDISCARD. */
     SYS_ioctl,
 
     /* Eventfd reads/writes (irqfd, ioeventfd, stopfd), serial stdin
@@ -60,12 +60,29 @@ static const long allowed_syscalls[] = {
     SYS_readv,
     SYS_writev,
 
-    /* virtio-blk uses pread/pwrite to keep concurrent virtq workers from
-     * racing on a shared file pointer; FLUSH dispatches to fdatasync.
+    /* virtio-blk uses positioned I/O (pread/pwrite, and preadv2/pwritev2
+     * for a whole request) to keep concurrent virtq workers from racing on
+     * a shared file pointer; FLUSH dispatches to fdatasync.
      */
     SYS_pread64,
     SYS_pwrite64,
+    SYS_preadv2,
+    SYS_pwritev2,
     SYS_fdatasync,
+    SYS_msync, /* --disk-io mmap flushes */
+    /* qcow2 images grow as clusters are allocated, and give back what was
+     * preallocated on exit.
+     */
+    SYS_fallocate,
+    SYS_ftruncate,
+
+    /* virtio-blk workers submit to the io_urings set up with the device.
+     * Each is restricted to reads and writes of the registered disk files
+     * before it is enabled, as its operations bypass this filter; setting
+     * up or registering anything on a ring stays forbidden, or a
+     * compromised process could make one without restrictions.
+     */
+    SYS_io_uring_enter,
 
 /* aarch64 lacks SYS_poll; glibc's poll(3) maps to ppoll there.
  * Allow both so the same source compiles on either arch.
@@ -107,6 +124,19 @@ static const long allowed_syscalls[] = {
     SYS_rseq,
 #endif
 
+    /* vm_stop kicks sibling vCPU threads out of KVM_RUN with pthread_kill,
+     * which glibc implements as getpid + tgkill.
+     */
+    SYS_getpid,
+    SYS_tgkill,
+
+    /* Device workers are spawned on first queue enable, after the filter is
+     * in place, and pinned with pthread_setaffinity_np.
+     */
+    SYS_sched_setaffinity,
+    /* --io-poll workers let a vCPU sharing their CPU in while they spin. */
+    SYS_sched_yield,
+
     /* Process teardown. */
     SYS_exit,
     SYS_exit_group,
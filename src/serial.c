@@ -11,6 +11,7 @@
 
 #include "err.h"
 #include "serial.h"
+#include "snapshot.h"
 #include "utils.h"
 #include "vm.h"
 
@@ -63,6 +64,30 @@ static void serial_update_irq(serial_dev_t *s)
                 iir == UART_IIR_NO_INT ? 0 /* inactive */ : 1 /* active */);
 }
 
+/* A THR write raises the THRI interrupt when IER enables it, so it has to
+ * exit. With THRI masked it changes nothing the guest can see: LSR keeps
+ * TEMT and THRE, and the line follows RDI alone. The writes can then wait
+ * in the coalesced ring until the guest next exits, which a driver does
+ * right away to poll LSR or to restore IER.
+ */
+static int serial_coalesce_tx(serial_dev_t *s)
+{
+    struct serial_dev_priv *priv = (struct serial_dev_priv *) s->priv;
+    vm_t *v = container_of(s, vm_t, serial);
+    bool coalesce = !(priv->ier & UART_IER_THRI);
+    int ret;
+
+    if (coalesce == s->tx_coalesced)
+        return 0;
+    if (coalesce)
+        ret = vm_coalesce_io(v, COM1_PORT_BASE + UART_TX, 1, true);
+    else
+        ret = vm_uncoalesce_io(v, COM1_PORT_BASE + UART_TX, 1, true);
+    if (!ret)
+        s->tx_coalesced = coalesce;
+    return ret;
+}
+
 static int serial_readable(serial_dev_t *s, int timeout)
 {
     struct pollfd pollfds[] = {
@@ -106,7 +131,16 @@ void serial_console(serial_dev_t *s)
 
     while (!fifo_is_full(&priv->rx_buf) && serial_readable(s, 0)) {
         char c;
-        if (read(s->infd, &c, 1) == -1)
+        ssize_t n = read(s->infd, &c, 1);
+        if (n == 0) {
+            /* The console went away (a clone's client disconnected). A
+             * negative fd is skipped by poll(), so this is the last read.
+             */
+            s->infd = -1;
+            vm_stop(container_of(s, vm_t, serial), 0);
+            break;
+        }
+        if (n < 0)
             break;
         if (escaped && c == TERMINAL_EXIT_CHAR) {
             /* Terminate */
@@ -207,6 +241,7 @@ static void serial_out(serial_dev_t *s, uint16_t offset, void *data)
             pthread_mutex_lock(&priv->lock);
             priv->ier = IO_READ8(data);
             serial_update_irq(s);
+            serial_coalesce_tx(s);
             pthread_mutex_unlock(&priv->lock);
         } else {
             priv->dlm = IO_READ8(data);
@@ -256,14 +291,50 @@ int serial_init(serial_dev_t *s, struct bus *bus)
     };
     if (s->stopfd < 0)
         return throw_err("Failed to create serial stop eventfd");
-    pthread_create(&s->worker_tid, NULL, (void *) serial_thread, (void *) s);
+    if (pthread_create(&s->worker_tid, NULL, (void *) serial_thread,
+                       (void *) s) == 0)
+        vm_pin_io_thread(container_of(s, vm_t, serial), s->worker_tid);
 
     dev_init(&s->dev, COM1_PORT_BASE, COM1_PORT_SIZE, s, serial_handle_io);
     bus_register_dev(bus, &s->dev);
 
+    if (serial_coalesce_tx(s) < 0)
+        return -1;
+
     return 0;
 }
 
+/* The 16550 registers through scr, followed by the pending RX bytes. */
+#define SERIAL_REGS_SIZE offsetof(struct serial_dev_priv, rx_buf)
+
+int serial_save(serial_dev_t *s, int fd)
+{
+    struct serial_dev_priv *priv = (struct serial_dev_priv *) s->priv;
+
+    pthread_mutex_lock(&priv->lock);
+    int ret = snapshot_write(fd, priv, SERIAL_REGS_SIZE);
+    if (!ret)
+        ret = snapshot_write(fd, &priv->rx_buf, sizeof(priv->rx_buf));
+    pthread_mutex_unlock(&priv->lock);
+    return ret;
+}
+
+int serial_restore(serial_dev_t *s, int fd)
+{
+    struct serial_dev_priv *priv = (struct serial_dev_priv *) s->priv;
+
+    pthread_mutex_lock(&priv->lock);
+    int ret = snapshot_read(fd, priv, SERIAL_REGS_SIZE);
+    if (!ret)
+        ret = snapshot_read(fd, &priv->rx_buf, sizeof(priv->rx_buf));
+    if (!ret) {
+        serial_update_irq(s);
+        ret = serial_coalesce_tx(s);
+    }
+    pthread_mutex_unlock(&priv->lock);
+    return ret;
+}
+
 void serial_exit(serial_dev_t *s)
 {
     struct serial_dev_priv *priv = (struct serial_dev_priv *) s->priv;
@@ -2,6 +2,7 @@
 
 #include <linux/kvm.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include "bus.h"
 
 #define COM1_PORT_BASE 0x03f8
@@ -16,8 +17,11 @@ struct serial_dev {
     int stopfd;
     struct dev dev;
     int irq_num;
+    bool tx_coalesced; /* THR writes queue in the coalesced ring */
 };
 
 void serial_console(serial_dev_t *s);
 int serial_init(serial_dev_t *s, struct bus *bus);
+int serial_save(serial_dev_t *s, int fd);
+int serial_restore(serial_dev_t *s, int fd);
 void serial_exit(serial_dev_t *s);
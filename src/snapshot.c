@@ -0,0 +1,321 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/kvm.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "snapshot.h"
+#include "vm.h"
+
+#if defined(__x86_64__)
+#define SNAPSHOT_ARCH 1
+#elif defined(__aarch64__)
+#define SNAPSHOT_ARCH 2
+#endif
+
+int snapshot_write(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int snapshot_read(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            errno = EINVAL; /* truncated snapshot */
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int snapshot_read_header(const char *path, struct snapshot_header *hdr)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return throw_err("Failed to open snapshot %s", path);
+    int ret = snapshot_read(fd, hdr, sizeof(*hdr));
+    close(fd);
+    if (ret < 0)
+        return throw_err("Failed to read snapshot header of %s", path);
+
+    if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != SNAPSHOT_VERSION || hdr->arch != SNAPSHOT_ARCH) {
+        errno = EINVAL;
+        return throw_err("%s is not a snapshot for this kvm-host", path);
+    }
+    return 0;
+}
+
+static int snapshot_pwrite(int fd, const uint8_t *buf, size_t len, off_t off)
+{
+    while (len) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+static bool page_is_zero(const uint8_t *p, size_t len)
+{
+    const uint64_t *w = (const uint64_t *) p;
+    for (size_t i = 0; i < len / sizeof(*w); i++) {
+        if (w[i])
+            return false;
+    }
+    return true;
+}
+
+/* Write guest RAM page by page, leaving all-zero pages as holes. Pages the
+ * guest never touched read as the shared zero page, so this neither grows the
+ * RSS nor the snapshot file for the unused part of a large guest.
+ */
+static int snapshot_write_ram(int fd, const struct guest_mem *m, off_t base)
+{
+    const uint8_t *ram = m->base;
+    size_t page = getpagesize();
+    size_t run = 0; /* start of the current run of non-zero pages */
+    bool in_run = false;
+
+    for (size_t off = 0; off < m->size; off += page) {
+        /* The last page always goes out so the file covers all of RAM. */
+        bool zero = off + page < m->size && page_is_zero(ram + off, page);
+        if (!zero && !in_run) {
+            run = off;
+            in_run = true;
+        } else if (zero && in_run) {
+            if (snapshot_pwrite(fd, ram + run, off - run, base + run) < 0)
+                return -1;
+            in_run = false;
+        }
+    }
+    return snapshot_pwrite(fd, ram + run, m->size - run, base + run);
+}
+
+static uint32_t vm_snapshot_devices(vm_t *v)
+{
+    uint32_t devices = 0;
+    if (v->virtio_blk_dev.enable)
+        devices |= SNAPSHOT_DEV_BLK;
+    if (v->virtio_net_dev.enable)
+        devices |= SNAPSHOT_DEV_NET;
+    return devices;
+}
+
+/* Quiesce the VM and write the header placeholder and the device state.
+ * The caller fills in and rewrites the header.
+ */
+static int snapshot_save_state(vm_t *v, int fd, struct snapshot_header *hdr)
+{
+    /* Stop the device workers first: once they are joined nothing but this
+     * thread touches the rings, the device registers or guest RAM.
+     */
+    virtio_blk_stop(&v->virtio_blk_dev);
+    virtio_net_stop(&v->virtio_net_dev);
+
+    /* A vCPU stopped on a PIO/MMIO exit has not retired that instruction
+     * yet; KVM finishes it on the next KVM_RUN. immediate_exit is still set
+     * from vm_stop, so this returns at once with consistent registers.
+     */
+    for (int i = 0; i < v->cfg.nr_vcpus; i++) {
+        vcpu_t *vcpu = &v->vcpus[i];
+        vcpu->run->immediate_exit = 1;
+        if (ioctl(vcpu->fd, KVM_RUN, 0) < 0 && errno != EINTR)
+            return throw_err("Failed to complete pending I/O of vcpu %d",
+                             vcpu->id);
+    }
+
+    /* The header is written blank to reserve its space and filled in last,
+     * so an interrupted save never looks like a valid snapshot.
+     */
+    *hdr = (struct snapshot_header) {0};
+    if (snapshot_write(fd, hdr, sizeof(*hdr)) < 0)
+        return throw_err("Failed to write snapshot");
+
+    *hdr = (struct snapshot_header) {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .arch = SNAPSHOT_ARCH,
+        .nr_vcpus = v->cfg.nr_vcpus,
+        .devices = vm_snapshot_devices(v),
+        .ram_size = v->mem.size,
+    };
+    if (vm_arch_save_state(v, fd) < 0 || serial_save(&v->serial, fd) < 0 ||
+        pci_save(&v->pci, fd) < 0)
+        return throw_err("Failed to save device state");
+    if ((hdr->devices & SNAPSHOT_DEV_BLK) &&
+        virtio_blk_save(&v->virtio_blk_dev, fd) < 0)
+        return throw_err("Failed to save virtio-blk state");
+    if ((hdr->devices & SNAPSHOT_DEV_NET) &&
+        virtio_net_save(&v->virtio_net_dev, fd) < 0)
+        return throw_err("Failed to save virtio-net state");
+    return 0;
+}
+
+/* @fd is opened by the caller up front, so saving works under --seccomp. */
+int vm_snapshot_save(vm_t *v, int fd)
+{
+    struct snapshot_header hdr;
+    if (snapshot_save_state(v, fd, &hdr) < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return throw_err("Failed to stat snapshot");
+    hdr.ram_offset =
+        (st.st_size + SNAPSHOT_RAM_ALIGN - 1) & ~(SNAPSHOT_RAM_ALIGN - 1);
+    if (snapshot_write_ram(fd, &v->mem, hdr.ram_offset) < 0)
+        return throw_err("Failed to write guest memory to snapshot");
+    if (snapshot_pwrite(fd, (uint8_t *) &hdr, sizeof(hdr), 0) < 0)
+        return throw_err("Failed to write snapshot header");
+    return 0;
+}
+
+/* Device and CPU state only, with ram_offset 0: guest RAM reaches the
+ * restoring side some other way (fork() for template clones).
+ */
+int vm_snapshot_save_state(vm_t *v, int fd)
+{
+    struct snapshot_header hdr;
+    if (snapshot_save_state(v, fd, &hdr) < 0)
+        return -1;
+    if (snapshot_pwrite(fd, (uint8_t *) &hdr, sizeof(hdr), 0) < 0)
+        return throw_err("Failed to write snapshot header");
+    return 0;
+}
+
+int vm_snapshot_map_ram(vm_t *v)
+{
+    const char *path = v->cfg.snapshot_in;
+    struct snapshot_header hdr;
+    if (snapshot_read_header(path, &hdr) < 0)
+        return -1;
+    if (!hdr.ram_offset) {
+        errno = EINVAL;
+        return throw_err("%s holds no guest memory", path);
+    }
+    if (hdr.ram_size != v->mem.size) {
+        errno = EINVAL;
+        return throw_err("Snapshot RAM size does not match the guest");
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return throw_err("Failed to open snapshot %s", path);
+
+    int ret = 0;
+    if (v->cfg.snapshot_uffd) {
+        if (v->mem.fd >= 0) {
+            close(fd);
+            errno = EINVAL;
+            return throw_err("userfaultfd restore needs anonymous guest RAM");
+        }
+        ret = uffd_restore_init(&v->uffd, v->mem.base, v->mem.size, fd,
+                                hdr.ram_offset, v->cfg.snapshot_trace);
+        if (v->uffd.fault_started)
+            vm_pin_io_thread(v, v->uffd.fault_tid);
+        if (v->uffd.prefetch_started)
+            vm_pin_io_thread(v, v->uffd.prefetch_tid);
+    } else if (v->mem.fd < 0) {
+        /* Private anonymous RAM is swapped for a private mapping of the
+         * snapshot: pages fault in from the page cache on first touch, and
+         * only the ones the guest writes get copied.
+         */
+        void *p = mmap(v->mem.base, v->mem.size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, fd,
+                       hdr.ram_offset);
+        if (p == MAP_FAILED)
+            ret = throw_err("Failed to map guest memory from %s", path);
+    } else {
+        /* hugetlb and file backends are shared mappings that must stay in
+         * place, so their contents are read in instead.
+         */
+        uint8_t *ram = v->mem.base;
+        for (size_t off = 0; off < v->mem.size;) {
+            ssize_t n = pread(fd, ram + off, v->mem.size - off,
+                              hdr.ram_offset + off);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                ret = throw_err("Failed to read guest memory from %s", path);
+                break;
+            }
+            off += n;
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+int vm_snapshot_restore(vm_t *v)
+{
+    const char *path = v->cfg.snapshot_in;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return throw_err("Failed to open snapshot %s", path);
+
+    struct snapshot_header hdr;
+    if (snapshot_read(fd, &hdr, sizeof(hdr)) < 0)
+        goto err;
+    if (hdr.devices != vm_snapshot_devices(v)) {
+        close(fd);
+        errno = EINVAL;
+        return throw_err("Snapshot devices differ (disk: %s, network: %s)",
+                         hdr.devices & SNAPSHOT_DEV_BLK ? "yes" : "no",
+                         hdr.devices & SNAPSHOT_DEV_NET ? "yes" : "no");
+    }
+
+    /* CPU and interrupt controller state go in before any device can raise
+     * an interrupt, and before virtio workers restart on the rings.
+     */
+    if (vm_arch_restore_state(v, fd) < 0 ||
+        serial_restore(&v->serial, fd) < 0 || pci_restore(&v->pci, fd) < 0)
+        goto err;
+    if ((hdr.devices & SNAPSHOT_DEV_BLK) &&
+        virtio_blk_restore(&v->virtio_blk_dev, fd) < 0)
+        goto err;
+    if ((hdr.devices & SNAPSHOT_DEV_NET) &&
+        virtio_net_restore(&v->virtio_net_dev, fd) < 0)
+        goto err;
+
+    close(fd);
+    return 0;
+
+err:
+    throw_err("Failed to restore snapshot %s", path);
+    close(fd);
+    return -1;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC "KVMHSNAP"
+#define SNAPSHOT_VERSION 2
+
+/* Guest RAM starts at this file offset so that it can be mapped straight
+ * from the snapshot, whatever the host page size.
+ */
+#define SNAPSHOT_RAM_ALIGN (1ULL << 21)
+
+/* Devices present when the snapshot was taken; the restoring kvm-host must
+ * be given the same set so that PCI slots line up.
+ */
+#define SNAPSHOT_DEV_BLK (1U << 0)
+#define SNAPSHOT_DEV_NET (1U << 1)
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t arch;
+    uint32_t nr_vcpus;
+    uint32_t devices;
+    uint64_t ram_size;
+    uint64_t ram_offset;
+};
+
+/* Device state is a flat stream of fixed-layout records in a fixed order;
+ * these move one record and fail on a short transfer.
+ */
+int snapshot_write(int fd, const void *buf, size_t len);
+int snapshot_read(int fd, void *buf, size_t len);
+int snapshot_read_header(const char *path, struct snapshot_header *hdr);
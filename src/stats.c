@@ -0,0 +1,264 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/kvm.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "stats.h"
+#include "vm.h"
+
+#define STATS_DUMP_SIGNAL SIGUSR2
+
+static const char *exit_names[STATS_NR_EXITS] = {
+    [KVM_EXIT_UNKNOWN] = "UNKNOWN",
+    [KVM_EXIT_EXCEPTION] = "EXCEPTION",
+    [KVM_EXIT_IO] = "IO",
+    [KVM_EXIT_HYPERCALL] = "HYPERCALL",
+    [KVM_EXIT_DEBUG] = "DEBUG",
+    [KVM_EXIT_HLT] = "HLT",
+    [KVM_EXIT_MMIO] = "MMIO",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "IRQ_WINDOW_OPEN",
+    [KVM_EXIT_SHUTDOWN] = "SHUTDOWN",
+    [KVM_EXIT_FAIL_ENTRY] = "FAIL_ENTRY",
+    [KVM_EXIT_INTR] = "INTR",
+    [KVM_EXIT_SET_TPR] = "SET_TPR",
+    [KVM_EXIT_TPR_ACCESS] = "TPR_ACCESS",
+    [KVM_EXIT_NMI] = "NMI",
+    [KVM_EXIT_INTERNAL_ERROR] = "INTERNAL_ERROR",
+    [KVM_EXIT_SYSTEM_EVENT] = "SYSTEM_EVENT",
+};
+
+static uint64_t load(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void dump_hist(FILE *f, const char *name, const struct stats_hist *h)
+{
+    int last = STATS_NR_BUCKETS - 1;
+    while (last >= 0 && !load(&h->buckets[last]))
+        last--;
+
+    fprintf(f, "\"%s\":{\"count\":%llu,\"cycles\":%llu,\"log2_cycles\":[",
+            name, (unsigned long long) load(&h->count),
+            (unsigned long long) load(&h->cycles));
+    for (int i = 0; i <= last; i++)
+        fprintf(f, "%s%llu", i ? "," : "",
+                (unsigned long long) load(&h->buckets[i]));
+    fprintf(f, "]}");
+}
+
+static void dump_vcpu(FILE *f, int id, const struct vcpu_stats *s)
+{
+    fprintf(f, "{\"id\":%d,\"exits\":{", id);
+    bool first = true;
+    for (int i = 0; i <= STATS_NR_EXITS; i++) {
+        uint64_t n = load(&s->exits[i]);
+        if (!n)
+            continue;
+        if (i == STATS_NR_EXITS)
+            fprintf(f, "%s\"OTHER\":%llu", first ? "" : ",",
+                    (unsigned long long) n);
+        else if (exit_names[i])
+            fprintf(f, "%s\"%s\":%llu", first ? "" : ",", exit_names[i],
+                    (unsigned long long) n);
+        else
+            fprintf(f, "%s\"%d\":%llu", first ? "" : ",", i,
+                    (unsigned long long) n);
+        first = false;
+    }
+    fprintf(f, "},");
+    dump_hist(f, "kvm_run", &s->run);
+    fprintf(f, ",");
+    dump_hist(f, "handle", &s->handle);
+    fprintf(f, "}");
+}
+
+static bool dump_bus(FILE *f, const char *name, struct bus *bus, bool first)
+{
+    for (size_t i = 0; i < bus->nr_devs; i++) {
+        struct dev *dev = bus->entries[i].dev;
+        fprintf(f,
+                "%s{\"bus\":\"%s\",\"base\":\"0x%llx\",\"len\":%llu,"
+                "\"accesses\":%llu}",
+                first ? "" : ",", name, (unsigned long long) dev->base,
+                (unsigned long long) dev->len,
+                (unsigned long long) load(&dev->accesses));
+        first = false;
+    }
+    return first;
+}
+
+static void dump_poll(FILE *f,
+                      const char *dev,
+                      int queue,
+                      const struct virtq_poll *p,
+                      bool first)
+{
+    fprintf(f,
+            "%s{\"dev\":\"%s\",\"queue\":%d,\"budget_ns\":%u,"
+            "\"polls\":%llu,\"hits\":%llu}",
+            first ? "" : ",", dev, queue,
+            __atomic_load_n(&p->ns, __ATOMIC_RELAXED),
+            (unsigned long long) load(&p->polls),
+            (unsigned long long) load(&p->hits));
+}
+
+/* Spin budget and success of each polling worker, with --io-poll. */
+static void dump_io_poll(FILE *f, vm_t *v)
+{
+    struct virtio_blk_dev *blk = &v->virtio_blk_dev;
+    struct virtio_net_dev *net = &v->virtio_net_dev;
+
+    fprintf(f, ",\"io_poll\":[");
+    for (int i = 0; blk->enable && i < blk->num_queues; i++)
+        dump_poll(f, "virtio-blk", i, &blk->queues[i].poll, !i);
+    if (net->enable)
+        dump_poll(f, "virtio-net", VIRTQ_TX, &net->tx_poll,
+                  !blk->enable);
+    fprintf(f, "]");
+}
+
+/* One JSON object per line, written with a single write() so that dumps of
+ * several VMs can share one file.
+ */
+void vm_stats_dump(vm_t *v)
+{
+    struct vm_stats *st = v->stats;
+    char *buf;
+    size_t len;
+    FILE *f = open_memstream(&buf, &len);
+    if (!f)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double us = (now.tv_sec - st->start_time.tv_sec) * 1e6 +
+                (now.tv_nsec - st->start_time.tv_nsec) / 1e3;
+    fprintf(f, "{\"pid\":%d,\"elapsed_us\":%.0f,\"cycles_per_us\":%.1f,",
+            (int) getpid(), us,
+            us > 0 ? (stats_cycles() - st->start_cycles) / us : 0.0);
+
+    fprintf(f, "\"vcpus\":[");
+    for (int i = 0; i < v->cfg.nr_vcpus; i++) {
+        if (i)
+            fprintf(f, ",");
+        dump_vcpu(f, i, &st->vcpus[i]);
+    }
+    fprintf(f, "]");
+    if (v->cfg.io_poll_ns)
+        dump_io_poll(f, v);
+
+    /* BARs move on the buses when the guest reprograms them. */
+    pthread_mutex_lock(&v->io_lock);
+    fprintf(f, ",\"devices\":[");
+    dump_bus(f, "mmio", &v->mmio_bus, dump_bus(f, "pio", &v->io_bus, true));
+    fprintf(f,
+            "],\"unclaimed\":{\"pio\":%llu,\"mmio\":%llu},"
+            "\"coalesced\":%llu}\n",
+            (unsigned long long) load(&st->unclaimed_pio),
+            (unsigned long long) load(&st->unclaimed_mmio),
+            (unsigned long long) load(&st->coalesced));
+    pthread_mutex_unlock(&v->io_lock);
+
+    fclose(f);
+    if (write(st->outfd, buf, len) < 0)
+        throw_err("Failed to write stats");
+    free(buf);
+}
+
+static void *stats_thread(void *arg)
+{
+    vm_t *v = (vm_t *) arg;
+    struct pollfd pollfds[] = {
+        [0] = {.fd = v->stats->sigfd, .events = POLLIN},
+        [1] = {.fd = v->stats->stopfd, .events = POLLIN},
+    };
+
+    while (1) {
+        if (poll(pollfds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pollfds[1].revents & POLLIN)
+            break;
+        struct signalfd_siginfo info;
+        if (read(v->stats->sigfd, &info, sizeof(info)) == sizeof(info))
+            vm_stats_dump(v);
+    }
+    return NULL;
+}
+
+/* Called before any thread exists, so that every thread inherits the blocked
+ * dump signal and it is only ever taken through the signalfd.
+ */
+int vm_stats_init(vm_t *v)
+{
+    struct vm_stats *st =
+        calloc(1, sizeof(*st) + v->cfg.nr_vcpus * sizeof(st->vcpus[0]));
+    if (!st)
+        return throw_err("Failed to allocate stats");
+    st->outfd = STDERR_FILENO;
+    st->sigfd = st->stopfd = -1;
+    v->stats = st;
+    for (int i = 0; i < v->cfg.nr_vcpus; i++)
+        v->vcpus[i].stats = &st->vcpus[i];
+
+    if (v->cfg.stats_file) {
+        st->outfd = open(v->cfg.stats_file,
+                         O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (st->outfd < 0)
+            return throw_err("Failed to open %s", v->cfg.stats_file);
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, STATS_DUMP_SIGNAL);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+        return throw_err("Failed to block the stats signal");
+    st->sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    st->stopfd = eventfd(0, EFD_CLOEXEC);
+    if (st->sigfd < 0 || st->stopfd < 0)
+        return throw_err("Failed to create the stats signalfd");
+
+    clock_gettime(CLOCK_MONOTONIC, &st->start_time);
+    st->start_cycles = stats_cycles();
+    if (pthread_create(&st->tid, NULL, stats_thread, v) != 0)
+        return throw_err("Failed to start the stats thread");
+    st->started = true;
+    return 0;
+}
+
+/* Stop the dump thread and write the final numbers. */
+void vm_stats_exit(vm_t *v)
+{
+    struct vm_stats *st = v->stats;
+    uint64_t n = 1;
+
+    if (!st)
+        return;
+    if (st->started) {
+        if (write(st->stopfd, &n, sizeof(n)) < 0)
+            throw_err("Failed to stop the stats thread");
+        pthread_join(st->tid, NULL);
+    }
+    vm_stats_dump(v);
+
+    if (st->outfd != STDERR_FILENO)
+        close(st->outfd);
+    if (st->sigfd >= 0)
+        close(st->sigfd);
+    if (st->stopfd >= 0)
+        close(st->stopfd);
+    for (int i = 0; i < v->cfg.nr_vcpus; i++)
+        v->vcpus[i].stats = NULL;
+    free(st);
+    v->stats = NULL;
+}
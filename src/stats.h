@@ -0,0 +1,68 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Exit accounting for --stats. Everything is counted in raw cycles of the
+ * CPU timestamp counter; the dump converts with a rate measured over the
+ * VM's lifetime.
+ */
+
+#define STATS_NR_BUCKETS 64 /* bucket i holds [2^i, 2^(i+1)) cycles */
+#define STATS_NR_EXITS 64   /* higher KVM exit reasons share the last slot */
+
+struct stats_hist {
+    uint64_t count;
+    uint64_t cycles;
+    uint64_t buckets[STATS_NR_BUCKETS];
+};
+
+/* Written only by its vCPU thread. */
+struct vcpu_stats {
+    uint64_t exits[STATS_NR_EXITS + 1];
+    struct stats_hist run;    /* time spent inside KVM_RUN */
+    struct stats_hist handle; /* time spent handling the exit */
+};
+
+struct vm_stats {
+    int outfd; /* JSON lines go here, stderr by default */
+    int sigfd; /* SIGUSR2 requests a dump */
+    int stopfd;
+    pthread_t tid;
+    bool started;
+    uint64_t start_cycles;
+    struct timespec start_time;
+    /* Accesses that no device on the bus claimed, under io_lock. */
+    uint64_t unclaimed_pio, unclaimed_mmio;
+    uint64_t coalesced; /* writes replayed from the coalesced ring */
+    struct vcpu_stats vcpus[];
+};
+
+static inline uint64_t stats_cycles(void)
+{
+#if defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t val;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(val));
+    return val;
+#endif
+}
+
+/* Counters have a single writer; the relaxed atomics only keep a concurrent
+ * dump from reading a torn value.
+ */
+static inline void stats_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+static inline void stats_hist_add(struct stats_hist *h, uint64_t cycles)
+{
+    stats_add(&h->count, 1);
+    stats_add(&h->cycles, cycles);
+    stats_add(&h->buckets[63 - __builtin_clzll(cycles | 1)], 1);
+}
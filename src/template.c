@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/memfd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "template.h"
+
+/* Give a clone its own copy of the template's disk: a reflink where the
+ * filesystem supports it, so the copy is instant and shares blocks, and a
+ * full copy otherwise. The file is unlinked at once and goes away with the
+ * clone.
+ */
+static int template_clone_disk(vm_t *v, const char *disk_path)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.clone.XXXXXX", disk_path);
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return throw_err("Failed to create a disk for the clone");
+    unlink(path);
+
+    int src = v->diskimg.fd;
+    if (ioctl(fd, FICLONE, src) == 0)
+        return fd;
+
+    /* The file, not the disk the guest sees: they differ for qcow2. */
+    struct stat st;
+    if (fstat(src, &st) < 0) {
+        close(fd);
+        return throw_err("Failed to stat the template's disk");
+    }
+    loff_t in = 0, out = 0;
+    while (in < st.st_size) {
+        ssize_t n = syscall(SYS_copy_file_range, src, &in, fd, &out,
+                            st.st_size - in, 0);
+        if (n <= 0) {
+            close(fd);
+            return throw_err("Failed to copy the disk for the clone");
+        }
+    }
+    return fd;
+}
+
+/* The clone creates its own KVM VM; the template's descriptors are of no
+ * use to it.
+ */
+static void template_detach(vm_t *v)
+{
+    for (int i = 0; i < v->cfg.nr_vcpus; i++) {
+        munmap(v->vcpus[i].run, v->run_size);
+        close(v->vcpus[i].fd);
+    }
+    close(v->vm_fd);
+    close(v->kvm_fd);
+    if (v->virtio_blk_dev.enable) {
+        virtio_blk_aio_drop(&v->virtio_blk_dev);
+        close(v->diskimg.fd);
+        if (v->diskimg.backing_fd >= 0)
+            close(v->diskimg.backing_fd);
+    }
+    if (v->virtio_net_dev.enable)
+        close(v->virtio_net_dev.tapfd);
+}
+
+static int template_listen(const char *socket_path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return throw_err("Invalid socket path %s", socket_path);
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return throw_err("Failed to create the template socket");
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return throw_err("Failed to listen on %s", socket_path);
+    }
+    return fd;
+}
+
+int vm_template_serve(vm_t *v,
+                      const char *socket_path,
+                      const char *disk_path,
+                      struct vm_clone *clone)
+{
+    if (v->diskimg.blockdev) {
+        /* There is nowhere next to a device node to put a clone's copy. */
+        errno = EINVAL;
+        return throw_err("A template's disk cannot be a block device");
+    }
+    if (v->uffd.ram) {
+        /* Pages userfaultfd has not filled in yet would read as zero in a
+         * clone.
+         */
+        errno = EINVAL;
+        return throw_err("A template cannot be restored with userfaultfd");
+    }
+
+    /* CPU and device state are captured once; each clone replays them on
+     * top of the RAM it inherits.
+     */
+    int state_fd =
+        syscall(SYS_memfd_create, "kvm-host-template", MFD_CLOEXEC);
+    if (state_fd < 0)
+        return throw_err("Failed to create the template state file");
+    if (vm_snapshot_save_state(v, state_fd) < 0)
+        return -1;
+
+    /* No other thread may be running at fork() time, or a clone could
+     * inherit one of its locks held.
+     */
+    serial_exit(&v->serial);
+    vm_stats_exit(v);
+    if (v->virtio_blk_dev.enable)
+        diskimg_flush(&v->diskimg);
+
+    int listen_fd = template_listen(socket_path);
+    if (listen_fd < 0)
+        return -1;
+    /* Clones are reaped automatically. */
+    signal(SIGCHLD, SIG_IGN);
+    /* Nothing buffered may be written twice, once by each clone. */
+    fflush(NULL);
+    fprintf(stderr, "\ntemplate ready on %s\n", socket_path);
+
+    while (1) {
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return throw_err("Failed to accept a clone request");
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            throw_err("Failed to fork a clone");
+        } else if (pid == 0) {
+            signal(SIGCHLD, SIG_DFL);
+            close(listen_fd);
+            *clone = (struct vm_clone) {
+                .state_fd = state_fd,
+                .disk_fd = -1,
+                .conn = conn,
+            };
+            if (v->virtio_blk_dev.enable) {
+                clone->disk_fd = template_clone_disk(v, disk_path);
+                if (clone->disk_fd < 0)
+                    return -1;
+            }
+            template_detach(v);
+            return 0;
+        }
+        close(conn);
+    }
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "vm.h"
+
+/* What a fork()ed clone takes over from the template. */
+struct vm_clone {
+    int state_fd; /* template CPU/device state, see vm_snapshot_save_state */
+    int disk_fd;  /* private copy of the template's disk, or -1 */
+    int conn;     /* client connection, which becomes the clone's console */
+};
+
+/* Turn a VM stopped at its pause point into a template and serve clones on
+ * a UNIX socket. Only returns on error, or in a new clone process with
+ * @clone filled in.
+ */
+int vm_template_serve(vm_t *v,
+                      const char *socket_path,
+                      const char *disk_path,
+                      struct vm_clone *clone);
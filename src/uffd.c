@@ -0,0 +1,336 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "uffd.h"
+#include "utils.h"
+#include "vm.h"
+
+#define TRACE_MAGIC "KVMHTRCE"
+
+struct trace_header {
+    char magic[8];
+    uint32_t page_size;
+    uint32_t nr_pages;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Copy one page in from the snapshot. Returns 1 if this call installed it,
+ * 0 if it was already present and -1 if it could not be installed, in which
+ * case it is left missing for a later attempt.
+ */
+static int uffd_install(struct uffd_restore *r, size_t page)
+{
+    if (__atomic_load_n(&r->installed[page], __ATOMIC_ACQUIRE))
+        return 0;
+
+    struct uffdio_copy copy = {
+        .dst = (uintptr_t) r->ram + page * r->page_size,
+        .src = (uintptr_t) r->src + page * r->page_size,
+        .len = r->page_size,
+    };
+    int ret;
+    while ((ret = ioctl(r->uffd, UFFDIO_COPY, &copy)) < 0 && errno == EAGAIN)
+        copy.copy = 0;
+    if (ret < 0 && errno != EEXIST)
+        return -1;
+    __atomic_store_n(&r->installed[page], 1, __ATOMIC_RELEASE);
+    if (ret == 0)
+        return 1;
+
+    /* The other thread won the race. Its copy woke the faulting thread
+     * already, but a wake here is cheap and covers a copy still in flight.
+     */
+    struct uffdio_range range = {.start = copy.dst, .len = copy.len};
+    ioctl(r->uffd, UFFDIO_WAKE, &range);
+    return 0;
+}
+
+static void uffd_handle_fault(struct uffd_restore *r, uint64_t addr)
+{
+    uint64_t start = now_ns();
+    size_t page = (addr - (uintptr_t) r->ram) / r->page_size;
+    if (page >= r->nr_pages)
+        return;
+
+    /* A page that cannot be read (a truncated snapshot, no memory) stops
+     * the VM. The faulting thread keeps retrying until the page is there,
+     * even with the stop signal pending, so it gets a zero page to get on
+     * with seeing the stop.
+     */
+    if (uffd_install(r, page) < 0) {
+        throw_err("Failed to restore guest page %zu", page);
+        vm_stop(container_of(r, vm_t, uffd), -1);
+        struct uffdio_zeropage zero = {
+            .range = {.start = (uintptr_t) r->ram + page * r->page_size,
+                      .len = r->page_size},
+        };
+        if (ioctl(r->uffd, UFFDIO_ZEROPAGE, &zero) == 0 || errno == EEXIST)
+            __atomic_store_n(&r->installed[page], 1, __ATOMIC_RELEASE);
+        return;
+    }
+    if (r->recording && r->trace_len < r->nr_pages)
+        r->trace[r->trace_len++] = page;
+
+    if (r->trace_pos && r->trace_pos[page]) {
+        /* The vCPU is already at this point of the trace; move the
+         * prefetcher up so that it keeps working ahead of it.
+         */
+        size_t pos = r->trace_pos[page];
+        size_t hint = __atomic_load_n(&r->prefetch_hint, __ATOMIC_RELAXED);
+        if (pos > hint)
+            __atomic_store_n(&r->prefetch_hint, pos, __ATOMIC_RELAXED);
+        r->faults_late++;
+    }
+
+    uint64_t ns = now_ns() - start;
+    r->faults++;
+    r->fault_ns += ns;
+    if (ns > r->fault_max_ns)
+        r->fault_max_ns = ns;
+}
+
+static void *uffd_fault_thread(void *arg)
+{
+    struct uffd_restore *r = (struct uffd_restore *) arg;
+    struct pollfd pollfds[] = {
+        [0] = {.fd = r->uffd, .events = POLLIN},
+        [1] = {.fd = r->stopfd, .events = POLLIN},
+    };
+
+    while (1) {
+        if (poll(pollfds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pollfds[1].revents & POLLIN)
+            break;
+
+        struct uffd_msg msgs[16];
+        ssize_t n = read(r->uffd, msgs, sizeof(msgs));
+        if (n <= 0)
+            continue;
+        for (size_t i = 0; i < n / sizeof(msgs[0]); i++) {
+            if (msgs[i].event == UFFD_EVENT_PAGEFAULT)
+                uffd_handle_fault(r, msgs[i].arg.pagefault.address);
+        }
+    }
+    return NULL;
+}
+
+static void *uffd_prefetch_thread(void *arg)
+{
+    struct uffd_restore *r = (struct uffd_restore *) arg;
+
+    /* Walk the trace in order, skipping forward whenever a fault shows the
+     * guest has overtaken us, then go back for the pages that were skipped.
+     * A page that cannot be installed is left to the fault thread.
+     */
+    for (size_t pos = 0; pos < r->trace_len; pos++) {
+        if (__atomic_load_n(&r->stopping, __ATOMIC_RELAXED))
+            return NULL;
+        size_t hint = __atomic_load_n(&r->prefetch_hint, __ATOMIC_RELAXED);
+        if (hint > pos)
+            pos = hint;
+        if (pos < r->trace_len && uffd_install(r, r->trace[pos]) > 0)
+            __atomic_fetch_add(&r->prefetched, 1, __ATOMIC_RELAXED);
+    }
+    for (size_t pos = 0; pos < r->trace_len; pos++) {
+        if (__atomic_load_n(&r->stopping, __ATOMIC_RELAXED))
+            return NULL;
+        if (uffd_install(r, r->trace[pos]) > 0)
+            __atomic_fetch_add(&r->prefetched, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/* Load the prefetch order, or get ready to record one if there is none. */
+static int uffd_open_trace(struct uffd_restore *r, const char *path)
+{
+    r->trace_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (r->trace_fd < 0) {
+        if (errno != ENOENT)
+            return throw_err("Failed to open trace %s", path);
+        /* Opened now so that it can be written under --seccomp. */
+        r->trace_fd =
+            open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (r->trace_fd < 0)
+            return throw_err("Failed to create trace %s", path);
+        r->recording = true;
+        return 0;
+    }
+
+    struct trace_header hdr;
+    if (read(r->trace_fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) ||
+        hdr.page_size != r->page_size || hdr.nr_pages > r->nr_pages) {
+        errno = EINVAL;
+        return throw_err("%s is not a trace for this snapshot", path);
+    }
+    size_t len = hdr.nr_pages * sizeof(r->trace[0]);
+    if (read(r->trace_fd, r->trace, len) != (ssize_t) len)
+        return throw_err("Failed to read trace %s", path);
+    r->trace_len = hdr.nr_pages;
+
+    r->trace_pos = calloc(r->nr_pages, sizeof(r->trace_pos[0]));
+    if (!r->trace_pos)
+        return throw_err("Failed to allocate trace index");
+    for (size_t i = 0; i < r->trace_len; i++) {
+        if (r->trace[i] >= r->nr_pages) {
+            errno = EINVAL;
+            return throw_err("%s is not a trace for this snapshot", path);
+        }
+        r->trace_pos[r->trace[i]] = i + 1;
+    }
+    return 0;
+}
+
+int uffd_restore_init(struct uffd_restore *r,
+                      void *ram,
+                      size_t size,
+                      int snapshot_fd,
+                      off_t ram_offset,
+                      const char *trace_path)
+{
+    *r = (struct uffd_restore) {
+        .uffd = -1,
+        .stopfd = -1,
+        .trace_fd = -1,
+        .ram = ram,
+        .size = size,
+        .page_size = getpagesize(),
+    };
+    r->nr_pages = size / r->page_size;
+
+    r->src = mmap(NULL, size, PROT_READ, MAP_SHARED, snapshot_fd, ram_offset);
+    if (r->src == MAP_FAILED) {
+        r->src = NULL;
+        return throw_err("Failed to map snapshot memory");
+    }
+    r->installed = calloc(r->nr_pages, 1);
+    if (!r->installed)
+        return throw_err("Failed to allocate the page map");
+    if (trace_path) {
+        r->trace = calloc(r->nr_pages, sizeof(r->trace[0]));
+        if (!r->trace)
+            return throw_err("Failed to allocate the page trace");
+        if (uffd_open_trace(r, trace_path) < 0)
+            return -1;
+    }
+
+    r->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (r->uffd < 0)
+        return throw_err("Failed to create userfaultfd (see "
+                         "vm.unprivileged_userfaultfd)");
+    struct uffdio_api api = {.api = UFFD_API};
+    if (ioctl(r->uffd, UFFDIO_API, &api) < 0)
+        return throw_err("Failed to negotiate the userfaultfd API");
+    struct uffdio_register reg = {
+        .range = {.start = (uintptr_t) ram, .len = size},
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+    if (ioctl(r->uffd, UFFDIO_REGISTER, &reg) < 0)
+        return throw_err("Failed to register guest memory with userfaultfd");
+
+    r->stopfd = eventfd(0, EFD_CLOEXEC);
+    if (r->stopfd < 0)
+        return throw_err("Failed to create userfaultfd stop eventfd");
+    if (pthread_create(&r->fault_tid, NULL, uffd_fault_thread, r) != 0)
+        return throw_err("Failed to start the userfaultfd thread");
+    r->fault_started = true;
+    if (r->trace_len) {
+        if (pthread_create(&r->prefetch_tid, NULL, uffd_prefetch_thread, r) ==
+            0)
+            r->prefetch_started = true;
+    }
+    return 0;
+}
+
+static void uffd_report(struct uffd_restore *r)
+{
+    uint64_t installed = r->prefetched + r->faults_late;
+    fprintf(stderr,
+            "uffd restore: %llu faults, avg %.1f us, max %.1f us; "
+            "%llu pages prefetched",
+            (unsigned long long) r->faults,
+            r->faults ? r->fault_ns / 1e3 / r->faults : 0.0,
+            r->fault_max_ns / 1e3, (unsigned long long) r->prefetched);
+    /* Of the trace pages that were installed, the share the prefetcher got
+     * to before the guest faulted on them. A prefetched page the guest
+     * never touches counts too, so this is how far ahead the prefetcher
+     * kept, not how many of its pages were of use.
+     */
+    if (r->trace_len && installed)
+        fprintf(stderr,
+                ", %.1f%% of trace pages ahead of the guest, "
+                "%llu faults outside the trace",
+                100.0 * r->prefetched / installed,
+                (unsigned long long) (r->faults - r->faults_late));
+    fprintf(stderr, "\n");
+}
+
+static void uffd_write_trace(struct uffd_restore *r)
+{
+    struct trace_header hdr = {
+        .magic = TRACE_MAGIC,
+        .page_size = r->page_size,
+        .nr_pages = r->trace_len,
+    };
+    size_t len = r->trace_len * sizeof(r->trace[0]);
+    if (write(r->trace_fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        write(r->trace_fd, r->trace, len) != (ssize_t) len)
+        throw_err("Failed to write the page trace");
+    else
+        fprintf(stderr, "uffd restore: recorded %zu pages\n", r->trace_len);
+}
+
+void uffd_restore_exit(struct uffd_restore *r)
+{
+    uint64_t n = 1;
+
+    if (!r->ram)
+        return;
+    __atomic_store_n(&r->stopping, true, __ATOMIC_RELAXED);
+    if (r->prefetch_started)
+        pthread_join(r->prefetch_tid, NULL);
+    if (r->fault_started) {
+        if (write(r->stopfd, &n, sizeof(n)) < 0)
+            throw_err("Failed to stop the userfaultfd thread");
+        pthread_join(r->fault_tid, NULL);
+        uffd_report(r);
+    }
+    if (r->recording)
+        uffd_write_trace(r);
+
+    if (r->trace_fd >= 0)
+        close(r->trace_fd);
+    if (r->stopfd >= 0)
+        close(r->stopfd);
+    if (r->uffd >= 0)
+        close(r->uffd);
+    if (r->src)
+        munmap((void *) r->src, r->size);
+    free(r->installed);
+    free(r->trace);
+    free(r->trace_pos);
+    r->ram = NULL;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Lazy restore of guest RAM through userfaultfd. Every page starts missing;
+ * a fault thread copies each one in from the snapshot on first touch, and a
+ * prefetch thread replays the page order recorded by an earlier restore so
+ * that most pages are already there when a vCPU gets to them.
+ */
+struct uffd_restore {
+    int uffd;
+    int stopfd;
+    uint8_t *ram;
+    const uint8_t *src; /* read-only mapping of the snapshot's RAM */
+    size_t size;
+    size_t page_size;
+    size_t nr_pages;
+    uint8_t *installed; /* per page, set once it has been copied in */
+
+    /* Page-touch trace. With no trace on disk the faults are recorded into
+     * it; otherwise it is the prefetch order and trace_pos maps a page back
+     * to its index (+1, 0 for pages not in the trace).
+     */
+    int trace_fd;
+    bool recording;
+    uint32_t *trace;
+    size_t trace_len;
+    uint32_t *trace_pos;
+    size_t prefetch_hint;
+
+    pthread_t fault_tid, prefetch_tid;
+    bool fault_started, prefetch_started;
+    bool stopping;
+
+    uint64_t faults;      /* demand faults served */
+    uint64_t faults_late; /* ... on pages the prefetcher had not reached */
+    uint64_t fault_ns, fault_max_ns;
+    uint64_t prefetched; /* pages installed ahead of any fault */
+};
+
+int uffd_restore_init(struct uffd_restore *r,
+                      void *ram,
+                      size_t size,
+                      int snapshot_fd,
+                      off_t ram_offset,
+                      const char *trace_path);
+void uffd_restore_exit(struct uffd_restore *r);
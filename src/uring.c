@@ -0,0 +1,133 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+static void *uring_map(int fd, size_t size, off_t offset)
+{
+    return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd, offset);
+}
+
+int uring_init(struct uring *r, unsigned entries, unsigned flags)
+{
+    struct io_uring_params p = {.flags = flags};
+
+    *r = (struct uring) {.fd = -1};
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->sq_entries = p.sq_entries;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ring = uring_map(r->fd, r->sq_ring_size, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED)
+        goto err;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ring = r->sq_ring;
+    else
+        r->cq_ring = uring_map(r->fd, r->cq_ring_size, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED)
+        goto err;
+    r->sqes = uring_map(r->fd, r->sqes_size, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto err;
+
+    r->sq_head = (unsigned *) ((char *) r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned *) ((char *) r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *) ((char *) r->sq_ring + p.sq_off.ring_mask);
+    r->cq_head = (unsigned *) ((char *) r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned *) ((char *) r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *) ((char *) r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ring + p.cq_off.cqes);
+
+    /* SQ slot i always names SQE i; SQEs are handed out in ring order. */
+    unsigned *array = (unsigned *) ((char *) r->sq_ring + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+    r->sqe_tail = *r->sq_tail;
+    return 0;
+
+err:
+    if (r->sq_ring == MAP_FAILED)
+        r->sq_ring = NULL;
+    if (r->cq_ring == MAP_FAILED)
+        r->cq_ring = NULL;
+    if (r->sqes == MAP_FAILED)
+        r->sqes = NULL;
+    uring_exit(r);
+    return -1;
+}
+
+int uring_register(struct uring *r, unsigned opcode, void *arg, unsigned nr)
+{
+    return syscall(__NR_io_uring_register, r->fd, opcode, arg, nr);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sqe_tail - head >= r->sq_entries)
+        return NULL;
+    struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+    r->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit(struct uring *r, unsigned wait_nr)
+{
+    /* Release pairs with the kernel's acquire of the tail: the SQE contents
+     * are visible before it sees them.
+     */
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    unsigned pending =
+        r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (!pending && !wait_nr)
+        return 0;
+
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, pending, wait_nr,
+                      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *r)
+{
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r)
+{
+    /* The CQE has been consumed before the kernel may reuse its slot. */
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_exit(struct uring *r)
+{
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring && r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring)
+        munmap(r->sq_ring, r->sq_ring_size);
+    if (r->fd >= 0)
+        close(r->fd);
+    *r = (struct uring) {.fd = -1};
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/* Bare io_uring instance driven through the raw syscalls, for a single
+ * submitting thread. Only what the disk backend needs is wrapped.
+ */
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned sqe_tail; /* SQEs handed out, published on uring_submit */
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+int uring_init(struct uring *r, unsigned entries, unsigned flags);
+int uring_register(struct uring *r, unsigned opcode, void *arg, unsigned nr);
+/* Next free SQE, zeroed, or NULL if the submission queue is full. */
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+/* Submit the SQEs handed out so far and wait for @wait_nr completions. */
+int uring_submit(struct uring *r, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+void uring_exit(struct uring *r);
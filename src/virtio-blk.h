@@ -4,14 +4,28 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include "diskimg.h"
 #include "pci.h"
 #include "virtio-pci.h"
 #include "virtq.h"
 
-#define VIRTIO_BLK_VIRTQ_NUM 1
+/* Request queues, each served by a worker thread of its own. */
+#define VIRTIO_BLK_MAX_QUEUES 16
 #define VIRTIO_BLK_PCI_CLASS 0x018000
+/* io_uring takes fixed buffers of at most 1 GiB each. */
+#define VIRTIO_BLK_RAM_BUF_SIZE (1ULL << 30)
+#define VIRTIO_BLK_RAM_BUFS 256
+
+/* Ranges one DISCARD or WRITE_ZEROES request may carry, which is also
+ * what the Linux driver sends at most, and sectors it may cover.
+ */
+#define VIRTIO_BLK_DISCARD_SEGS 256
+#define VIRTIO_BLK_DISCARD_SECTORS ((1U << 30) >> 9)
+
+/* Granularity at which --disk-zeroes unmap finds zeros in writes. */
+#define VIRTIO_BLK_ZERO_BLOCK 4096
 
 /* Wire-format header is the first three fields (type/reserved/sector); the
  * trailing host-only bookkeeping is filled in by the device emulator from the
@@ -26,24 +40,129 @@ struct virtio_blk_req {
     uint8_t *status;
 };
 
+/* Snapshot of one descriptor in a chain. We copy the volatile guest fields
+ * once so subsequent decisions cannot tear against a concurrent guest write.
+ */
+struct desc_snap {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t id;
+};
+
+/* Segments an I/O handed to io_uring keeps in its slot; more are
+ * allocated.
+ */
+#define VIRTIO_BLK_AIO_SEGS 8
+
+/* A request taken off the ring and not yet returned. */
+struct virtio_blk_pending {
+    uint8_t *status;
+    uint64_t len; /* data bytes the request must move */
+    uint16_t id;  /* buffer ID */
+    uint16_t ndescs;
+    bool device_writes; /* a read: data lands in guest buffers */
+};
+
+/* Reads or writes pulled off the ring in one pass that continue each other
+ * on disk, merged into one vectored I/O.
+ */
+struct virtio_blk_batch {
+    bool write;
+    bool aligned; /* can go to an O_DIRECT image without bouncing */
+    uint64_t offset, len;
+    unsigned nr_reqs;
+    struct virtio_blk_pending *reqs; /* one per descriptor of the queue */
+    int cnt;
+    struct iovec iov[DISKIMG_IOV_MAX];
+};
+
+/* An I/O handed to io_uring, completed by its slot index. */
+struct virtio_blk_inflight {
+    uint64_t write_seq; /* of a write, while it is in flight; else 0 */
+    unsigned nr_reqs;
+    struct virtio_blk_pending *reqs; /* &req, or allocated */
+    struct iovec *iov;               /* iov_inline, or allocated */
+    struct virtio_blk_pending req;
+    struct iovec iov_inline[VIRTIO_BLK_AIO_SEGS];
+};
+
+/* A FLUSH, first held by its queue until the writes issued before it have
+ * completed, then by the sync thread until an fdatasync covers it.
+ */
+struct virtio_blk_flush {
+    struct virtio_blk_flush *next;
+    struct virtio_blk_queue *q;
+    struct virtio_blk_pending req;
+    uint64_t write_seq; /* the last write it waits for */
+    int ret;
+};
+
+struct virtio_blk_queue {
+    int ioeventfd; /* kicks for this queue only, matched on the queue index */
+    int irqfd;
+    int aio_eventfd;
+    int flush_eventfd; /* flushes are back from the sync thread */
+    pthread_t thread;
+    bool thread_started;
+    /* Set up with the device, used by the worker thread while it runs. */
+    struct diskimg_aio aio;
+    bool aio_enabled;
+    bool used; /* buffers returned since the driver was last signalled */
+    struct virtq_poll poll;
+    struct virtio_blk_batch *batch;
+    /* The chain being taken off the ring and its data segments. */
+    struct desc_snap *chain;
+    struct iovec *iov;
+    struct virtio_blk_inflight *inflight;
+    uint16_t *free_slots;
+    unsigned nr_slots; /* one per descriptor the ring may have */
+    unsigned nr_free;
+    uint64_t write_seq; /* writes issued to the io_uring so far */
+    /* Flushes waiting for earlier writes, oldest first. */
+    struct virtio_blk_flush *waiting, **waiting_tail;
+    unsigned nr_flushes; /* taken off the ring and not yet returned */
+    struct virtio_blk_flush *synced; /* under the device's sync_lock */
+};
+
 struct virtio_blk_dev {
     struct virtio_pci_dev virtio_pci_dev;
     struct virtio_blk_config config;
-    struct virtq vq[VIRTIO_BLK_VIRTQ_NUM];
-    int irqfd;
-    int ioeventfd;
-    int stopfd;
+    struct virtq vq[VIRTIO_BLK_MAX_QUEUES];
+    struct virtio_blk_queue queues[VIRTIO_BLK_MAX_QUEUES];
+    int num_queues;
+    int stopfd; /* shared: one write stops every worker */
+    /* Group commit: the sync thread takes every flush handed to it so far
+     * and covers them all with one diskimg_flush.
+     */
+    pthread_t sync_thread;
+    bool sync_started;
+    bool sync_stop;
+    pthread_mutex_t sync_lock;
+    pthread_cond_t sync_cond;
+    struct virtio_blk_flush *sync_list;
     int irq_num;
-    pthread_t vq_avail_thread;
     struct diskimg *diskimg;
-    bool vq_thread_started;
+    /* Guest RAM as io_uring fixed buffers; nr_ram_bufs is 0 to not pin. */
+    struct iovec ram_bufs[VIRTIO_BLK_RAM_BUFS];
+    unsigned nr_ram_bufs;
     bool enable;
 };
 
 void virtio_blk_init(struct virtio_blk_dev *virtio_blk_dev);
 void virtio_blk_exit(struct virtio_blk_dev *dev);
+/* Release the io_urings in a fork()ed clone: they hold the parent's disk
+ * files open.
+ */
+void virtio_blk_aio_drop(struct virtio_blk_dev *dev);
+/* Join the workers; the device keeps its state for virtio_blk_save. */
+void virtio_blk_stop(struct virtio_blk_dev *dev);
+int virtio_blk_save(struct virtio_blk_dev *dev, int fd);
+int virtio_blk_restore(struct virtio_blk_dev *dev, int fd);
 int virtio_blk_init_pci(struct virtio_blk_dev *dev,
                         struct diskimg *diskimg,
+                        int num_queues,
+                        uint16_t queue_size,
                         struct pci *pci,
                         struct bus *io_bus,
                         struct bus *mmio_bus);
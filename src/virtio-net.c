@@ -20,8 +20,6 @@
 #include "vm.h"
 
 #define TAP_INTERFACE "tap%d"
-#define VIRTQ_RX 0
-#define VIRTQ_TX 1
 #define NOTIFY_OFFSET 2
 
 static bool virtio_net_stop_requested(struct virtio_net_dev *dev)
@@ -33,17 +31,28 @@ static bool virtio_net_stop_requested(struct virtio_net_dev *dev)
     return poll(&pollfd, 1, 0) > 0 && (pollfd.revents & POLLIN);
 }
 
-static bool virtio_net_poll_rx(struct virtio_net_dev *dev)
+/* Wait for a frame on the TAP, or with @starved, for the guest to add
+ * receive buffers. Returns whether there is a frame to take.
+ */
+static bool virtio_net_poll_rx(struct virtio_net_dev *dev, bool starved)
 {
     struct pollfd pollfds[] = {
-        [0] = {.fd = dev->tapfd, .events = POLLIN},
+        [0] = {.fd = starved ? dev->rx_ioeventfd : dev->tapfd,
+               .events = POLLIN},
         [1] = {.fd = dev->stopfd, .events = POLLIN},
     };
 
     int ret = poll(pollfds, 2, -1);
-
-    return ret > 0 && (pollfds[0].revents & POLLIN) &&
-           !(pollfds[1].revents & POLLIN);
+    if (ret <= 0 || (pollfds[1].revents & POLLIN) ||
+        !(pollfds[0].revents & POLLIN))
+        return false;
+    if (starved) {
+        uint64_t n;
+        ssize_t ignored = read(dev->rx_ioeventfd, &n, sizeof(n));
+        (void) ignored;
+        return false;
+    }
+    return true;
 }
 
 static bool virtio_net_poll_tx(struct virtio_net_dev *dev)
@@ -78,8 +87,13 @@ static void *virtio_net_vq_avail_handler_rx(void *arg)
     struct virtio_net_dev *dev = (struct virtio_net_dev *) vq->dev;
 
     while (!virtio_net_stop_requested(dev)) {
-        virtq_set_guest_event_flags(vq, VRING_PACKED_EVENT_FLAG_ENABLE);
-        if (virtio_net_poll_rx(dev))
+        /* Frames wake the worker, not kicks: the guest needs to kick only
+         * once the ring has run out of buffers for them.
+         */
+        bool starved = !virtq_has_avail(vq) && !virtq_enable_notify(vq);
+        if (!starved)
+            virtq_disable_notify(vq);
+        if (virtio_net_poll_rx(dev, starved))
             virtq_handle_avail(vq);
     }
     return NULL;
@@ -89,11 +103,24 @@ static void *virtio_net_vq_avail_handler_tx(void *arg)
 {
     struct virtq *vq = (struct virtq *) arg;
     struct virtio_net_dev *dev = (struct virtio_net_dev *) vq->dev;
+    vm_t *v = container_of(dev, vm_t, virtio_net_dev);
 
+    virtq_poll_init(&dev->tx_poll, v->cfg.io_poll_ns);
     while (!virtio_net_stop_requested(dev)) {
-        virtq_set_guest_event_flags(vq, VRING_PACKED_EVENT_FLAG_ENABLE);
-        if (virtio_net_poll_tx(dev))
-            virtq_handle_avail(vq);
+        /* The guest kicks only while the worker sleeps; a TX stalled on a
+         * full TAP waits for the TAP instead. RX is driven by frames on the
+         * TAP rather than by the ring, so only TX spins.
+         */
+        if (dev->tx_wait_for_tap ||
+            !(virtq_poll(vq, &dev->tx_poll, NULL, NULL) ||
+              virtq_enable_notify(vq))) {
+            bool kicked = virtio_net_poll_tx(dev);
+            virtq_poll_slept(&dev->tx_poll);
+            if (!kicked)
+                continue;
+        }
+        virtq_disable_notify(vq);
+        virtq_handle_avail(vq);
     }
     return NULL;
 }
@@ -113,10 +140,12 @@ static void virtio_net_enable_vq_rx(struct virtq *vq)
     vq->guest_event = (struct vring_packed_desc_event *) vm_guest_to_host(
         v, vq->info.driver_addr);
     uint64_t addr = virtio_pci_get_notify_addr(&dev->virtio_pci_dev, vq);
-    vm_ioeventfd_register(v, dev->rx_ioeventfd, addr, NOTIFY_OFFSET, 0);
+    vm_ioeventfd_register(v, dev->rx_ioeventfd, addr, NOTIFY_OFFSET, 0, 0);
     if (pthread_create(&dev->rx_thread, NULL, virtio_net_vq_avail_handler_rx,
-                       (void *) vq) == 0)
+                       (void *) vq) == 0) {
         dev->rx_thread_started = true;
+        vm_pin_io_thread(v, dev->rx_thread);
+    }
 }
 
 static void virtio_net_enable_vq_tx(struct virtq *vq)
@@ -135,10 +164,12 @@ static void virtio_net_enable_vq_tx(struct virtq *vq)
         v, vq->info.driver_addr);
 
     uint64_t addr = virtio_pci_get_notify_addr(&dev->virtio_pci_dev, vq);
-    vm_ioeventfd_register(v, dev->tx_ioeventfd, addr, NOTIFY_OFFSET, 0);
+    vm_ioeventfd_register(v, dev->tx_ioeventfd, addr, NOTIFY_OFFSET, 0, 0);
     if (pthread_create(&dev->tx_thread, NULL, virtio_net_vq_avail_handler_tx,
-                       (void *) vq) == 0)
+                       (void *) vq) == 0) {
         dev->tx_thread_started = true;
+        vm_pin_io_thread(v, dev->tx_thread);
+    }
 }
 
 static void virtio_net_notify_used_rx(struct virtq *vq)
@@ -158,16 +189,6 @@ static void virtio_net_notify_used_tx(struct virtq *vq)
         throw_err("Failed to write the irqfd");
 }
 
-/* Snapshot of one descriptor in a chain, copied once so guest-side races can
- * not tear our subsequent decisions.
- */
-struct net_desc_snap {
-    uint64_t addr;
-    uint32_t len;
-    uint16_t flags;
-    uint16_t id;
-};
-
 /* Walk the chain rooted at head, copying each descriptor into out[]. cap bounds
  * the chain length. Returns the count on success or 0 on malformed chain (NULL
  * mid-walk or chain longer than cap). The head has been consumed regardless, so
@@ -206,11 +227,11 @@ void virtio_net_complete_request_rx(struct virtq *vq)
     const size_t hdr_len = sizeof(struct virtio_net_hdr_v1);
 
     while ((head = virtq_get_avail(vq))) {
-        struct net_desc_snap chain[VIRTQ_SIZE];
-        /* See virtio-blk for why we cap at VIRTQ_SIZE rather than the
+        struct net_desc_snap *chain = dev->chain[VIRTQ_RX];
+        /* See virtio-blk for why we cap at max_size rather than the
          * guest-controlled vq->info.size.
          */
-        size_t n = net_walk_chain(vq, head, chain, VIRTQ_SIZE);
+        size_t n = net_walk_chain(vq, head, chain, vq->max_size);
         if (n == 0) {
             /* Malformed chain — buffer ID lives on the last descriptor and we
              * never reached it. Publishing USED with chain[0].id (which the
@@ -219,7 +240,6 @@ void virtio_net_complete_request_rx(struct virtq *vq)
              * advance next_used_idx by an unrelated chain length. Stalling is
              * the lesser evil; a misbehaving driver hangs only itself.
              */
-            virtq_set_guest_event_flags(vq, VRING_PACKED_EVENT_FLAG_DISABLE);
             return;
         }
         uint16_t buffer_id = chain[n - 1].id;
@@ -228,7 +248,7 @@ void virtio_net_complete_request_rx(struct virtq *vq)
         /* Build iov over device-writable buffers; reject chains that mix
          * directions (per RX rules every descriptor must be writable).
          */
-        struct iovec iov[VIRTQ_SIZE];
+        struct iovec *iov = dev->iov[VIRTQ_RX];
         size_t iov_n = 0;
         size_t writable_total = 0;
         bool ok = true;
@@ -279,20 +299,14 @@ void virtio_net_complete_request_rx(struct virtq *vq)
         used_len = (uint32_t) hdr_len + (uint32_t) got;
 
     rx_publish:
-        virtq_publish_used(head, buffer_id, used_len);
+        virtq_push_used(vq, buffer_id, used_len, n);
         __atomic_fetch_or(&dev->virtio_pci_dev.config.isr_cap.isr_status,
                           VIRTIO_PCI_ISR_QUEUE, __ATOMIC_RELEASE);
-        if (used_len == 0) {
-            /* Wedged — back off so we don't hot-loop on a broken chain. */
-            virtq_set_guest_event_flags(vq, VRING_PACKED_EVENT_FLAG_DISABLE);
-            return;
-        }
         /* Process exactly one chain per call so the worker can re-poll the tap
          * before draining the next packet.
          */
         return;
     }
-    virtq_set_guest_event_flags(vq, VRING_PACKED_EVENT_FLAG_DISABLE);
 }
 
 void virtio_net_complete_request_tx(struct virtq *vq)
@@ -314,11 +328,10 @@ void virtio_net_complete_request_tx(struct virtq *vq)
         bool used_wrap_count = vq->used_wrap_count;
         if (!(head = virtq_get_avail(vq)))
             break;
-        struct net_desc_snap chain[VIRTQ_SIZE];
-        size_t n = net_walk_chain(vq, head, chain, VIRTQ_SIZE);
+        struct net_desc_snap *chain = dev->chain[VIRTQ_TX];
+        size_t n = net_walk_chain(vq, head, chain, vq->max_size);
         if (n == 0) {
             /* See RX path: don't publish USED with a stale id. */
-            virtq_set_guest_event_flags(vq, VRING_PACKED_EVENT_FLAG_DISABLE);
             return;
         }
         uint16_t buffer_id = chain[n - 1].id;
@@ -326,7 +339,7 @@ void virtio_net_complete_request_tx(struct virtq *vq)
         /* Build iov over device-readable buffers; reject chains that mix
          * directions (per TX rules every descriptor must be readable).
          */
-        struct iovec iov[VIRTQ_SIZE];
+        struct iovec *iov = dev->iov[VIRTQ_TX];
         size_t iov_n = 0;
         size_t total = 0;
         bool ok = true;
@@ -369,8 +382,6 @@ void virtio_net_complete_request_tx(struct virtq *vq)
                 vq->next_avail_idx = avail_idx;
                 vq->used_wrap_count = used_wrap_count;
                 dev->tx_wait_for_tap = true;
-                virtq_set_guest_event_flags(vq,
-                                            VRING_PACKED_EVENT_FLAG_DISABLE);
                 return;
             }
         }
@@ -379,7 +390,7 @@ void virtio_net_complete_request_tx(struct virtq *vq)
         /* TX buffers are device-readable only — no bytes were written to
          * device-writable buffers, so used.len = 0.
          */
-        virtq_publish_used(head, buffer_id, 0);
+        virtq_push_used(vq, buffer_id, 0, n);
         __atomic_fetch_or(&dev->virtio_pci_dev.config.isr_cap.isr_status,
                           VIRTIO_PCI_ISR_QUEUE, __ATOMIC_RELEASE);
         /* Drain the entire virtq in one wakeup. The ioeventfd was already read
@@ -387,7 +398,6 @@ void virtio_net_complete_request_tx(struct virtq *vq)
          * untouched until the next guest kick.
          */
     }
-    virtq_set_guest_event_flags(vq, VRING_PACKED_EVENT_FLAG_DISABLE);
 }
 
 static struct virtq_ops virtio_net_ops[VIRTIO_NET_VIRTQ_NUM] = {
@@ -399,6 +409,16 @@ static struct virtq_ops virtio_net_ops[VIRTIO_NET_VIRTQ_NUM] = {
                   .notify_used = virtio_net_notify_used_tx},
 };
 
+static void virtio_net_free_scratch(struct virtio_net_dev *dev)
+{
+    for (int i = 0; i < VIRTIO_NET_VIRTQ_NUM; i++) {
+        free(dev->chain[i]);
+        free(dev->iov[i]);
+        dev->chain[i] = NULL;
+        dev->iov[i] = NULL;
+    }
+}
+
 bool virtio_net_init(struct virtio_net_dev *virtio_net_dev)
 {
     memset(virtio_net_dev, 0x00, sizeof(struct virtio_net_dev));
@@ -425,10 +445,19 @@ bool virtio_net_init(struct virtio_net_dev *virtio_net_dev)
     return true;
 }
 
-static int virtio_net_setup(struct virtio_net_dev *dev)
+static int virtio_net_setup(struct virtio_net_dev *dev, uint16_t queue_size)
 {
     vm_t *v = container_of(dev, vm_t, virtio_net_dev);
 
+    for (int i = 0; i < VIRTIO_NET_VIRTQ_NUM; i++) {
+        dev->chain[i] = calloc(queue_size, sizeof(*dev->chain[i]));
+        dev->iov[i] = calloc(queue_size, sizeof(*dev->iov[i]));
+        if (!dev->chain[i] || !dev->iov[i]) {
+            virtio_net_free_scratch(dev);
+            return throw_err("Failed to allocate virtio-net queues");
+        }
+    }
+
     dev->rx_ioeventfd = eventfd(0, EFD_CLOEXEC);
     dev->tx_ioeventfd = eventfd(0, EFD_CLOEXEC);
     dev->stopfd = eventfd(0, EFD_CLOEXEC);
@@ -443,6 +472,7 @@ static int virtio_net_setup(struct virtio_net_dev *dev)
             close(dev->stopfd);
         if (dev->irqfd >= 0)
             close(dev->irqfd);
+        virtio_net_free_scratch(dev);
         return throw_err("Failed to create virtio-net eventfds");
     }
 
@@ -452,18 +482,19 @@ static int virtio_net_setup(struct virtio_net_dev *dev)
     for (int i = 0; i < VIRTIO_NET_VIRTQ_NUM; i++) {
         struct virtq_ops *ops = &virtio_net_ops[i];
         dev->vq[i].info.notify_off = i;
-        virtq_init(&dev->vq[i], dev, ops);
+        virtq_init(&dev->vq[i], dev, ops, queue_size);
     }
     return 0;
 }
 
 int virtio_net_init_pci(struct virtio_net_dev *virtio_net_dev,
+                        uint16_t queue_size,
                         struct pci *pci,
                         struct bus *io_bus,
                         struct bus *mmio_bus)
 {
     struct virtio_pci_dev *dev = &virtio_net_dev->virtio_pci_dev;
-    if (virtio_net_setup(virtio_net_dev) < 0)
+    if (virtio_net_setup(virtio_net_dev, queue_size) < 0)
         return -1;
     virtio_pci_init(dev, pci, io_bus, mmio_bus);
     virtio_pci_set_dev_cfg(dev, &virtio_net_dev->config,
@@ -474,26 +505,54 @@ int virtio_net_init_pci(struct virtio_net_dev *virtio_net_dev,
     virtio_pci_set_virtq(dev, virtio_net_dev->vq, VIRTIO_NET_VIRTQ_NUM);
 
     virtio_pci_add_feature(dev, VIRTIO_NET_F_MQ);
+    virtio_pci_add_feature(dev, 1ULL << VIRTIO_RING_F_EVENT_IDX);
     virtio_pci_enable(dev);
     return 0;
 }
 
-void virtio_net_exit(struct virtio_net_dev *dev)
+void virtio_net_stop(struct virtio_net_dev *dev)
 {
     uint64_t n = 1;
 
     if (!dev->enable)
         return;
-    if (dev->stopfd >= 0 && write(dev->stopfd, &n, sizeof(n)) < 0)
+    if (write(dev->stopfd, &n, sizeof(n)) < 0)
         throw_err("Failed to wake virtio-net workers");
     if (dev->rx_thread_started)
         pthread_join(dev->rx_thread, NULL);
     if (dev->tx_thread_started)
         pthread_join(dev->tx_thread, NULL);
+    dev->rx_thread_started = false;
+    dev->tx_thread_started = false;
+}
+
+int virtio_net_save(struct virtio_net_dev *dev, int fd)
+{
+    return virtio_pci_save(&dev->virtio_pci_dev, fd);
+}
+
+int virtio_net_restore(struct virtio_net_dev *dev, int fd)
+{
+    uint64_t n = 1;
+
+    if (virtio_pci_restore(&dev->virtio_pci_dev, fd) < 0)
+        return -1;
+    /* RX is driven by the TAP; only a TX kick can have been lost. */
+    if (dev->tx_thread_started && write(dev->tx_ioeventfd, &n, sizeof(n)) < 0)
+        return -1;
+    return 0;
+}
+
+void virtio_net_exit(struct virtio_net_dev *dev)
+{
+    if (!dev->enable)
+        return;
+    virtio_net_stop(dev);
     virtio_pci_exit(&dev->virtio_pci_dev);
     close(dev->irqfd);
     close(dev->rx_ioeventfd);
     close(dev->tx_ioeventfd);
     close(dev->stopfd);
     close(dev->tapfd);
+    virtio_net_free_scratch(dev);
 }
@@ -1,17 +1,34 @@
 #pragma once
 
 #include <linux/virtio_net.h>
+#include <sys/uio.h>
+
 #include "pci.h"
 #include "virtio-pci.h"
 #include "virtq.h"
 
 #define VIRTIO_NET_VIRTQ_NUM 2
+#define VIRTQ_RX 0
+#define VIRTQ_TX 1
 #define VIRTIO_NET_PCI_CLASS 0x020000
 
+/* Snapshot of one descriptor in a chain, copied once so guest-side races can
+ * not tear our subsequent decisions.
+ */
+struct net_desc_snap {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t id;
+};
+
 struct virtio_net_dev {
     struct virtio_pci_dev virtio_pci_dev;
     struct virtio_net_config config;
     struct virtq vq[VIRTIO_NET_VIRTQ_NUM];
+    /* Each queue's worker builds its chains here, sized to the queue. */
+    struct net_desc_snap *chain[VIRTIO_NET_VIRTQ_NUM];
+    struct iovec *iov[VIRTIO_NET_VIRTQ_NUM];
     int tapfd;
     int irqfd;
     int rx_ioeventfd;
@@ -23,12 +40,18 @@ struct virtio_net_dev {
     bool rx_thread_started;
     bool tx_thread_started;
     bool tx_wait_for_tap;
+    struct virtq_poll tx_poll; /* owned by the TX worker */
     bool enable;
 };
 
 bool virtio_net_init(struct virtio_net_dev *virtio_net_dev);
 void virtio_net_exit(struct virtio_net_dev *virtio_net_dev);
+/* Join the workers; the device keeps its state for virtio_net_save. */
+void virtio_net_stop(struct virtio_net_dev *dev);
+int virtio_net_save(struct virtio_net_dev *dev, int fd);
+int virtio_net_restore(struct virtio_net_dev *dev, int fd);
 int virtio_net_init_pci(struct virtio_net_dev *virtio_net_dev,
+                        uint16_t queue_size,
                         struct pci *pci,
                         struct bus *io_bus,
                         struct bus *mmio_bus);
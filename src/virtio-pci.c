@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/virtio_config.h>
 #include <stddef.h>
@@ -5,6 +6,7 @@
 #include <unistd.h>
 
 #include "pci.h"
+#include "snapshot.h"
 #include "utils.h"
 #include "virtio-pci.h"
 
@@ -72,12 +74,14 @@ static void virtio_pci_reset(struct virtio_pci_dev *dev)
         struct virtq *vq = &dev->vq[i];
         if (vq->info.enable)
             continue;
-        vq->info.size = VIRTQ_SIZE;
+        vq->info.size = vq->max_size;
         vq->info.desc_addr = 0;
         vq->info.device_addr = 0;
         vq->info.driver_addr = 0;
         vq->next_avail_idx = 0;
         vq->used_wrap_count = 1;
+        vq->next_used_idx = 0;
+        vq->used_wrap = 1;
     }
 }
 
@@ -103,10 +107,23 @@ static void virtio_pci_select_virtq(struct virtio_pci_dev *dev)
     }
 }
 
+/* Features of the ring itself are the transport's to apply; the worker
+ * owns them once the queue is running.
+ */
+static void virtio_pci_start_virtq(struct virtio_pci_dev *dev, struct virtq *vq)
+{
+    if (!vq->info.enable) {
+        vq->event_idx = dev->guest_feature & (1ULL << VIRTIO_RING_F_EVENT_IDX);
+        vq->signalled_used_valid = false;
+    }
+    virtq_enable(vq);
+}
+
 static void virtio_pci_enable_virtq(struct virtio_pci_dev *dev)
 {
     uint16_t select = dev->config.common_cfg.queue_select;
-    virtq_enable(&dev->vq[select]);
+    if (select < dev->num_queues)
+        virtio_pci_start_virtq(dev, &dev->vq[select]);
 }
 
 static void virtio_pci_disable_virtq(struct virtio_pci_dev *dev)
@@ -151,17 +168,22 @@ static void virtio_pci_space_write(struct virtio_pci_dev *dev,
                                      info_offset),
                            data, size);
                     /* Clamp guest-supplied queue_size to what we advertised
-                     * (VIRTQ_SIZE). Without this, a guest writing a larger
-                     * avalue would let chain walks blow past the
-                     * VIRTQ_SIZE-sized stack arrays in the device emulators.
+                     * (max_size). Without this, a guest writing a larger
+                     * value would let chain walks blow past the
+                     * max_size-sized scratch buffers in the device
+                     * emulators; a size of 0 would never wrap the ring.
                      */
-                    if (dev->vq[select].info.size > VIRTQ_SIZE)
-                        dev->vq[select].info.size = VIRTQ_SIZE;
+                    struct virtq *vq = &dev->vq[select];
+                    if (!vq->info.size || vq->info.size > vq->max_size)
+                        vq->info.size = vq->max_size;
                 }
             }
-            /* guest notify buffer avail */
+            /* guest notify buffer avail, for a queue whose ioeventfd is not
+             * registered (yet)
+             */
             else if (offset ==
-                     offsetof(struct virtio_pci_config, notify_data)) {
+                         offsetof(struct virtio_pci_config, notify_data) &&
+                     dev->config.notify_data.vqn < dev->num_queues) {
                 virtq_handle_avail(&dev->vq[dev->config.notify_data.vqn]);
             }
             break;
@@ -331,6 +353,75 @@ void virtio_pci_enable(struct virtio_pci_dev *dev)
     pci_dev_register(&dev->pci_dev);
 }
 
+/* Per-queue record: the guest-programmed queue registers plus the device's
+ * position in the packed ring.
+ */
+struct virtio_pci_vq_state {
+    struct virtq_info info;
+    uint16_t next_avail_idx;
+    uint8_t used_wrap_count;
+} __attribute__((packed));
+
+int virtio_pci_save(struct virtio_pci_dev *dev, int fd)
+{
+    if (pci_dev_save(&dev->pci_dev, fd) < 0 ||
+        snapshot_write(fd, &dev->config,
+                       offsetof(struct virtio_pci_config, dev_cfg)) < 0 ||
+        snapshot_write(fd, &dev->guest_feature, sizeof(dev->guest_feature)) <
+            0)
+        return -1;
+
+    for (uint16_t i = 0; i < dev->num_queues; i++) {
+        struct virtq *vq = &dev->vq[i];
+        struct virtio_pci_vq_state state = {
+            .info = vq->info,
+            .next_avail_idx = vq->next_avail_idx,
+            .used_wrap_count = vq->used_wrap_count,
+        };
+        if (snapshot_write(fd, &state, sizeof(state)) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int virtio_pci_restore(struct virtio_pci_dev *dev, int fd)
+{
+    if (pci_dev_restore(&dev->pci_dev, fd) < 0 ||
+        snapshot_read(fd, &dev->config,
+                      offsetof(struct virtio_pci_config, dev_cfg)) < 0 ||
+        snapshot_read(fd, &dev->guest_feature, sizeof(dev->guest_feature)) < 0)
+        return -1;
+    /* Host-owned fields are never taken from the file. */
+    dev->config.common_cfg.num_queues = dev->num_queues;
+
+    for (uint16_t i = 0; i < dev->num_queues; i++) {
+        struct virtq *vq = &dev->vq[i];
+        struct virtio_pci_vq_state state;
+        if (snapshot_read(fd, &state, sizeof(state)) < 0)
+            return -1;
+        if (!state.info.size || state.info.size > vq->max_size ||
+            state.next_avail_idx >= state.info.size) {
+            errno = EINVAL;
+            return -1;
+        }
+        vq->info = state.info;
+        vq->next_avail_idx = state.next_avail_idx;
+        vq->used_wrap_count = state.used_wrap_count;
+        /* Devices are stopped with nothing in flight before a save. */
+        vq->next_used_idx = vq->next_avail_idx;
+        vq->used_wrap = vq->used_wrap_count;
+        /* Enabling maps the rings, hooks the notify ioeventfd at the
+         * restored BAR and starts the worker, as the guest's own enable
+         * did before the snapshot.
+         */
+        if (vq->info.enable) {
+            vq->info.enable = 0;
+            virtio_pci_start_virtq(dev, vq);
+        }
+    }
+    return 0;
+}
+
 void virtio_pci_exit(struct virtio_pci_dev *dev)
 {
     (void) dev;
@@ -62,4 +62,6 @@ void virtio_pci_init(struct virtio_pci_dev *dev,
                      struct pci *pci,
                      struct bus *io_bus,
                      struct bus *mmio_bus);
+int virtio_pci_save(struct virtio_pci_dev *dev, int fd);
+int virtio_pci_restore(struct virtio_pci_dev *dev, int fd);
 void virtio_pci_exit(struct virtio_pci_dev *dev);
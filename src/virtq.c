@@ -1,9 +1,18 @@
 #include <linux/kvm.h>
+#include <sched.h>
+#include <string.h>
 #include <sys/ioctl.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "stats.h"
 #include "virtq.h"
 
+/* First spin budget once polling pays off. */
+#define VIRTQ_POLL_MIN_NS 4000
+/* How long a spin goes before it lets other threads on its CPU run. */
+#define VIRTQ_POLL_YIELD_NS 2000
+
 void virtq_complete_request(struct virtq *vq)
 {
     vq->ops->complete_request(vq);
@@ -21,12 +30,20 @@ void virtq_enable(struct virtq *vq)
 
 void virtq_disable(struct virtq *vq) {}
 
-void virtq_init(struct virtq *vq, void *dev, struct virtq_ops *ops)
+void virtq_init(struct virtq *vq,
+                void *dev,
+                struct virtq_ops *ops,
+                uint16_t size)
 {
-    vq->info.size = VIRTQ_SIZE;
+    vq->info.size = size;
+    vq->max_size = size;
     vq->info.enable = 0;
     vq->next_avail_idx = 0;
     vq->used_wrap_count = 1;
+    vq->next_used_idx = 0;
+    vq->used_wrap = 1;
+    vq->event_idx = false;
+    vq->signalled_used_valid = false;
     vq->ops = ops;
     vq->dev = dev;
 }
@@ -36,7 +53,7 @@ bool virtq_check_next(struct vring_packed_desc *desc)
     return desc->flags & VRING_DESC_F_NEXT;
 }
 
-struct vring_packed_desc *virtq_get_avail(struct virtq *vq)
+bool virtq_has_avail(struct virtq *vq)
 {
     struct vring_packed_desc *desc = &vq->desc_ring[vq->next_avail_idx];
     /* Acquire pairs with the driver's release when it published the descriptor.
@@ -47,7 +64,14 @@ struct vring_packed_desc *virtq_get_avail(struct virtq *vq)
     bool avail = flags & (1ULL << VRING_PACKED_DESC_F_AVAIL);
     bool used = flags & (1ULL << VRING_PACKED_DESC_F_USED);
 
-    if (avail != vq->used_wrap_count || used == vq->used_wrap_count)
+    return avail == vq->used_wrap_count && used != vq->used_wrap_count;
+}
+
+struct vring_packed_desc *virtq_get_avail(struct virtq *vq)
+{
+    struct vring_packed_desc *desc = &vq->desc_ring[vq->next_avail_idx];
+
+    if (!virtq_has_avail(vq))
         return NULL;
     vq->next_avail_idx++;
     if (vq->next_avail_idx >= vq->info.size) {
@@ -57,26 +81,192 @@ struct vring_packed_desc *virtq_get_avail(struct virtq *vq)
     return desc;
 }
 
-void virtq_publish_used(struct vring_packed_desc *head,
-                        uint16_t id,
-                        uint32_t len)
+/* Write a used element at the device's used position rather than over the
+ * chain's own head, so that buffers can be returned in any order. The driver
+ * steps past as many ring slots as the buffer took (@ndescs), and so does
+ * the device.
+ */
+void virtq_push_used(struct virtq *vq,
+                     uint16_t id,
+                     uint32_t len,
+                     uint16_t ndescs)
 {
-    /* Buffer ID belongs in the head/used slot in packed virtqueues; the
-     * driver uses it to match the completion to its in-flight request. The
-     * len update must be visible before the USED flag flip, so write id and
-     * len with relaxed stores and then use a release-store on flags. */
-    head->id = id;
-    head->len = len;
-    uint16_t flags = head->flags ^ (uint16_t) (1U << VRING_PACKED_DESC_F_USED);
-    __atomic_store_n(&head->flags, flags, __ATOMIC_RELEASE);
+    struct vring_packed_desc *desc = &vq->desc_ring[vq->next_used_idx];
+    uint16_t flags = vq->used_wrap ? (1U << VRING_PACKED_DESC_F_AVAIL) |
+                                         (1U << VRING_PACKED_DESC_F_USED)
+                                   : 0;
+    desc->id = id;
+    desc->len = len;
+    __atomic_store_n(&desc->flags, flags, __ATOMIC_RELEASE);
+
+    vq->next_used_idx += ndescs;
+    if (vq->next_used_idx >= vq->info.size) {
+        vq->next_used_idx -= vq->info.size;
+        vq->used_wrap ^= 1;
+    }
 }
 
-void virtq_set_guest_event_flags(struct virtq *vq, uint16_t value)
+/* A ring position and wrap counter as one index that runs over two laps of
+ * the ring, so that positions on either side of a wrap can be compared.
+ */
+static unsigned virtq_lap_idx(struct virtq *vq, uint16_t idx, bool wrap)
 {
-    /* The consumer side reads guest_event->flags with __ATOMIC_ACQUIRE in
-     * virtq_handle_avail; pair with a release-store so completion writes
-     * land before the suppression-flag transition is visible. */
-    __atomic_store_n(&vq->guest_event->flags, value, __ATOMIC_RELEASE);
+    return idx + (wrap ? vq->info.size : 0);
+}
+
+/* Interrupt the driver about new used buffers unless it suppressed that,
+ * either outright or, with EVENT_IDX, until the used element at the
+ * position it names has been written.
+ */
+void virtq_signal_used(struct virtq *vq)
+{
+    unsigned laps = 2U * vq->info.size;
+    unsigned new = virtq_lap_idx(vq, vq->next_used_idx, vq->used_wrap);
+    unsigned old = vq->signalled_used;
+    bool valid = vq->signalled_used_valid;
+
+    vq->signalled_used = new;
+    vq->signalled_used_valid = true;
+    /* The used elements must be visible before the driver's suppression
+     * fields are read, or an interrupt it asks for right then is missed;
+     * release/acquire does not order a store before a load.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    /* off_wrap and flags in one load, so they cannot tear. */
+    uint32_t evt = __atomic_load_n((uint32_t *) vq->guest_event,
+                                   __ATOMIC_ACQUIRE);
+    uint16_t off_wrap = evt & 0xffff, flags = evt >> 16;
+
+    if (flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+        return;
+    if (flags == VRING_PACKED_EVENT_FLAG_DESC && vq->event_idx && valid) {
+        unsigned off = off_wrap & ~(1U << VRING_PACKED_EVENT_F_WRAP_CTR);
+        bool wrap = off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR;
+        unsigned evt_idx = virtq_lap_idx(vq, off, wrap);
+        /* Only if that element is among the ones written since the last
+         * interrupt, [old, new).
+         */
+        if ((new + laps - evt_idx) % laps - 1 >= (new + laps - old) % laps)
+            return;
+    }
+    virtq_notify_used(vq);
+}
+
+void virtq_disable_notify(struct virtq *vq)
+{
+    /* Read first: the store would dirty a cache line the driver reads. */
+    if (vq->device_event->flags != VRING_PACKED_EVENT_FLAG_DISABLE)
+        __atomic_store_n(&vq->device_event->flags,
+                         VRING_PACKED_EVENT_FLAG_DISABLE, __ATOMIC_RELAXED);
+}
+
+bool virtq_enable_notify(struct virtq *vq)
+{
+    uint16_t flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+
+    /* With EVENT_IDX, a kick only for the descriptor the device looks at
+     * next, not for every batch the driver adds behind it.
+     */
+    if (vq->event_idx) {
+        uint16_t off_wrap =
+            vq->next_avail_idx |
+            (uint16_t) vq->used_wrap_count << VRING_PACKED_EVENT_F_WRAP_CTR;
+        __atomic_store_n(&vq->device_event->off_wrap, off_wrap,
+                         __ATOMIC_RELAXED);
+        flags = VRING_PACKED_EVENT_FLAG_DESC;
+    }
+    __atomic_store_n(&vq->device_event->flags, flags, __ATOMIC_RELEASE);
+    /* Pairs with the driver's fence between making a descriptor available
+     * and reading these flags: either it sees them and kicks, or the
+     * descriptor is seen here.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return virtq_has_avail(vq);
+}
+
+static uint64_t virtq_poll_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void virtq_cpu_relax(void)
+{
+#if defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+void virtq_poll_init(struct virtq_poll *p, uint32_t max_ns)
+{
+    memset(p, 0, sizeof(*p));
+    p->max_ns = max_ns;
+    /* Start at the shortest spin rather than at none, so that the first
+     * requests after a kick are already caught.
+     */
+    p->ns = max_ns < VIRTQ_POLL_MIN_NS ? max_ns : VIRTQ_POLL_MIN_NS;
+}
+
+bool virtq_poll(struct virtq *vq,
+                struct virtq_poll *p,
+                bool (*ready)(void *opaque),
+                void *opaque)
+{
+    if (!p->max_ns)
+        return false;
+    uint64_t start = virtq_poll_clock();
+    p->start = start;
+    p->waiting = true;
+    if (!p->ns)
+        return false;
+
+    /* The driver need not kick a worker that is looking anyway. */
+    virtq_disable_notify(vq);
+    stats_add(&p->polls, 1);
+    uint64_t now = start, yielded = start;
+    do {
+        if (virtq_has_avail(vq) || (ready && ready(opaque))) {
+            stats_add(&p->hits, 1);
+            p->waiting = false;
+            return true;
+        }
+        /* Where the vCPU shares this CPU, it cannot add requests while the
+         * worker spins; a dedicated CPU gets straight back.
+         */
+        if (now - yielded >= VIRTQ_POLL_YIELD_NS) {
+            sched_yield();
+            yielded = now;
+        } else {
+            virtq_cpu_relax();
+        }
+        now = virtq_poll_clock();
+    } while (now - start < p->ns);
+    return false;
+}
+
+void virtq_poll_slept(struct virtq_poll *p)
+{
+    if (!p->waiting)
+        return;
+    p->waiting = false;
+
+    uint64_t waited = virtq_poll_clock() - p->start;
+    uint32_t ns = p->ns;
+    if (waited > p->max_ns) {
+        /* Idle: spinning longer would not have helped. */
+        ns /= 2;
+        if (ns < VIRTQ_POLL_MIN_NS)
+            ns = 0;
+    } else if (waited > ns) {
+        /* The work came soon after the spin gave up. */
+        ns = ns ? ns * 2 : VIRTQ_POLL_MIN_NS;
+        if (ns > p->max_ns)
+            ns = p->max_ns;
+    }
+    __atomic_store_n(&p->ns, ns, __ATOMIC_RELAXED);
 }
 
 void virtq_handle_avail(struct virtq *vq)
@@ -84,11 +274,5 @@ void virtq_handle_avail(struct virtq *vq)
     if (!vq->info.enable)
         return;
     virtq_complete_request(vq);
-    /* Driver-side suppression flag is shared memory; acquire so we don't
-     * re-order the read past the completion writes above.
-     */
-    uint16_t evt_flags =
-        __atomic_load_n(&vq->guest_event->flags, __ATOMIC_ACQUIRE);
-    if (evt_flags == VRING_PACKED_EVENT_FLAG_ENABLE)
-        virtq_notify_used(vq);
+    virtq_signal_used(vq);
 }
@@ -4,9 +4,11 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-/* Maximum descriptors per packed virtqueue. Also bounds chain length so a
- * malformed chain cannot loop the device. */
+/* Descriptors per packed virtqueue unless the device asks for more, and
+ * the most the packed ring layout allows. A queue's size also bounds chain
+ * length so a malformed chain cannot loop the device. */
 #define VIRTQ_SIZE 128
+#define VIRTQ_MAX_SIZE 32768
 
 struct virtq;
 
@@ -32,22 +34,78 @@ struct virtq {
     struct vring_packed_desc_event *device_event;
     struct vring_packed_desc_event *guest_event;
     struct virtq_info info;
+    /* Size offered to the driver, which may pick a smaller one; device
+     * scratch buffers are sized to it.
+     */
+    uint16_t max_size;
     void *dev;
     uint16_t next_avail_idx;
     bool used_wrap_count;
+    /* Where the next used element goes, for devices that complete out of
+     * order through virtq_push_used. Equal to next_avail_idx and
+     * used_wrap_count whenever nothing is in flight.
+     */
+    uint16_t next_used_idx;
+    bool used_wrap;
+    /* VIRTIO_RING_F_EVENT_IDX was negotiated: both sides may ask to be
+     * notified at a given descriptor rather than just on or off.
+     */
+    bool event_idx;
+    /* Used position at the last interrupt, if there has been one. */
+    uint16_t signalled_used;
+    bool signalled_used_valid;
     struct virtq_ops *ops;
 };
 
+/* Adaptive busy polling of a ring by its worker (--io-poll). Before it
+ * sleeps, the worker spins for new descriptors for up to ns, with kicks
+ * suppressed. The budget doubles while the worker keeps waking up soon
+ * after it gave up spinning, up to max_ns, and halves when it sleeps for
+ * longer than that.
+ */
+struct virtq_poll {
+    uint32_t max_ns; /* 0: never spin */
+    uint32_t ns;
+    uint64_t start; /* of the spin that ran out, if waiting */
+    bool waiting;
+    /* Owned by the worker; read by the stats dump. */
+    uint64_t polls;
+    uint64_t hits; /* polls that found work before the budget ran out */
+};
+
 struct vring_packed_desc *virtq_get_avail(struct virtq *vq);
+/* Whether the driver has made the next descriptor available. */
+bool virtq_has_avail(struct virtq *vq);
 bool virtq_check_next(struct vring_packed_desc *desc);
-void virtq_publish_used(struct vring_packed_desc *head,
-                        uint16_t id,
-                        uint32_t len);
-void virtq_set_guest_event_flags(struct virtq *vq, uint16_t value);
+void virtq_push_used(struct virtq *vq,
+                     uint16_t id,
+                     uint32_t len,
+                     uint16_t ndescs);
+void virtq_signal_used(struct virtq *vq);
+/* Kick suppression: the driver need not notify the device while its worker
+ * is busy. virtq_enable_notify asks for a kick again before the worker
+ * sleeps and returns true if a descriptor came in meanwhile, in which case
+ * the worker must not sleep.
+ */
+void virtq_disable_notify(struct virtq *vq);
+bool virtq_enable_notify(struct virtq *vq);
+void virtq_poll_init(struct virtq_poll *p, uint32_t max_ns);
+/* Spin on the ring, and on @ready if not NULL, for the current budget.
+ * Returns true if there is work; otherwise the worker goes on to
+ * virtq_enable_notify and sleep, and calls virtq_poll_slept on waking.
+ */
+bool virtq_poll(struct virtq *vq,
+                struct virtq_poll *p,
+                bool (*ready)(void *opaque),
+                void *opaque);
+void virtq_poll_slept(struct virtq_poll *p);
 void virtq_enable(struct virtq *vq);
 void virtq_disable(struct virtq *vq);
 void virtq_complete_request(struct virtq *vq);
 void virtq_notify_used(struct virtq *vq);
 void virtq_deassert_irq(struct virtq *vq);
 void virtq_handle_avail(struct virtq *vq);
-void virtq_init(struct virtq *vq, void *dev, struct virtq_ops *ops);
+void virtq_init(struct virtq *vq,
+                void *dev,
+                struct virtq_ops *ops,
+                uint16_t size);
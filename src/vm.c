@@ -1,6 +1,7 @@
 #include <fcntl.h>
 #include <linux/kvm.h>
 #include <linux/kvm_para.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,47 +11,282 @@
 #include <unistd.h>
 
 #include "bus.h"
+#include "diskmmap.h"
 #include "err.h"
 #include "vm.h"
 
-int vm_init(vm_t *v)
+/* Signal used to knock a vCPU thread out of KVM_RUN when the VM stops. The
+ * handler is empty; all the work is done by the EINTR and immediate_exit.
+ */
+#define VCPU_KICK_SIGNAL SIGUSR1
+
+static void vcpu_kick_handler(int sig)
+{
+    (void) sig;
+}
+
+static int vm_max_vcpus(vm_t *v)
+{
+    int max = ioctl(v->kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_MAX_VCPUS);
+    if (max <= 0)
+        max = ioctl(v->kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_NR_VCPUS);
+    /* KVM API: if neither capability is reported, assume 4 vCPUs. */
+    if (max <= 0)
+        max = 4;
+    return max < VM_MAX_VCPUS ? max : VM_MAX_VCPUS;
+}
+
+static int vm_vcpu_init(vm_t *v, vcpu_t *vcpu, int id)
+{
+    vcpu->id = id;
+    vcpu->vm = v;
+    vcpu->stats = v->stats ? &v->stats->vcpus[id] : NULL;
+    if ((vcpu->fd = ioctl(v->vm_fd, KVM_CREATE_VCPU, id)) < 0)
+        return throw_err("Failed to create vcpu %d", id);
+
+    vcpu->run = mmap(0, v->run_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     vcpu->fd, 0);
+    if (vcpu->run == MAP_FAILED)
+        return throw_err("Failed to mmap kvm_run of vcpu %d", id);
+
+    return vm_arch_cpu_init(v, vcpu);
+}
+
+/* Split the single host mapping at v->mem.base into guest memslots.
+ * Architectures that keep 32-bit PCI MMIO inside the RAM window define
+ * MMIO_HOLE_BASE and MMIO_HOLE_END; RAM that would overlap the hole is moved
+ * above it.
+ */
+static void vm_mem_layout(vm_t *v)
+{
+    uint64_t size = v->cfg.ram_size;
+    int n = 0;
+
+#ifdef MMIO_HOLE_BASE
+    uint64_t low = MMIO_HOLE_BASE - RAM_BASE;
+    if (size > low) {
+        v->mem_regions[n++] = (struct vm_mem_region) {
+            .gpa = RAM_BASE,
+            .size = low,
+            .hva = v->mem.base,
+        };
+        v->mem_regions[n++] = (struct vm_mem_region) {
+            .gpa = MMIO_HOLE_END,
+            .size = size - low,
+            .hva = (uint8_t *) v->mem.base + low,
+        };
+        v->nr_mem_regions = n;
+        return;
+    }
+#endif
+    v->mem_regions[n++] = (struct vm_mem_region) {
+        .gpa = RAM_BASE,
+        .size = size,
+        .hva = v->mem.base,
+    };
+    v->nr_mem_regions = n;
+}
+
+/* Any byte written to the pause port marks the point the guest wants to be
+ * captured at, e.g. after init has finished booting. Without a consumer for
+ * the pause (--snapshot-out) the write is ignored.
+ */
+static void vm_pause_io(void *owner,
+                        void *data,
+                        uint8_t is_write,
+                        uint64_t offset,
+                        uint8_t size)
+{
+    vm_t *v = (vm_t *) owner;
+
+    if (!is_write || !v->cfg.guest_pause)
+        return;
+    if (!__atomic_load_n(&v->stopping, __ATOMIC_ACQUIRE)) {
+        v->paused = true;
+        vm_stop(v, 0);
+    }
+}
+
+/* Redo what guest RAM was set up with on a range of it that was mapped
+ * anew, which dropped the advice and memory policy of the old mapping.
+ */
+static int vm_mem_remapped(vm_t *v, void *addr, size_t len)
+{
+    if (v->mem.backend == MEM_BACKEND_THP &&
+        madvise(addr, len, MADV_HUGEPAGE) < 0)
+        return throw_err("Failed to enable transparent huge pages");
+    if (!numa_mask_empty(&v->cfg.mem_nodes) &&
+        numa_bind_memory(addr, len, &v->cfg.mem_nodes, v->cfg.mem_policy) < 0)
+        return throw_err("Failed to bind guest memory to host NUMA nodes");
+    return 0;
+}
+
+static int vm_mem_init(vm_t *v)
+{
+    if (v->cfg.template_mem) {
+        /* A clone runs on the template's RAM, inherited copy-on-write across
+         * fork(). Shared backends are remapped privately so that the clone's
+         * writes stay its own.
+         */
+        v->mem = *v->cfg.template_mem;
+        if (v->mem.fd >= 0 &&
+            mmap(v->mem.base, v->mem.size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_FIXED, v->mem.fd, 0) == MAP_FAILED)
+            return throw_err("Failed to map template memory privately");
+        return 0;
+    }
+
+    if (guest_mem_alloc(&v->mem, v->cfg.ram_size, v->cfg.mem_backend,
+                        v->cfg.hugepage_size, v->cfg.mem_path) < 0)
+        return -1;
+    /* Set the policy before anything touches guest RAM, so that a snapshot
+     * restore, prefault and first-touch faults already allocate on the
+     * requested nodes.
+     */
+    if (!numa_mask_empty(&v->cfg.mem_nodes) &&
+        numa_bind_memory(v->mem.base, v->mem.size, &v->cfg.mem_nodes,
+                         v->cfg.mem_policy) < 0)
+        return throw_err("Failed to bind guest memory to host NUMA nodes");
+    if (v->cfg.snapshot_in) {
+        if (vm_snapshot_map_ram(v) < 0)
+            return -1;
+        /* Anonymous RAM restored without userfaultfd is now a mapping of the
+         * snapshot file; the copies the guest's writes make still go to the
+         * requested nodes.
+         */
+        if (!v->cfg.snapshot_uffd && v->mem.fd < 0 &&
+            vm_mem_remapped(v, v->mem.base, v->mem.size) < 0)
+            return -1;
+    }
+    if (v->cfg.prefault_threads > 0 &&
+        guest_mem_prefault(&v->mem, v->cfg.prefault_threads) < 0)
+        return -1;
+    if (v->cfg.mem_backend != MEM_BACKEND_ANON || v->cfg.prefault_threads > 0)
+        guest_mem_report(&v->mem);
+    return 0;
+}
+
+int vm_init(vm_t *v, const vm_config_t *cfg)
 {
+    v->cfg = *cfg;
+    v->stopping = false;
+    v->paused = false;
+    v->exit_code = 0;
+    v->uffd.ram = NULL;
+    v->stats = NULL;
+    /* A failed --snapshot-uffd page may call vm_stop before any vCPU is set
+     * up; it skips those without a kvm_run yet.
+     */
+    memset(v->vcpus, 0, sizeof(v->vcpus));
+    pthread_mutex_init(&v->io_lock, NULL);
+    bus_init(&v->io_bus);
+    bus_init(&v->mmio_bus);
+    if (numa_get_thread_cpus(&v->host_cpus) < 0)
+        return throw_err("Failed to get the host CPU affinity");
+
     if ((v->kvm_fd = open("/dev/kvm", O_RDWR)) < 0)
         return throw_err("Failed to open /dev/kvm");
 
+    int max_vcpus = vm_max_vcpus(v);
+    if (v->cfg.nr_vcpus < 1 || v->cfg.nr_vcpus > max_vcpus) {
+        errno = EINVAL;
+        return throw_err("Invalid number of vCPUs %d (1..%d supported)",
+                         v->cfg.nr_vcpus, max_vcpus);
+    }
+    /* Before any helper thread is started; see vm_stats_init. */
+    if (v->cfg.stats && vm_stats_init(v) < 0)
+        return -1;
+
     if ((v->vm_fd = ioctl(v->kvm_fd, KVM_CREATE_VM, 0)) < 0)
         return throw_err("Failed to create vm");
 
     if (vm_arch_init(v) < 0)
         return -1;
 
-    v->mem = mmap(NULL, RAM_SIZE, PROT_READ | PROT_WRITE,
-                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (v->mem == MAP_FAILED)
-        return throw_err("Failed to mmap vm memory");
-
-    struct kvm_userspace_memory_region region = {
-        .slot = 0,
-        .flags = 0,
-        .guest_phys_addr = RAM_BASE,
-        .memory_size = RAM_SIZE,
-        .userspace_addr = (__u64) v->mem,
-    };
-    if (ioctl(v->vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0)
-        return throw_err("Failed to set user memory region");
-
-    if ((v->vcpu_fd = ioctl(v->vm_fd, KVM_CREATE_VCPU, 0)) < 0)
-        return throw_err("Failed to create vcpu");
+    if (v->cfg.ram_size < RAM_SIZE_MIN || v->cfg.ram_size % getpagesize()) {
+        errno = EINVAL;
+        return throw_err("Invalid guest memory size %llu",
+                         (unsigned long long) v->cfg.ram_size);
+    }
 
-    if (vm_arch_cpu_init(v) < 0)
+    if (vm_mem_init(v) < 0)
         return -1;
 
-    bus_init(&v->io_bus);
-    bus_init(&v->mmio_bus);
+    vm_mem_layout(v);
+    for (int i = 0; i < v->nr_mem_regions; i++) {
+        struct vm_mem_region *r = &v->mem_regions[i];
+        struct kvm_userspace_memory_region region = {
+            .slot = i,
+            .flags = 0,
+            .guest_phys_addr = r->gpa,
+            .memory_size = r->size,
+            .userspace_addr = (__u64) r->hva,
+        };
+        if (ioctl(v->vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0)
+            return throw_err("Failed to set user memory region %d", i);
+    }
+
+    if ((v->run_size = ioctl(v->kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0)) < 0)
+        return throw_err("Failed to get VCPU mmap size");
+
+    for (int i = 0; i < v->cfg.nr_vcpus; i++) {
+        if (vm_vcpu_init(v, &v->vcpus[i], i) < 0)
+            return -1;
+    }
+
+    /* The ring is shared by the whole VM and mapped through every vCPU;
+     * the boot vCPU's mapping serves for all of them.
+     */
+    v->coalesced_ring = NULL;
+    int ring_page =
+        ioctl(v->kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_MMIO);
+    if (ring_page > 0) {
+        v->coalesced_ring =
+            (void *) ((uint8_t *) v->vcpus[0].run + ring_page * getpagesize());
+        v->coalesced_max = (getpagesize() - sizeof(*v->coalesced_ring)) /
+                           sizeof(v->coalesced_ring->coalesced_mmio[0]);
+    }
 
     if (vm_arch_init_platform_device(v) < 0)
         return -1;
 
+    dev_init(&v->pause_dev, PAUSE_PORT, 1, v, vm_pause_io);
+    bus_register_dev(&v->io_bus, &v->pause_dev);
+
+    return 0;
+}
+
+/* Put @len bytes from @offset of the image file @fd, mapped at @data, into
+ * guest RAM at @dest. With --map-images, anonymous guest RAM and both ends
+ * page aligned, the whole pages are mapped privately from the file over
+ * guest RAM instead of copied: they come from the host page cache, are
+ * shared by every VM booting the same file and fault in only when the guest
+ * touches them. A guest write copies the page as usual. Pages the guest
+ * never writes stay those of the file, so it must not be changed or
+ * truncated while the VM runs. The rest is copied.
+ */
+int vm_load_range(vm_t *v,
+                  void *dest,
+                  int fd,
+                  const void *data,
+                  size_t offset,
+                  size_t len)
+{
+    size_t page = getpagesize();
+    size_t mapped = 0;
+
+    /* hugetlb and file RAM cannot be split into small mappings. */
+    if (v->cfg.map_images && v->mem.fd < 0 &&
+        !((uintptr_t) dest & (page - 1)) && !(offset & (page - 1)))
+        mapped = len & ~(page - 1);
+    if (mapped && mmap(dest, mapped, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED)
+        return throw_err("Failed to map image into guest memory");
+    if (mapped && vm_mem_remapped(v, dest, mapped) < 0)
+        return -1;
+
+    memcpy((uint8_t *) dest + mapped, (const uint8_t *) data + offset + mapped,
+           len - mapped);
     return 0;
 }
 
@@ -67,12 +303,14 @@ int vm_load_image(vm_t *v, const char *image_path)
     }
     size_t datasz = st.st_size;
     void *data = mmap(0, datasz, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-    close(fd);
-    if (data == MAP_FAILED)
+    if (data == MAP_FAILED) {
+        close(fd);
         return throw_err("Failed to mmap %s", image_path);
+    }
 
-    int ret = vm_arch_load_image(v, data, datasz);
+    int ret = vm_arch_load_image(v, fd, data, datasz);
     munmap(data, datasz);
+    close(fd);
     return ret;
 }
 
@@ -89,28 +327,51 @@ int vm_load_initrd(vm_t *v, const char *initrd_path)
     }
     size_t datasz = st.st_size;
     void *data = mmap(0, datasz, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-    close(fd);
-    if (data == MAP_FAILED)
+    if (data == MAP_FAILED) {
+        close(fd);
         return throw_err("Failed to mmap %s", initrd_path);
+    }
 
-    int ret = vm_arch_load_initrd(v, data, datasz);
+    int ret = vm_arch_load_initrd(v, fd, data, datasz);
     munmap(data, datasz);
+    close(fd);
     return ret;
 }
 
 int vm_load_diskimg(vm_t *v, const char *diskimg_file)
 {
-    if (diskimg_init(&v->diskimg, diskimg_file) < 0)
+    enum diskimg_cache cache = v->cfg.disk_cache;
+    /* A mapping goes through the page cache. */
+    if (v->cfg.disk_mmap && cache == DISKIMG_CACHE_DEFAULT)
+        cache = DISKIMG_CACHE_WRITEBACK;
+    if (diskimg_init(&v->diskimg, diskimg_file, v->cfg.disk_base,
+                     cache) < 0) {
+        if (cache == DISKIMG_CACHE_NONE && errno == EINVAL)
+            return throw_err("%s does not support O_DIRECT", diskimg_file);
+        if (v->cfg.disk_base && errno == EEXIST)
+            return throw_err("%s is not an overlay", diskimg_file);
         return -1;
-    return virtio_blk_init_pci(&v->virtio_blk_dev, &v->diskimg, &v->pci,
-                               &v->io_bus, &v->mmio_bus);
+    }
+    if (v->cfg.disk_mmap && diskmmap_open(&v->diskimg) < 0)
+        return throw_err("Failed to map %s; --disk-io mmap needs a raw image "
+                         "without --disk-cache none",
+                         diskimg_file);
+    int queues = v->cfg.blk_queues;
+    if (!queues)
+        queues = v->cfg.nr_vcpus < VIRTIO_BLK_MAX_QUEUES
+                     ? v->cfg.nr_vcpus
+                     : VIRTIO_BLK_MAX_QUEUES;
+    uint16_t size = v->cfg.blk_queue_size ? v->cfg.blk_queue_size : VIRTQ_SIZE;
+    return virtio_blk_init_pci(&v->virtio_blk_dev, &v->diskimg, queues, size,
+                               &v->pci, &v->io_bus, &v->mmio_bus);
 }
 
 int vm_enable_net(vm_t *v)
 {
     if (!virtio_net_init(&v->virtio_net_dev))
         return -1;
-    return virtio_net_init_pci(&v->virtio_net_dev, &v->pci, &v->io_bus,
+    uint16_t size = v->cfg.net_queue_size ? v->cfg.net_queue_size : VIRTQ_SIZE;
+    return virtio_net_init_pci(&v->virtio_net_dev, size, &v->pci, &v->io_bus,
                                &v->mmio_bus);
 }
 
@@ -120,33 +381,138 @@ void vm_handle_io(vm_t *v, struct kvm_run *run)
     void *data = (void *) ((uintptr_t) run + run->io.data_offset);
     bool is_write = run->io.direction == KVM_EXIT_IO_OUT;
 
+    pthread_mutex_lock(&v->io_lock);
     for (int i = 0; i < run->io.count; i++) {
-        bus_handle_io(&v->io_bus, data, is_write, addr, run->io.size);
+        struct dev *dev =
+            bus_handle_io(&v->io_bus, data, is_write, addr, run->io.size);
+        if (v->stats)
+            stats_add(dev ? &dev->accesses : &v->stats->unclaimed_pio, 1);
         addr += run->io.size;
     }
+    pthread_mutex_unlock(&v->io_lock);
+}
+
+/* Replay the writes KVM queued without exiting, oldest first. Runs before
+ * every exit is dispatched, so a device never sees a later access ahead of a
+ * coalesced one.
+ */
+static void vm_handle_coalesced(vm_t *v)
+{
+    struct kvm_coalesced_mmio_ring *ring = v->coalesced_ring;
+
+    if (!ring || __atomic_load_n(&ring->first, __ATOMIC_RELAXED) ==
+                     __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE))
+        return;
+
+    pthread_mutex_lock(&v->io_lock);
+    uint32_t first = ring->first;
+    while (first != __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE)) {
+        struct kvm_coalesced_mmio *m = &ring->coalesced_mmio[first];
+        struct bus *bus = m->pio ? &v->io_bus : &v->mmio_bus;
+        struct dev *dev = bus_handle_io(bus, m->data, 1, m->phys_addr, m->len);
+        if (v->stats) {
+            stats_add(&v->stats->coalesced, 1);
+            stats_add(dev ? &dev->accesses
+                      : m->pio ? &v->stats->unclaimed_pio
+                               : &v->stats->unclaimed_mmio,
+                      1);
+        }
+        first = (first + 1) % v->coalesced_max;
+        /* Hand the slot back to KVM. */
+        __atomic_store_n(&ring->first, first, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&v->io_lock);
 }
 
 void vm_handle_mmio(vm_t *v, struct kvm_run *run)
 {
-    bus_handle_io(&v->mmio_bus, run->mmio.data, run->mmio.is_write,
-                  run->mmio.phys_addr, run->mmio.len);
+    pthread_mutex_lock(&v->io_lock);
+    struct dev *dev = bus_handle_io(&v->mmio_bus, run->mmio.data,
+                                    run->mmio.is_write, run->mmio.phys_addr,
+                                    run->mmio.len);
+    if (v->stats)
+        stats_add(dev ? &dev->accesses : &v->stats->unclaimed_mmio, 1);
+    pthread_mutex_unlock(&v->io_lock);
 }
 
-int vm_run(vm_t *v)
+void vm_stop(vm_t *v, int exit_code)
 {
-    int run_size = ioctl(v->kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
-    if (run_size < 0)
-        return throw_err("Failed to get VCPU mmap size");
-    struct kvm_run *run =
-        mmap(0, run_size, PROT_READ | PROT_WRITE, MAP_SHARED, v->vcpu_fd, 0);
-    if (run == MAP_FAILED)
-        return throw_err("Failed to mmap kvm_run");
-
-    while (1) {
-        int err = ioctl(v->vcpu_fd, KVM_RUN, 0);
-        if (err < 0 && (errno != EINTR && errno != EAGAIN)) {
-            munmap(run, run_size);
-            return throw_err("Failed to execute kvm_run");
+    /* Only the first vCPU to stop gets to pick the exit code. */
+    if (__atomic_exchange_n(&v->stopping, true, __ATOMIC_ACQ_REL))
+        return;
+    v->exit_code = exit_code;
+
+    /* immediate_exit covers the window where a sibling has checked stopping
+     * but not yet entered KVM_RUN; the signal covers one already inside it.
+     */
+    for (int i = 0; i < v->cfg.nr_vcpus; i++) {
+        vcpu_t *vcpu = &v->vcpus[i];
+        if (!vcpu->run)
+            continue;
+        __atomic_store_n(&vcpu->run->immediate_exit, 1, __ATOMIC_RELEASE);
+        if (__atomic_load_n(&vcpu->thread_started, __ATOMIC_ACQUIRE) &&
+            !pthread_equal(vcpu->tid, pthread_self()))
+            pthread_kill(vcpu->tid, VCPU_KICK_SIGNAL);
+    }
+}
+
+/* With at least as many CPUs in the list as vCPUs, vCPU i gets the i-th CPU
+ * to itself; otherwise every vCPU floats over the whole list.
+ */
+static void vm_pin_vcpu(vm_t *v, vcpu_t *vcpu)
+{
+    const numa_mask_t *cpus = &v->cfg.vcpu_cpus;
+    if (numa_mask_empty(cpus))
+        return;
+
+    numa_mask_t one = {0};
+    if (numa_mask_weight(cpus) >= v->cfg.nr_vcpus) {
+        numa_mask_set(&one, numa_mask_nth(cpus, vcpu->id));
+        cpus = &one;
+    }
+    if (numa_pin_thread(vcpu->tid, cpus) < 0)
+        throw_err("Failed to set the CPU affinity of vcpu %d", vcpu->id);
+}
+
+void vm_pin_io_thread(vm_t *v, pthread_t tid)
+{
+    const numa_mask_t *cpus = &v->cfg.io_cpus;
+    if (numa_mask_empty(cpus)) {
+        /* Workers are spawned from vCPU exits; undo the inherited pin. */
+        if (numa_mask_empty(&v->cfg.vcpu_cpus))
+            return;
+        cpus = &v->host_cpus;
+    }
+    if (numa_pin_thread(tid, cpus) < 0)
+        throw_err("Failed to set the CPU affinity of an I/O worker");
+}
+
+static int vm_vcpu_run(vm_t *v, vcpu_t *vcpu)
+{
+    struct kvm_run *run = vcpu->run;
+    struct vcpu_stats *stats = vcpu->stats;
+    uint64_t start = 0, exited = 0;
+
+    while (!__atomic_load_n(&v->stopping, __ATOMIC_ACQUIRE)) {
+        if (stats)
+            start = stats_cycles();
+        int err = ioctl(vcpu->fd, KVM_RUN, 0);
+        if (err < 0 && (errno != EINTR && errno != EAGAIN))
+            return throw_err("Failed to execute kvm_run on vcpu %d",
+                             vcpu->id);
+        vm_handle_coalesced(v);
+        /* A kick or immediate_exit returns without writing exit_reason,
+         * which still holds the exit handled last time.
+         */
+        if (err < 0)
+            continue;
+        if (stats) {
+            exited = stats_cycles();
+            stats_hist_add(&stats->run, exited - start);
+            stats_add(&stats->exits[run->exit_reason < STATS_NR_EXITS
+                                        ? run->exit_reason
+                                        : STATS_NR_EXITS],
+                      1);
         }
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
@@ -159,7 +525,6 @@ int vm_run(vm_t *v)
             break;
         case KVM_EXIT_SHUTDOWN:
             printf("shutdown\n");
-            munmap(run, run_size);
             return 0;
         case KVM_EXIT_SYSTEM_EVENT: {
             /* arm64 PSCI SYSTEM_OFF / SYSTEM_RESET land here. SHUTDOWN and
@@ -172,31 +537,102 @@ int vm_run(vm_t *v)
              */
             uint32_t type = run->system_event.type;
             printf("system event %u\n", type);
-            munmap(run, run_size);
             return type == KVM_SYSTEM_EVENT_CRASH ? -1 : 0;
         }
         default:
             printf("reason: %d\n", run->exit_reason);
-            munmap(run, run_size);
             return -1;
         }
+        if (stats)
+            stats_hist_add(&stats->handle, stats_cycles() - exited);
     }
+    return 0;
+}
+
+static void *vm_vcpu_thread(void *arg)
+{
+    vcpu_t *vcpu = (vcpu_t *) arg;
+    vm_t *v = (vm_t *) vcpu->vm;
+
+    vm_stop(v, vm_vcpu_run(v, vcpu));
+    return NULL;
+}
+
+int vm_run(vm_t *v)
+{
+    struct sigaction sa = {.sa_handler = vcpu_kick_handler};
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(VCPU_KICK_SIGNAL, &sa, NULL) < 0)
+        return throw_err("Failed to install the vcpu kick handler");
+
+    /* The boot vCPU runs on the calling thread; every secondary vCPU gets a
+     * thread of its own and sits in KVM_RUN until the guest brings it up
+     * (INIT/SIPI on x86, PSCI CPU_ON on arm64), both handled in-kernel.
+     */
+    vcpu_t *boot = &v->vcpus[0];
+    boot->tid = pthread_self();
+    __atomic_store_n(&boot->thread_started, true, __ATOMIC_RELEASE);
+    for (int i = 1; i < v->cfg.nr_vcpus; i++) {
+        vcpu_t *vcpu = &v->vcpus[i];
+        if (pthread_create(&vcpu->tid, NULL, vm_vcpu_thread, vcpu) != 0) {
+            vm_stop(v, -1);
+            break;
+        }
+        __atomic_store_n(&vcpu->thread_started, true, __ATOMIC_RELEASE);
+        vm_pin_vcpu(v, vcpu);
+    }
+    /* Pinned last so the secondaries above are not created inside the boot
+     * vCPU's single-CPU mask.
+     */
+    vm_pin_vcpu(v, boot);
+    /* A stop that raced with the thread creation above may have skipped the
+     * kick of a vCPU whose thread_started was not yet visible; immediate_exit
+     * still makes its next KVM_RUN return at once.
+     */
+    if (!__atomic_load_n(&v->stopping, __ATOMIC_ACQUIRE))
+        vm_stop(v, vm_vcpu_run(v, boot));
+
+    for (int i = 1; i < v->cfg.nr_vcpus; i++) {
+        if (v->vcpus[i].thread_started)
+            pthread_join(v->vcpus[i].tid, NULL);
+    }
+    /* Writes queued after the last exit, e.g. the tail of the console. */
+    vm_handle_coalesced(v);
+    return v->exit_code;
+}
+
+/* Translation runs for every descriptor the virtio workers touch, so it is a
+ * bounded scan over at most VM_MAX_MEM_REGIONS entries with the low region,
+ * where most of a small guest lives, first. The unsigned subtraction folds
+ * the below-base check into the size comparison.
+ */
+static inline struct vm_mem_region *vm_find_region(vm_t *v, uint64_t guest)
+{
+    for (int i = 0; i < v->nr_mem_regions; i++) {
+        struct vm_mem_region *r = &v->mem_regions[i];
+        if (guest - r->gpa < r->size)
+            return r;
+    }
+    return NULL;
 }
 
 void *vm_guest_to_host(vm_t *v, uint64_t guest)
 {
-    if (guest < RAM_BASE || guest >= RAM_BASE + RAM_SIZE)
+    struct vm_mem_region *r = vm_find_region(v, guest);
+    if (!r)
         return NULL;
-    return (void *) ((uintptr_t) v->mem + guest - RAM_BASE);
+    return (void *) ((uintptr_t) r->hva + guest - r->gpa);
 }
 
 void *vm_guest_buf(vm_t *v, uint64_t guest, size_t len)
 {
-    uint64_t end;
-    if (guest < RAM_BASE || __builtin_add_overflow(guest, len, &end) ||
-        end > RAM_BASE + RAM_SIZE)
+    /* A buffer must sit inside one region; regions are never adjacent in
+     * guest-physical space, so a range crossing a boundary hits a hole.
+     */
+    struct vm_mem_region *r = vm_find_region(v, guest);
+    if (!r || len > r->size - (guest - r->gpa))
         return NULL;
-    return (void *) ((uintptr_t) v->mem + guest - RAM_BASE);
+    return (void *) ((uintptr_t) r->hva + guest - r->gpa);
 }
 
 void vm_irqfd_register(vm_t *v, int fd, int gsi, int flags)
@@ -211,13 +647,56 @@ void vm_irqfd_register(vm_t *v, int fd, int gsi, int flags)
         throw_err("Failed to set the status of IRQFD");
 }
 
+static int vm_coalesced_zone(vm_t *v,
+                             unsigned long request,
+                             uint64_t addr,
+                             uint32_t len,
+                             bool pio)
+{
+    if (!v->coalesced_ring ||
+        (pio && ioctl(v->kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_PIO) <=
+                    0))
+        return 0;
+
+    struct kvm_coalesced_mmio_zone zone = {
+        .addr = addr,
+        .size = len,
+        .pio = pio,
+    };
+    if (ioctl(v->vm_fd, request, &zone) < 0)
+        return throw_err("Failed to %scoalesce writes to 0x%llx",
+                         request == KVM_REGISTER_COALESCED_MMIO ? "" : "un",
+                         (unsigned long long) addr);
+    return 0;
+}
+
+/* Let KVM queue guest writes to [addr, addr + len) instead of exiting. Only
+ * for registers whose writes have no effect the guest can observe before
+ * its next exit, since that is when they are replayed. A no-op when KVM
+ * cannot coalesce.
+ */
+int vm_coalesce_io(vm_t *v, uint64_t addr, uint32_t len, bool pio)
+{
+    return vm_coalesced_zone(v, KVM_REGISTER_COALESCED_MMIO, addr, len, pio);
+}
+
+/* Make writes to a range registered with vm_coalesce_io exit again. Writes
+ * already queued are replayed at the next exit as before.
+ */
+int vm_uncoalesce_io(vm_t *v, uint64_t addr, uint32_t len, bool pio)
+{
+    return vm_coalesced_zone(v, KVM_UNREGISTER_COALESCED_MMIO, addr, len, pio);
+}
+
 void vm_ioeventfd_register(vm_t *v,
                            int fd,
                            unsigned long long addr,
                            int len,
+                           unsigned long long datamatch,
                            int flags)
 {
     struct kvm_ioeventfd ioeventfd = {
+        .datamatch = datamatch,
         .fd = fd,
         .addr = addr,
         .len = len,
@@ -230,11 +709,20 @@ void vm_ioeventfd_register(vm_t *v,
 
 void vm_exit(vm_t *v)
 {
+    vm_stats_exit(v);
     serial_exit(&v->serial);
     virtio_blk_exit(&v->virtio_blk_dev);
     virtio_net_exit(&v->virtio_net_dev);
+    for (int i = 0; i < v->cfg.nr_vcpus; i++) {
+        munmap(v->vcpus[i].run, v->run_size);
+        close(v->vcpus[i].fd);
+    }
     close(v->kvm_fd);
     close(v->vm_fd);
-    close(v->vcpu_fd);
-    munmap(v->mem, RAM_SIZE);
+    bus_exit(&v->io_bus);
+    bus_exit(&v->mmio_bus);
+    bus_exit(&v->pci.pci_bus);
+    /* Every user of guest RAM is gone by now; stop serving its faults. */
+    uffd_restore_exit(&v->uffd);
+    guest_mem_free(&v->mem);
 }
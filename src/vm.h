@@ -1,15 +1,124 @@
 #pragma once
 
-#define RAM_SIZE (1 << 30)
+#define RAM_SIZE_DEFAULT (1ULL << 30)
 
+/* Guest RAM is one host mapping carved into at most this many memslots: the
+ * range below the 32-bit MMIO hole and, for larger guests, the remainder
+ * relocated above 4 GiB.
+ */
+#define VM_MAX_MEM_REGIONS 2
+
+/* Upper bound for -c/--cpus. x86 MP table APIC IDs are 8-bit and the IOAPIC
+ * takes the ID right after the last vCPU; arm64 GICv2 tops out at 8 CPUs,
+ * which vm_arch_init checks once it knows which GIC it got.
+ */
+#define VM_MAX_VCPUS 64
+
+/* Guest-visible I/O port (reached through the PIO window on arm64) that a
+ * guest writes to ask to be paused, e.g. so that a snapshot captures it
+ * right after init is up.
+ */
+#define PAUSE_PORT 0x0500
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "mem.h"
+#include "numa.h"
 #include "pci.h"
 #include "serial.h"
+#include "stats.h"
+#include "uffd.h"
 #include "virtio-blk.h"
 #include "virtio-net.h"
 
+/* Knobs collected by main() before vm_init. */
+typedef struct {
+    int nr_vcpus;
+    uint64_t ram_size;
+    /* virtio-blk queues; 0 picks one per vCPU. */
+    int blk_queues;
+    /* Descriptors per virtqueue; 0 picks VIRTQ_SIZE. */
+    uint16_t blk_queue_size;
+    uint16_t net_queue_size;
+    /* Serve the disk with blocking pread/pwrite instead of io_uring. */
+    bool disk_sync_io;
+    /* ...or by copying from and to a mapping of the image (implies
+     * disk_sync_io).
+     */
+    bool disk_mmap;
+    /* Whether the disk is opened with O_DIRECT, bypassing the host page
+     * cache.
+     */
+    enum diskimg_cache disk_cache;
+    /* Longest a virtqueue worker spins for requests before it sleeps, in
+     * nanoseconds; 0 never spins.
+     */
+    uint32_t io_poll_ns;
+    /* Punch blocks of zeros the guest writes out of the disk image instead
+     * of writing them.
+     */
+    bool disk_unmap_zeroes;
+    /* Make the disk a copy-on-write overlay of this read-only image. */
+    const char *disk_base;
+    enum mem_backend mem_backend;
+    uint64_t hugepage_size;
+    const char *mem_path;
+    int prefault_threads; /* 0 = fault guest RAM in lazily */
+    /* Map whole pages of the kernel and initrd from their files into guest
+     * RAM instead of copying them (see vm_load_range).
+     */
+    bool map_images;
+    /* Host placement; an empty mask leaves the kernel default alone. */
+    numa_mask_t mem_nodes;
+    enum numa_policy mem_policy;
+    numa_mask_t vcpu_cpus;
+    numa_mask_t io_cpus;
+    /* Stop the VM when the guest writes the pause port (see PAUSE_PORT). */
+    bool guest_pause;
+    /* Take guest RAM and device state from this snapshot instead of booting
+     * a kernel.
+     */
+    const char *snapshot_in;
+    /* Serve snapshot RAM through userfaultfd rather than a file mapping,
+     * prefetching in the order recorded in snapshot_trace.
+     */
+    bool snapshot_uffd;
+    const char *snapshot_trace;
+    /* Set in a fork()ed clone: run on the template's guest RAM. */
+    const struct guest_mem *template_mem;
+    /* Count exits and device accesses; dumped on SIGUSR2 and at exit to
+     * stats_file, or stderr if NULL.
+     */
+    bool stats;
+    const char *stats_file;
+} vm_config_t;
+
+struct vm_mem_region {
+    uint64_t gpa;
+    uint64_t size;
+    void *hva;
+};
+
+typedef struct {
+    int id;
+    int fd;
+    struct kvm_run *run;
+    pthread_t tid;
+    bool thread_started;
+    struct vcpu_stats *stats; /* NULL unless cfg.stats */
+    void *vm;
+} vcpu_t;
+
 typedef struct {
-    int kvm_fd, vm_fd, vcpu_fd;
-    void *mem;
+    int kvm_fd, vm_fd;
+    vm_config_t cfg;
+    vcpu_t vcpus[VM_MAX_VCPUS];
+    int run_size;
+    struct guest_mem mem;
+    struct uffd_restore uffd;
+    struct vm_mem_region mem_regions[VM_MAX_MEM_REGIONS];
+    int nr_mem_regions;
     serial_dev_t serial;
     struct bus mmio_bus;
     struct bus io_bus;
@@ -17,31 +126,72 @@ typedef struct {
     struct diskimg diskimg;
     struct virtio_blk_dev virtio_blk_dev;
     struct virtio_net_dev virtio_net_dev;
+    struct dev pause_dev;
+    /* Serializes device emulation across vCPU threads. Every PIO/MMIO exit
+     * funnels through vm_handle_io/vm_handle_mmio under this lock, so the
+     * emulators (PCI config latch, virtio common config, 16550 registers)
+     * keep their single-threaded assumptions.
+     */
+    pthread_mutex_t io_lock;
+    /* Writes KVM queued for the ranges registered with vm_coalesce_io,
+     * replayed under io_lock before the next exit is handled. NULL if KVM
+     * cannot coalesce.
+     */
+    struct kvm_coalesced_mmio_ring *coalesced_ring;
+    uint32_t coalesced_max;
+    /* Affinity kvm-host started with, handed back to device workers that
+     * would otherwise inherit a single-CPU vCPU pin from their creator.
+     */
+    numa_mask_t host_cpus;
+    bool stopping;
+    bool paused; /* stopped by the guest at its pause point */
+    int exit_code;
+    struct vm_stats *stats; /* NULL unless cfg.stats */
     void *priv;
 } vm_t;
 
 int vm_arch_init(vm_t *v);
-int vm_arch_cpu_init(vm_t *v);
+int vm_arch_cpu_init(vm_t *v, vcpu_t *vcpu);
 int vm_arch_init_platform_device(vm_t *v);
-int vm_arch_load_image(vm_t *v, void *image, size_t size);
-int vm_arch_load_initrd(vm_t *v, void *initrd, size_t size);
+int vm_arch_load_image(vm_t *v, int fd, void *image, size_t size);
+int vm_arch_load_initrd(vm_t *v, int fd, void *initrd, size_t size);
+int vm_arch_save_state(vm_t *v, int fd);
+int vm_arch_restore_state(vm_t *v, int fd);
 
-int vm_init(vm_t *v);
+int vm_init(vm_t *v, const vm_config_t *cfg);
 int vm_load_image(vm_t *v, const char *image_path);
 int vm_load_initrd(vm_t *v, const char *initrd_path);
+int vm_load_range(vm_t *v,
+                  void *dest,
+                  int fd,
+                  const void *data,
+                  size_t offset,
+                  size_t len);
 int vm_load_diskimg(vm_t *v, const char *diskimg_file);
 int vm_late_init(vm_t *v);
 int vm_enable_net(vm_t *v);
 int vm_run(vm_t *v);
+void vm_stop(vm_t *v, int exit_code);
+int vm_snapshot_save(vm_t *v, int fd);
+int vm_snapshot_map_ram(vm_t *v);
+int vm_snapshot_restore(vm_t *v);
+int vm_snapshot_save_state(vm_t *v, int fd);
+int vm_stats_init(vm_t *v);
+void vm_stats_dump(vm_t *v);
+void vm_stats_exit(vm_t *v);
 int vm_irq_line(vm_t *v, int irq, int level);
 void *vm_guest_to_host(vm_t *v, uint64_t guest);
 void *vm_guest_buf(vm_t *v, uint64_t guest, size_t len);
 void vm_irqfd_register(vm_t *v, int fd, int gsi, int flags);
+int vm_coalesce_io(vm_t *v, uint64_t addr, uint32_t len, bool pio);
+int vm_uncoalesce_io(vm_t *v, uint64_t addr, uint32_t len, bool pio);
 void vm_ioeventfd_register(vm_t *v,
                            int fd,
                            unsigned long long addr,
                            int len,
+                           unsigned long long datamatch,
                            int flags);
+void vm_pin_io_thread(vm_t *v, pthread_t tid);
 void vm_handle_io(vm_t *v, struct kvm_run *run);
 void vm_handle_mmio(vm_t *v, struct kvm_run *run);
 void vm_exit(vm_t *v);